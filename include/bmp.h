@@ -32,11 +32,17 @@ struct bitmap {
 	/* Dimesions of the bitmap */
 	int w, h;	
 	
-	/* The actual pixel data in RGBA format */
+	/* The actual pixel data in RGBA format. The colours are 
+	 * premultiplied by their alpha */
 	unsigned char *data;
+	
+	/* Bytes from the start of one row of data to the next;
+	 * It is w * 4 unless the bitmap is a view. See bm_view() */
+	int stride;
 		
-	/* Color for the pen, of the canvas */
-	int r,g,b,a;
+	/* Color for the pen, of the canvas.
+	 * It is packed like the pixels in data; See bm_get_pixel() */
+	unsigned int color;
 	
 	/* XBM font. See font.xbm */
 	const unsigned char *font;
@@ -52,6 +58,37 @@ struct bitmap {
 		int x0, y0;
 		int x1, y1;
 	} clip;
+	
+	/* Areas modified since the last bm_dirty_reset(), or NULL
+	 * if they aren't being tracked. See bm_dirty_track() */
+	struct bm_dirty *dirty;
+	
+	/* Drawing commands waiting for bm_flush(), or NULL if drawing
+	 * on the bitmap isn't deferred. See bm_defer() */
+	struct bm_cmdlist *cmds;
+	
+	/* A combination of the enum bm_flags values */
+	unsigned int flags;
+	
+	/* The bitmap whose pixels a view shares, or NULL if the bitmap 
+	 * owns its pixels. See bm_view() */
+	struct bitmap *parent;
+};
+
+/*@ enum bm_flags
+ *# Flags in a {{struct bitmap}}'s {{flags}} field:
+ *{
+ ** {{BM_ALPHA_MASK}} - The mask is in the alpha channel; Masked blits 
+ *#   skip the pixels whose alpha is 0 instead of those that match the 
+ *#   bitmap colour. Set by {{bm_mask_alpha()}}.
+ ** {{BM_BLEND_KEY}} - {{bm_blit_alpha()}} skips the pixels that match the 
+ *#   bitmap colour, like {{bm_maskedblit()}}. Without it only the alpha
+ *#   channel decides how much of a pixel is drawn.
+ *}
+ */
+enum bm_flags {
+	BM_ALPHA_MASK = 0x01,
+	BM_BLEND_KEY = 0x02
 };
 
 /*@ struct bitmap *bm_create(int w, int h)
@@ -64,10 +101,30 @@ struct bitmap *bm_create(int w, int h);
  */
 void bm_free(struct bitmap *b);
 
+/*@ struct bitmap *bm_view(struct bitmap *parent, int x, int y, int w, int h)
+ *# Creates a view of the area of w*h pixels at x,y on {{parent}}: 
+ *# A bitmap that shares the parent's pixels instead of copying them,
+ *# for the frames of a sprite sheet, tiles or split screen viewports.\n
+ *# The area is clipped to the parent. Drawing on the view draws on 
+ *# the parent, clipped to the view, and the view's coordinates are 
+ *# relative to x,y. It starts with the parent's colour and font.\n
+ *# A view of a view is a view of the same parent. Views must be freed 
+ *# with {{bm_free()}} before their parent is. Drawing on a view can't 
+ *# be deferred; See {{bm_defer()}}.\n
+ *# Returns NULL if the area is empty or it runs out of memory.
+ */
+struct bitmap *bm_view(struct bitmap *parent, int x, int y, int w, int h);
+
 /*@ struct bitmap *bm_load(const char *filename)
  *# Loads a bitmap file {{filename}} into a bitmap structure.\n
  *# It tries to detect the file type from the first bytes in the file.
  *# BMP support is always enabled, while PNG support is optional.\n
+ *# Uncompressed 8, 16, 24 and 32-bit BMP files are supported, as are
+ *# 16 and 32-bit BI_BITFIELDS and 8-bit RLE compressed files.\n
+ *# All PNG colour types and bit depths are supported; They are
+ *# converted to 8-bit RGBA. PNG images with an alpha channel (or
+ *# a transparent palette entry) are stored with premultiplied
+ *# alpha, for use with {{bm_blit_alpha()}}.\n
  *# Returns NULL if the file could not be loaded.
  */
 struct bitmap *bm_load(const char *filename);
@@ -110,13 +167,134 @@ void bm_clip(struct bitmap *b, int x0, int y0, int x1, int y1);
  */
 void bm_unclip(struct bitmap *b);
 
+/*@ void bm_dirty_track(struct bitmap *b, int enable)
+ *# Enables (or disables, if {{enable}} is zero) tracking of the
+ *# rectangles of bitmap {{b}} that the drawing functions modify.\n
+ *# The rectangles are bounding boxes, clipped to the clipping
+ *# rectangle, and overlapping ones are merged. Use it to copy only
+ *# the changed parts of the bitmap to the screen.
+ */
+void bm_dirty_track(struct bitmap *b, int enable);
+
+/*@ void bm_dirty_add(struct bitmap *b, int x0, int y0, int x1, int y1)
+ *# Marks the rectangle from {{x0,y0}} (inclusive) to {{x1,y1}} 
+ *# (exclusive) as modified. Use it if you change the bitmap's
+ *# {{data}} directly.
+ */
+void bm_dirty_add(struct bitmap *b, int x0, int y0, int x1, int y1);
+
+/*@ int bm_dirty_count(struct bitmap *b)
+ *# Returns the number of modified rectangles since the last call to
+ *# {{bm_dirty_reset()}}.\n
+ *# If tracking is not enabled, it returns 1, and that rectangle
+ *# covers the entire bitmap.
+ */
+int bm_dirty_count(struct bitmap *b);
+
+/*@ void bm_dirty_get(struct bitmap *b, int i, int *x0, int *y0, int *x1, int *y1)
+ *# Retrieves the {{i}}'th modified rectangle, from {{x0,y0}} 
+ *# (inclusive) to {{x1,y1}} (exclusive), like the clipping rectangle.
+ */
+void bm_dirty_get(struct bitmap *b, int i, int *x0, int *y0, int *x1, int *y1);
+
+/*@ void bm_dirty_reset(struct bitmap *b)
+ *# Clears the list of modified rectangles.
+ */
+void bm_dirty_reset(struct bitmap *b);
+
+/*@ void bm_defer(struct bitmap *b, int enable)
+ *# Enables (or disables, if {{enable}} is zero) deferred drawing on
+ *# bitmap {{b}}: The blits, fills, lines, shapes, text and pixels 
+ *# drawn on it are recorded, along with the pen colour, font and 
+ *# clipping rectangle at the time, and only drawn by {{bm_flush()}}.\n
+ *# With {{-DBM_THREADS}}, {{bm_flush()}} draws the commands on
+ *# horizontal bands of the bitmap in parallel. The result is the same
+ *# as drawing them directly.\n
+ *# Functions that read the bitmap, like {{bm_get_pixel()}}, 
+ *# {{bm_save()}} or blitting from it, flush it first. So does changing
+ *# the pixels of a bitmap that a recorded blit uses as its source, 
+ *# or freeing it. Code that accesses {{data}} directly should 
+ *# call {{bm_flush()}} itself.\n
+ *# Disabling it flushes the pending commands.\n
+ *# It has no effect on views (see {{bm_view()}}); Drawing on a view 
+ *# of a deferred bitmap flushes the bitmap and draws directly.
+ */
+void bm_defer(struct bitmap *b, int enable);
+
+/*@ void bm_flush(struct bitmap *b)
+ *# Draws the commands recorded on a bitmap in deferred mode.
+ *# See {{bm_defer()}}. It does nothing if there are none.
+ */
+void bm_flush(struct bitmap *b);
+
+/*@ struct bm_cmdlist *bm_cmdlist_create(void)
+ *# Creates an empty list of drawing commands, that can be recorded
+ *# once with {{bm_cmdlist_begin()}} and drawn any number of times
+ *# with {{bm_cmdlist_replay()}}.\n
+ *# Before drawing them, the list is planned: Commands that later
+ *# opaque commands ({{bm_clear()}}, {{bm_blit()}} and {{bm_fillrect()}}
+ *# with an opaque pen) hide completely are skipped, and blits are
+ *# moved up to follow earlier blits from the same source where nothing
+ *# in between overlaps them. Like {{bm_flush()}}, the commands are
+ *# drawn on horizontal bands in parallel with {{-DBM_THREADS}}.\n
+ *# The list refers to the bitmaps it blits from and draws what they
+ *# contain at the time of the replay, so they must not be freed
+ *# before the list.
+ */
+struct bm_cmdlist *bm_cmdlist_create(void);
+
+/*@ void bm_cmdlist_free(struct bm_cmdlist *l)
+ *# Deallocates a list of drawing commands, ending the recording first.
+ */
+void bm_cmdlist_free(struct bm_cmdlist *l);
+
+/*@ void bm_cmdlist_begin(struct bm_cmdlist *l, struct bitmap *b)
+ *# Starts recording the drawing commands on bitmap {{b}} into {{l}}
+ *# instead of drawing them, until {{bm_cmdlist_end()}}. The commands
+ *# are appended to the ones already in the list.
+ */
+void bm_cmdlist_begin(struct bm_cmdlist *l, struct bitmap *b);
+
+/*@ void bm_cmdlist_end(struct bm_cmdlist *l)
+ *# Stops recording into {{l}}. Freeing the bitmap being recorded
+ *# does this too.
+ */
+void bm_cmdlist_end(struct bm_cmdlist *l);
+
+/*@ void bm_cmdlist_replay(struct bm_cmdlist *l, struct bitmap *dst)
+ *# Draws the commands in {{l}} on {{dst}}, which need not be the
+ *# bitmap they were recorded on. Each command is clipped to its own
+ *# clipping rectangle and the dimensions of {{dst}}.
+ */
+void bm_cmdlist_replay(struct bm_cmdlist *l, struct bitmap *dst);
+
+/*@ void bm_cmdlist_clear(struct bm_cmdlist *l)
+ *# Removes all the commands from {{l}}.
+ */
+void bm_cmdlist_clear(struct bm_cmdlist *l);
+
+/*@ int bm_cmdlist_count(struct bm_cmdlist *l)
+ *# Returns the number of commands in {{l}}.
+ */
+int bm_cmdlist_count(struct bm_cmdlist *l);
+
+/*@ void bm_cmdlist_dump(struct bm_cmdlist *l, FILE *f)
+ *# Writes the commands in {{l}} with the boxes they can draw in to
+ *# {{f}}, along with how many of them the last replay drew, skipped
+ *# and moved, to help profile the drawing of a frame.
+ */
+void bm_cmdlist_dump(struct bm_cmdlist *l, FILE *f);
+
 /*@ void bm_set(struct bitmap *b, int x, int y, unsigned char R, unsigned char G, unsigned char B)
- *# Sets a pixel at x,y in the bitmap b to the specified R,G,B color
+ *# Sets a pixel at x,y in the bitmap b to the specified R,G,B color,
+ *# with the alpha of the pen, like {{bm_set_a()}}
  */ 
 void bm_set(struct bitmap *b, int x, int y, unsigned char R, unsigned char G, unsigned char B);
 
 /*@ void bm_set_a(struct bitmap *b, int x, int y, unsigned char R, unsigned char G, unsigned char B, unsigned char A)
- *# Sets a pixel at x,y in the bitmap b to the specified R,G,B,A color
+ *# Sets a pixel at x,y in the bitmap b to the specified R,G,B,A color.\n
+ *# R,G,B is a plain colour; It is premultiplied by A when it is
+ *# stored, so {{bm_getr()}} and friends return the premultiplied values
  */ 
 void bm_set_a(struct bitmap *b, int x, int y, unsigned char R, unsigned char G, unsigned char B, unsigned char A);
 
@@ -140,16 +318,40 @@ unsigned char bm_getb(struct bitmap *b, int x, int y);
  */
 unsigned char bm_geta(struct bitmap *b, int x, int y);
 
+/*@ unsigned int bm_get_pixel(struct bitmap *b, int x, int y)
+ *# Retrieves the pixel at x,y in bitmap b as a packed 32-bit value.\n
+ *# The value is in the bitmap's memory layout: The bytes R,G,B,A
+ *# in that order in memory, so its numeric value depends on the 
+ *# byte order of the platform. Use it to copy and compare pixels,
+ *# not to extract components.
+ */
+unsigned int bm_get_pixel(struct bitmap *b, int x, int y);
+
+/*@ void bm_set_pixel(struct bitmap *b, int x, int y, unsigned int c)
+ *# Sets the pixel at x,y in bitmap b to the packed value c,
+ *# as returned by bm_get_pixel(). Its colour must already be 
+ *# premultiplied by its alpha.
+ */
+void bm_set_pixel(struct bitmap *b, int x, int y, unsigned int c);
+
 /*@ void bm_set_color(struct bitmap *bc, int r, int g, int b)
  *# Sets the colour of the pen to (r,g,b)
  */
 void bm_set_color(struct bitmap *bm, int r, int g, int b);
 
 /*@ void bm_set_alpha(struct bitmap *bm, int a)
- *# Sets the alpha value of the pen to {{a}}
+ *# Sets the alpha value of the pen to {{a}}\n
+ *# If {{a}} is less than 255, {{bm_fillrect()}}, the other filled
+ *# shapes and the text functions blend the pen with the bitmap 
+ *# instead of overwriting the pixels.
  */
 void bm_set_alpha(struct bitmap *bm, int a);
 
+/*@ int bm_get_alpha(struct bitmap *bm)
+ *# Gets the alpha value of the pen
+ */
+int bm_get_alpha(struct bitmap *bm);
+
 /*@ void bm_set_color_s(struct bitmap *bm, const char *text)
  *# Sets the colour of the pen to a colour represented by text.
  *# The text can be in the HTML format, like #RRGGBB or one of
@@ -231,22 +433,272 @@ void bm_blit(struct bitmap *dst, int dx, int dy, struct bitmap *src, int sx, int
  */
 void bm_maskedblit(struct bitmap *dst, int dx, int dy, struct bitmap *src, int sx, int sy, int w, int h);
 
-/*@ void bm_blit_ex(struct bitmap *dst, int dx, int dy, int dw, int dh, struct bitmap *src, int sx, int sy, int sw, int sh, int mask)
+/*@ void bm_mask_alpha(struct bitmap *b)
+ *# Bakes the mask colour of {{b}} into its alpha channel: The pixels
+ *# that match the bitmap colour become transparent (all four components 
+ *# are set to 0) and {{BM_ALPHA_MASK}} is set in {{b->flags}}.\n
+ *# From then on {{bm_maskedblit()}} and the other masked blits test 
+ *# the alpha of the pixels only, so the bitmap colour can be used as 
+ *# a pen again. The pixels keep their alpha otherwise, so the 
+ *# transparent pixels of PNG images stay transparent.\n
+ *# It can't be undone; Calling it again with a different colour 
+ *# makes the pixels of that colour transparent as well.
+ */
+void bm_mask_alpha(struct bitmap *b);
+
+/*@ void bm_blit_alpha(struct bitmap *dst, int dx, int dy, struct bitmap *src, int sx, int sy, int w, int h, int alpha)
+ *# Blends an area of w*h pixels at sx,sy on the src bitmap over 
+ *# dx,dy on the dst bitmap, using the alpha channel of src.\n
+ *# The src pixels must have premultiplied alpha, like the PNG images
+ *# loaded through {{bm_load()}}. {{alpha}} (0-255) is the opacity 
+ *# of the whole area, for fades.\n
+ *# If {{BM_BLEND_KEY}} is set in {{src->flags}}, pixels that match the 
+ *# src bitmap colour are not blitted, like in {{bm_maskedblit()}}.
+ */
+void bm_blit_alpha(struct bitmap *dst, int dx, int dy, struct bitmap *src, int sx, int sy, int w, int h, int alpha);
+
+/*@ struct bm_rle
+ *# A "compiled" masked area of a bitmap. The pixels that don't
+ *# match the mask colour are stored as runs of opaque pixels, so that
+ *# blitting it doesn't have to test every pixel against the mask.\n
+ *# It is meant for bitmaps that don't change after they've been 
+ *# loaded, like tilesets. Changes to the bitmap or its mask colour
+ *# afterwards are not reflected in the {{bm_rle}}.
+ */
+struct bm_rle;
+
+/*@ struct bm_rle *bm_rle_create(struct bitmap *b, int sx, int sy, int w, int h)
+ *# Compiles the area of w*h pixels at sx,sy on the bitmap {{b}}, using
+ *# the bitmap's colour as the mask colour.\n
+ *# Returns {{NULL}} if it runs out of memory.
+ */
+struct bm_rle *bm_rle_create(struct bitmap *b, int sx, int sy, int w, int h);
+
+/*@ void bm_rle_free(struct bm_rle *r)
+ *# Destroys a {{bm_rle}} previously created with {{bm_rle_create()}}
+ */
+void bm_rle_free(struct bm_rle *r);
+
+/*@ void bm_rle_blit(struct bitmap *dst, int dx, int dy, struct bm_rle *src, int sx, int sy, int w, int h)
+ *# Blits an area of w*h pixels at sx,sy of the compiled bitmap {{src}} to 
+ *# dx,dy on the dst bitmap. The coordinates sx,sy are relative to the area
+ *# that was compiled.\n
+ *# The result is the same as {{bm_maskedblit()}} on the original bitmap.
+ */
+void bm_rle_blit(struct bitmap *dst, int dx, int dy, struct bm_rle *src, int sx, int sy, int w, int h);
+
+/*@ struct bm_sprite
+ *# A sprite: The area of w*h pixels at x,y on the bitmap {{bmp}},
+ *# typically a page of a {{bm_atlas}}. {{color}} is the sprite's mask
+ *# colour, which it can't keep in the shared bitmap; Set the bitmap's
+ *# colour to it before a masked blit. Likewise {{flags}} holds the 
+ *# sprite's {{BM_BLEND_KEY}} flag.\n
+ *# Use {{bm_sprite_clip()}} to turn the sprite's coordinates into
+ *# the bitmap's for {{bm_blit()}} and the other blit functions.
+ */
+struct bm_sprite {
+	struct bitmap *bmp;
+	int x, y, w, h;
+	unsigned int color, flags;
+};
+
+/*@ struct bm_atlas
+ *# A set of pages, bitmaps that small bitmaps are packed into, so
+ *# that sprites drawn together are close together in memory.
+ */
+struct bm_atlas;
+
+/*@ struct bm_atlas *bm_atlas_create(int w, int h)
+ *# Creates an empty atlas whose pages are {{w}} by {{h}} pixels.
+ *# Pages are only created when they are needed.
+ */
+struct bm_atlas *bm_atlas_create(int w, int h);
+
+/*@ void bm_atlas_free(struct bm_atlas *a)
+ *# Destroys an atlas and its pages, and with them all its sprites.
+ */
+void bm_atlas_free(struct bm_atlas *a);
+
+/*@ int bm_atlas_add(struct bm_atlas *a, struct bitmap *b, struct bm_sprite *s)
+ *# Copies bitmap {{b}} into a page of atlas {{a}}, and fills in {{s}}
+ *# with where it went. {{b}} can be freed afterwards.\n
+ *# Returns 0 if {{b}} is too big for a page (it needs a pixel of
+ *# border on every side) or it runs out of memory. It also returns 0
+ *# if {{b}}'s mask is in its alpha channel (see {{bm_mask_alpha()}}), 
+ *# since the pages are masked by colour.
+ */
+int bm_atlas_add(struct bm_atlas *a, struct bitmap *b, struct bm_sprite *s);
+
+/*@ int bm_atlas_pages(struct bm_atlas *a)
+ *# Returns the number of pages in atlas {{a}}.
+ */
+int bm_atlas_pages(struct bm_atlas *a);
+
+/*@ int bm_sprite_clip(const struct bm_sprite *s, int *dx, int *dy, int *sx, int *sy, int *w, int *h)
+ *# Clips the area of w*h pixels at sx,sy of sprite {{s}}, to be drawn
+ *# at dx,dy, to the sprite, and turns sx,sy into coordinates on
+ *# {{s->bmp}}, so that a blit doesn't draw the neighbouring sprites.\n
+ *# Returns 0 if there is nothing left to draw.
+ *X if(bm_sprite_clip(s, &dx, &dy, &sx, &sy, &w, &h))
+ *X     bm_maskedblit(screen, dx, dy, s->bmp, sx, sy, w, h);
+ */
+int bm_sprite_clip(const struct bm_sprite *s, int *dx, int *dy, int *sx, int *sy, int *w, int *h);
+
+/*@ struct bm_indexed
+ *# An 8-bit indexed bitmap: Every pixel is an index into a palette
+ *# of 256 colours, packed the same way as the pixels of a {{bitmap}}.\n
+ *# Blits between indexed bitmaps move a quarter of the memory of 
+ *# RGBA blits, and palette effects like colour cycling and fades
+ *# only touch the 256 palette entries. The palette is applied when the 
+ *# indexed bitmap is drawn onto a {{bitmap}} with {{bm_indexed_resolve()}}.\n
+ *# {{mask}} is the index that {{bm_indexed_maskedblit()}} skips.
+ */
+struct bm_indexed {
+	int w, h;
+	unsigned char *data;
+	unsigned int palette[256];
+	int mask;
+};
+
+/*@ struct bm_indexed *bm_indexed_create(int w, int h)
+ *# Creates an indexed bitmap of w*h pixels. All pixels, the palette
+ *# and the mask are 0.\n
+ *# Returns {{NULL}} if it runs out of memory.
+ */
+struct bm_indexed *bm_indexed_create(int w, int h);
+
+/*@ struct bm_indexed *bm_indexed_from_bitmap(struct bitmap *b)
+ *# Converts the bitmap {{b}} to an indexed bitmap. The palette 
+ *# contains the exact colours of {{b}}, in the order they're found, and
+ *# the mask is the index of the bitmap's colour. If no pixel has that
+ *# colour, it is added to the palette for the mask.\n
+ *# Returns {{NULL}} if {{b}} has more than 256 distinct colours, counting
+ *# the mask colour, or if it runs out of memory.
+ */
+struct bm_indexed *bm_indexed_from_bitmap(struct bitmap *b);
+
+/*@ void bm_indexed_free(struct bm_indexed *b)
+ *# Destroys an indexed bitmap.
+ */
+void bm_indexed_free(struct bm_indexed *b);
+
+/*@ void bm_indexed_set_color(struct bm_indexed *b, int i, int R, int G, int B)
+ *# Sets the palette entry {{i}} (0-255) of the indexed bitmap.
+ */
+void bm_indexed_set_color(struct bm_indexed *b, int i, int R, int G, int B);
+
+/*@ void bm_indexed_clear(struct bm_indexed *b, int i)
+ *# Sets all the pixels of the indexed bitmap to the index {{i}}.
+ */
+void bm_indexed_clear(struct bm_indexed *b, int i);
+
+/*@ void bm_indexed_fillrect(struct bm_indexed *b, int x0, int y0, int x1, int y1, int i)
+ *# Fills the rectangle from x0,y0 to x1,y1 (inclusive) with the index {{i}}.
+ */
+void bm_indexed_fillrect(struct bm_indexed *b, int x0, int y0, int x1, int y1, int i);
+
+/*@ void bm_indexed_blit(struct bm_indexed *dst, int dx, int dy, struct bm_indexed *src, int sx, int sy, int w, int h)
+ *# Copies the indices in the area of w*h pixels at sx,sy on {{src}} 
+ *# to dx,dy on {{dst}}. The palettes aren't touched, so the two 
+ *# bitmaps would normally share one.
+ */
+void bm_indexed_blit(struct bm_indexed *dst, int dx, int dy, struct bm_indexed *src, int sx, int sy, int w, int h);
+
+/*@ void bm_indexed_maskedblit(struct bm_indexed *dst, int dx, int dy, struct bm_indexed *src, int sx, int sy, int w, int h)
+ *# Like {{bm_indexed_blit()}}, but pixels that are equal to the mask index
+ *# of {{src}} are not copied.
+ */
+void bm_indexed_maskedblit(struct bm_indexed *dst, int dx, int dy, struct bm_indexed *src, int sx, int sy, int w, int h);
+
+/*@ void bm_indexed_cycle(struct bm_indexed *b, int first, int last, int steps)
+ *# Rotates the palette entries {{first}} to {{last}} (inclusive) by {{steps}} 
+ *# positions: Entry {{first}} moves to {{first + steps}} and the entries 
+ *# that fall off the end wrap around to {{first}}. Negative steps rotate 
+ *# the other way.
+ */
+void bm_indexed_cycle(struct bm_indexed *b, int first, int last, int steps);
+
+/*@ void bm_indexed_fade(struct bm_indexed *b, const unsigned int *from, int R, int G, int B, int amount)
+ *# Sets the palette of {{b}} to the 256 colours in {{from}} faded 
+ *# towards the colour R,G,B. {{amount}} goes from 0 (the colours in {{from}})
+ *# to 255 (all entries R,G,B).\n
+ *# {{from}} is normally a copy of the palette taken before the fade started.
+ */
+void bm_indexed_fade(struct bm_indexed *b, const unsigned int *from, int R, int G, int B, int amount);
+
+/*@ void bm_indexed_resolve(struct bitmap *dst, int dx, int dy, struct bm_indexed *src)
+ *# Draws the indexed bitmap {{src}} at dx,dy on the bitmap {{dst}} through
+ *# its palette. The pixels are copied as they are, without blending.
+ */
+void bm_indexed_resolve(struct bitmap *dst, int dx, int dy, struct bm_indexed *src);
+
+/*@ void bm_indexed_draw(struct bitmap *dst, int dx, int dy, struct bm_indexed *src, int sx, int sy, int w, int h)
+ *# Draws the area of w*h pixels at sx,sy on the indexed bitmap {{src}}
+ *# at dx,dy on the bitmap {{dst}} through its palette, like
+ *# {{bm_indexed_resolve()}}, but the pixels equal to the mask index of
+ *# {{src}} are not drawn. Use it to draw tiles and sprites of an
+ *# indexed sheet, so that palette effects show on the next frame.
+ */
+void bm_indexed_draw(struct bitmap *dst, int dx, int dy, struct bm_indexed *src, int sx, int sy, int w, int h);
+
+/*@ enum bm_blit_flags
+ *# Flags for {{bm_blit_ex()}}:
+ *{
+ ** {{BM_BLIT_MASK}} - Pixels on the src bitmap that matches the src bitmap colour are not blitted.
+ ** {{BM_BLIT_BILINEAR}} - Smooths the scaled image with a bilinear filter.
+ ** {{BM_BLIT_FLIP_H}} - Mirrors the image horizontally, so that a sprite faces the other way.
+ ** {{BM_BLIT_FLIP_V}} - Mirrors the image vertically.
+ *}
+ *# Use {{bm_blit_ex()}} with the same source and destination size to
+ *# flip a plain or masked blit.
+ */
+enum bm_blit_flags {
+	BM_BLIT_MASK = 0x01,
+	BM_BLIT_BILINEAR = 0x02,
+	BM_BLIT_FLIP_H = 0x04,
+	BM_BLIT_FLIP_V = 0x08
+};
+
+/*@ void bm_blit_ex(struct bitmap *dst, int dx, int dy, int dw, int dh, struct bitmap *src, int sx, int sy, int sw, int sh, int flags)
  *# Extended blit function. Blits an area of sw*sh pixels at sx,sy from the {{src}} bitmap to 
  *# dx,dy on the {{dst}} bitmap into an area of dw*dh pixels, stretching or shrinking the blitted area as neccessary.
- *# If {{mask}} is non-zero, pixels on the src bitmap that matches the src bitmap colour are not blitted.
+ *# {{flags}} is a combination of the {{enum bm_blit_flags}} values;
+ *# For compatibility, a {{flags}} of 1 masks the blit as before.\n
+ *# If the area isn't scaled, it is as fast as {{bm_blit()}} or 
+ *# {{bm_maskedblit()}}, also when it is flipped.
+ */
+void bm_blit_ex(struct bitmap *dst, int dx, int dy, int dw, int dh, struct bitmap *src, int sx, int sy, int sw, int sh, int flags);
+
+/*@ void bm_blit_rotozoom(struct bitmap *dst, int cx, int cy, struct bitmap *src, int sx, int sy, int sw, int sh, double angle, double scale, int flags)
+ *# Blits the area of sw*sh pixels at sx,sy from the {{src}} bitmap to the {{dst}}
+ *# bitmap, rotated by {{angle}} degrees clockwise and scaled by {{scale}}, with
+ *# the centre of the area at cx,cy.\n
+ *# {{flags}} is a combination of the {{enum bm_blit_flags}} values, as for
+ *# {{bm_blit_ex()}}. The flips are applied before the rotation.\n
+ *# The time it takes depends on the area it draws, so there is no need to keep
+ *# a rotated copy of a sprite for every angle.
  */
-void bm_blit_ex(struct bitmap *dst, int dx, int dy, int dw, int dh, struct bitmap *src, int sx, int sy, int sw, int sh, int mask);
+void bm_blit_rotozoom(struct bitmap *dst, int cx, int cy, struct bitmap *src, int sx, int sy, int sw, int sh, double angle, double scale, int flags);
 
 /*@ void bm_smooth(struct bitmap *b)
- *# Smoothes the bitmap by essentially applying a 3x3 median filter.
+ *# Smoothes the bitmap by applying a 3x3 box filter
+ *# (each pixel becomes the average of itself and its neighbours).
  */
 void bm_smooth(struct bitmap *b);
 
+/*@ void bm_median(struct bitmap *b)
+ *# Applies a 3x3 median filter to the bitmap, which removes 
+ *# noise while keeping edges sharp. Each component is filtered 
+ *# separately.
+ */
+void bm_median(struct bitmap *b);
+
 /*@ struct bitmap *bm_resample(const struct bitmap *in, int nw, int nh)
  *# Creates a new bitmap of dimensions nw*nh that is a scaled
- *# (linearly resampled) version of the input bitmap. 
- *# The input bimap remains untouched.
+ *# version of the input bitmap. Enlarged bitmaps are interpolated
+ *# bilinearly and reduced bitmaps are area averaged.
+ *# The input bimap remains untouched.\n
+ *# It returns NULL if the memory can't be allocated.
  */
 struct bitmap *bm_resample(const struct bitmap *in, int nw, int nh);
 
@@ -255,6 +707,28 @@ struct bitmap *bm_resample(const struct bitmap *in, int nw, int nh);
  */
 void bm_swap_colour(struct bitmap *b, unsigned char sR, unsigned char sG, unsigned char sB, unsigned char dR, unsigned char dG, unsigned char dB);
 
+/*@ void bm_remap_colours(struct bitmap *b, int n, const unsigned int *src, const unsigned int *dst)
+ *# Replaces the pixels of colour {{src[i]}} in bitmap b with the colour
+ *# {{dst[i]}}, for the {{n}} colours in the arrays, in a single pass.
+ *# The colours are {{0xRRGGBB}} integers, like {{bm_set_color_i()}}'s.
+ *# The alpha of the pixels is kept.\n
+ *# Every pixel is replaced at most once, so colours can be swapped:
+ *# {{src = {RED, BLUE}, dst = {BLUE, RED}}}.
+ */
+void bm_remap_colours(struct bitmap *b, int n, const unsigned int *src, const unsigned int *dst);
+
+/*@ struct bitmap *bm_remap_variant(struct bitmap *b, int id, int n, const unsigned int *src, const unsigned int *dst)
+ *# Returns a copy of {{b}} with its colours remapped through
+ *# {{bm_remap_colours()}}, for recoloured sprites like team colours.\n
+ *# The copies are cached by {{b}} and the palette {{id}}, so asking
+ *# for the same {{id}} again returns the same copy without looking at
+ *# {{src}} and {{dst}}. The cache owns the copies: They are freed
+ *# along with {{b}}, and changes to {{b}} after the copy is made
+ *# aren't reflected in it.\n
+ *# Returns {{NULL}} if it runs out of memory.
+ */
+struct bitmap *bm_remap_variant(struct bitmap *b, int id, int n, const unsigned int *src, const unsigned int *dst);
+
 /*@ int bm_width(struct bitmap *b)
  *# Retrieves the width of the bitmap {{b}}
  */
@@ -280,13 +754,22 @@ void bm_putpixel(struct bitmap *b, int x, int y);
  */
 void bm_line(struct bitmap *b, int x0, int y0, int x1, int y1);
 
+/*@ void bm_polyline(struct bitmap *b, const int *points, int n)
+ *# Draws lines through the {{n}} points in {{points}} using the 
+ *# colour of the pen. {{points}} contains {{n}} pairs of <x,y>
+ *# coordinates: {{x0, y0, x1, y1, ...}}
+ */
+void bm_polyline(struct bitmap *b, const int *points, int n);
+
 /*@ void bm_rect(struct bitmap *b, int x0, int y0, int x1, int y1)
  *# Draws a rectangle from <x0,y0> to <x1,y1> using the pen colour
  */
 void bm_rect(struct bitmap *b, int x0, int y0, int x1, int y1);
 
 /*@ void bm_fillrect(struct bitmap *b, int x0, int y0, int x1, int y1)
- *# Draws a filled rectangle from <x0,y0> to <x1,y1> using the pen colour
+ *# Draws a filled rectangle from <x0,y0> to <x1,y1> using the pen colour.\n
+ *# The rectangle is blended with the bitmap if the pen's alpha is 
+ *# less than 255. See {{bm_set_alpha()}}
  */
 void bm_fillrect(struct bitmap *b, int x0, int y0, int x1, int y1);
 
@@ -306,7 +789,11 @@ void bm_fillcircle(struct bitmap *b, int x0, int y0, int r);
  */
 void bm_ellipse(struct bitmap *b, int x0, int y0, int x1, int y1);
 
-/* MISSING: bm_fillellipse */
+/*@ void bm_fillellipse(struct bitmap *b, int x0, int y0, int x1, int y1)
+ *# Draws a filled ellipse that occupies the rectangle from <x0,y0> to 
+ *# <x1,y1>, using the pen colour
+ */
+void bm_fillellipse(struct bitmap *b, int x0, int y0, int x1, int y1);
 
 /*@ void bm_round_rect(struct bitmap *b, int x0, int y0, int x1, int y1, int r)
  *# Draws a rect from <x0,y0> to <x1,y1> using the pen colour with rounded corners 
@@ -328,8 +815,8 @@ void bm_bezier3(struct bitmap *b, int x0, int y0, int x1, int y1, int x2, int y2
 /*@ void bm_fill(struct bitmap *b, int x, int y)
  *# Floodfills from <x,y> using the pen colour.\n
  *# The colour of the pixel at <x,y> is used as the source colour.
- *# The colour of the pen is used as the target colour.
- *N The function does not take the clipping into account.
+ *# The colour of the pen is used as the target colour.\n
+ *# The fill stays inside the clipping rectangle.
  */
 void bm_fill(struct bitmap *b, int x, int y);
 
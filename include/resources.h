@@ -14,6 +14,28 @@ struct ini_file *re_get_ini(const char *filename);
 
 struct bitmap *re_get_bmp(const char *filename);
 
+/* Sprites from re_get_sprite() that are at most max_size pixels wide
+ * and high are packed into atlas pages of page_size pixels square.
+ * A max_size of 0 (the default) turns the atlas off. */
+void re_atlas_setup(int max_size, int page_size);
+
+/* Like re_get_bmp(), but small bitmaps are packed into a shared atlas
+ * page; Blit the sprite's area of sprite->bmp. See struct bm_sprite */
+struct bm_sprite *re_get_sprite(const char *filename);
+
+/* Frees the atlas pages and the sprites in them, so that the next
+ * state packs only the ones it uses. Called on a state change. */
+void re_atlas_reset();
+
+/* If alpha is set, re_mask_alpha() bakes the mask colour of bitmaps 
+ * into their alpha channel, so that masked blits only test the alpha. 
+ * It is off by default. */
+void re_mask_setup(int alpha);
+
+/* Called after the mask colour of a bitmap is set. 
+ * See bm_mask_alpha() */
+void re_mask_alpha(struct bitmap *bmp);
+
 #ifdef _SDL_MIXER_H
 Mix_Chunk *re_get_wav(const char *filename);
 Mix_Music *re_get_mus(const char *filename);
@@ -21,6 +21,15 @@ struct tileset {
 	
 	int nmeta;
 	struct tile_meta *meta;
+	
+	/* Compiled tiles for faster rendering. See ts_compile() */
+	int ntiles;
+	struct bm_rle **tiles;
+	
+	/* The tileset as an indexed bitmap that map_render() draws
+	 * instead, and its palette as it was loaded. See ts_index() */
+	struct bm_indexed *ibm;
+	unsigned int palette[256];
 };
 
 struct tile_collection {
@@ -60,6 +69,23 @@ struct json; /* see json.h */
 int ts_read_all(struct tile_collection *tc, struct json *j);
 
 int ts_valid_class(const char *clas);
+
+/* Compiles each tile of the tileset t into a struct bm_rle 
+ * so that map_render() can draw it without testing the mask
+ * colour of every pixel. The tileset's bitmap and mask colour 
+ * should not change afterwards. */
+int ts_compile(struct tile_collection *tc, struct tileset *t);
+
+/* If indexed is set, tilesets of at most 256 colours are converted
+ * to indexed bitmaps when they're loaded, so that palette cycling
+ * and fades apply to every tile on the map at once. It is off by 
+ * default. */
+void ts_index_setup(int indexed);
+
+/* Converts the tileset t to an indexed bitmap, which map_render()
+ * then draws instead of the compiled tiles. Returns 0 if it has 
+ * more than 256 colours. */
+int ts_index(struct tileset *t);
  
 #if defined(__cplusplus) || defined(c_plusplus)
 } /* extern "C" */
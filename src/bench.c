@@ -0,0 +1,579 @@
+/*
+ * Microbenchmarks for the bitmap module (bmp.c).
+ *
+ * The benchmark doesn't depend on SDL or Lua, so it can be
+ * built on its own with `make bench` in the src/ directory.
+ *
+ * Usage: bench [-c | -j] [width height ...]
+ * where each width and height is the size of a virtual screen
+ * to draw on (320x240 by default). The results are printed as
+ * a table, or with -c as CSV and with -j as JSON, to compare
+ * builds with each other.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bmp.h"
+
+/* Minimum time (in seconds) to spend on each benchmark */
+#define MIN_TIME	0.25
+
+static struct bitmap *screen;
+
+typedef void (*bench_fun)(struct bitmap *src, long i);
+
+/* Creates a sprite of random colours where the area outside 
+ * the inscribed ellipse is the mask colour #FF00FF */
+static struct bitmap *make_sprite(int w, int h) {
+	int x, y;
+	struct bitmap *b = bm_create(w, h);
+	for(y = 0; y < h; y++) {
+		for(x = 0; x < w; x++) {
+			double ex = (2.0 * x + 1 - w) / w, ey = (2.0 * y + 1 - h) / h;
+			if(ex * ex + ey * ey > 1.0)
+				bm_set_a(b, x, y, 0xFF, 0x00, 0xFF, 0xFF);
+			else
+				bm_set_a(b, x, y, rand() & 0xFF, rand() & 0xFF, rand() & 0xFF, 0xFF);
+		}
+	}
+	bm_set_color_s(b, "#FF00FF");
+	return b;
+}
+
+/* Moves the blits around the screen without clipping them */
+static int pos_x(struct bitmap *src, long i) {
+	return (i * 7) % (screen->w - src->w + 1);
+}
+
+static int pos_y(struct bitmap *src, long i) {
+	return (i * 13) % (screen->h - src->h + 1);
+}
+
+static void do_blit(struct bitmap *src, long i) {
+	bm_blit(screen, pos_x(src, i), pos_y(src, i), src, 0, 0, src->w, src->h);
+}
+
+static void do_maskedblit(struct bitmap *src, long i) {
+	bm_maskedblit(screen, pos_x(src, i), pos_y(src, i), src, 0, 0, src->w, src->h);
+}
+
+/* Sprites facing the other way */
+static void do_blit_flip(struct bitmap *src, long i) {
+	bm_blit_ex(screen, pos_x(src, i), pos_y(src, i), src->w, src->h, src, 0, 0, src->w, src->h, BM_BLIT_FLIP_H);
+}
+
+static void do_maskedblit_flip(struct bitmap *src, long i) {
+	bm_blit_ex(screen, pos_x(src, i), pos_y(src, i), src->w, src->h, src, 0, 0, src->w, src->h, BM_BLIT_MASK | BM_BLIT_FLIP_H);
+}
+
+/* Moves the blits half past each of the screen's edges in turn; 
+ * The rate is still in terms of the whole sprite */
+static int clip_x(struct bitmap *src, long i) {
+	switch(i & 3) {
+		case 0: return -src->w / 2;
+		case 1: return screen->w - src->w / 2;
+		default: return pos_x(src, i);
+	}
+}
+
+static int clip_y(struct bitmap *src, long i) {
+	switch(i & 3) {
+		case 2: return -src->h / 2;
+		case 3: return screen->h - src->h / 2;
+		default: return pos_y(src, i);
+	}
+}
+
+static void do_blit_clipped(struct bitmap *src, long i) {
+	bm_blit(screen, clip_x(src, i), clip_y(src, i), src, 0, 0, src->w, src->h);
+}
+
+static void do_maskedblit_clipped(struct bitmap *src, long i) {
+	bm_maskedblit(screen, clip_x(src, i), clip_y(src, i), src, 0, 0, src->w, src->h);
+}
+
+static void do_blit_alpha(struct bitmap *src, long i) {
+	bm_blit_alpha(screen, pos_x(src, i), pos_y(src, i), src, 0, 0, src->w, src->h, 192);
+}
+
+/* Zooms a quarter of the sprite to twice its size, so that
+ * the pixels drawn are the same as for the other benchmarks */
+static void do_blit_ex(struct bitmap *src, long i) {
+	bm_blit_ex(screen, 0, 0, src->w, src->h, src, i % 8, 0, src->w / 2, src->h / 2, BM_BLIT_MASK);
+}
+
+static void do_blit_ex_bilinear(struct bitmap *src, long i) {
+	bm_blit_ex(screen, 0, 0, src->w, src->h, src, i % 8, 0, src->w / 2, src->h / 2, BM_BLIT_MASK | BM_BLIT_BILINEAR);
+}
+
+/* Turns the sprite a few degrees more every time around the middle of
+ * the screen. Rotation keeps the area, so it draws about as many 
+ * pixels as the sprite has, less what falls off the screen */
+static void do_rotozoom(struct bitmap *src, long i) {
+	bm_blit_rotozoom(screen, screen->w / 2, screen->h / 2, src, 0, 0, src->w, src->h, (i % 360) + 0.5, 1.0, BM_BLIT_MASK);
+}
+
+static void do_rotozoom_bilinear(struct bitmap *src, long i) {
+	bm_blit_rotozoom(screen, screen->w / 2, screen->h / 2, src, 0, 0, src->w, src->h, (i % 360) + 0.5, 1.0, BM_BLIT_MASK | BM_BLIT_BILINEAR);
+}
+
+/* Clears the screen with a colour whose bytes differ, so that
+ * bm_clear() can't fall back to memset() */
+static void do_clear(struct bitmap *src, long i) {
+	bm_set_color(screen, 0x10, 0x20, (int)(i & 0x3F));
+	bm_clear(screen);
+}
+
+static void do_fillrect(struct bitmap *src, long i) {
+	bm_set_color(screen, 0x10, 0x20, (int)(i & 0x3F));
+	bm_fillrect(screen, pos_x(src, i), pos_y(src, i), pos_x(src, i) + src->w - 1, pos_y(src, i) + src->h - 1);
+}
+
+/* The filled shapes are inscribed in the sprite's rectangle,
+ * so the rate is in terms of the bounding box */
+static void do_fillcircle(struct bitmap *src, long i) {
+	int r = src->w / 2;
+	bm_set_color(screen, 0x10, 0x20, (int)(i & 0x3F));
+	bm_fillcircle(screen, pos_x(src, i) + r, pos_y(src, i) + r, r - 1);
+}
+
+static void do_fillellipse(struct bitmap *src, long i) {
+	bm_set_color(screen, 0x10, 0x20, (int)(i & 0x3F));
+	bm_fillellipse(screen, pos_x(src, i), pos_y(src, i), pos_x(src, i) + src->w - 1, pos_y(src, i) + src->h - 1);
+}
+
+/* A line across the screen, and a long line that is mostly
+ * outside of it */
+static void do_line(struct bitmap *src, long i) {
+	bm_set_color(screen, 0x10, 0x20, (int)(i & 0x3F));
+	bm_line(screen, 0, (int)(i % screen->h), screen->w - 1, screen->h - 1 - (int)(i % screen->h));
+}
+
+static void do_line_clipped(struct bitmap *src, long i) {
+	bm_set_color(screen, 0x10, 0x20, (int)(i & 0x3F));
+	bm_line(screen, -100000, (int)(i % screen->h) - 50000, 100000, 50000 - (int)(i % screen->h));
+}
+
+static void do_rect(struct bitmap *src, long i) {
+	bm_set_color(screen, 0x10, 0x20, (int)(i & 0x3F));
+	bm_rect(screen, (int)(i % 16), (int)(i % 16), screen->w - 1 - (int)(i % 16), screen->h - 1 - (int)(i % 16));
+}
+
+static void do_circle(struct bitmap *src, long i) {
+	int r = src->w / 2;
+	bm_set_color(screen, 0x10, 0x20, (int)(i & 0x3F));
+	bm_circle(screen, pos_x(src, i) + r, pos_y(src, i) + r, r - 1);
+}
+
+/* Floods the area around the circles drawn by fill_setup(),
+ * alternating between two colours so there is always work to do */
+static void do_fill(struct bitmap *src, long i) {
+	bm_set_color(screen, 0x10, 0x20, (i & 1) ? 0x30 : 0x40);
+	bm_fill(screen, 0, 0);
+}
+
+static void fill_setup(void) {
+	int i;
+	bm_set_color(screen, 0x10, 0x20, 0x30);
+	bm_clear(screen);
+	bm_set_color(screen, 0xFF, 0xFF, 0xFF);
+	for(i = 0; i < 32; i++)
+		bm_circle(screen, rand() % screen->w, rand() % screen->h, 4 + rand() % 16);
+}
+
+/* A line of text; text_area is the size of its bounding box */
+static const char *text_line = "The quick brown fox jumps over the lazy dog 0123456789";
+static struct bitmap *text_area;
+
+static void do_puts(struct bitmap *src, long i) {
+	bm_set_color(screen, 0xFF, 0xFF, (int)(i & 0x3F));
+	bm_puts(screen, (int)(i % 8), pos_y(src, i), text_line);
+}
+
+/* Saves and loads the sprite through a file, in either format */
+static const char *file_name;
+
+static void do_save(struct bitmap *src, long i) {
+	if(!bm_save(src, file_name)) {
+		fprintf(stderr, "Unable to save %s\n", file_name);
+		exit(1);
+	}
+}
+
+static void do_load(struct bitmap *src, long i) {
+	struct bitmap *b = bm_load(file_name);
+	if(!b) {
+		fprintf(stderr, "Unable to load %s\n", file_name);
+		exit(1);
+	}
+	bm_free(b);
+}
+
+static void do_smooth(struct bitmap *src, long i) {
+	bm_smooth(src);
+}
+
+static void do_median(struct bitmap *src, long i) {
+	bm_median(src);
+}
+
+static void do_resample(struct bitmap *src, long i) {
+	bm_free(bm_resample(src, src->w * 2, src->h * 2));
+}
+
+/* Recolouring with palettes of remap_n colours, that make_sprite()'s
+ * random colours mostly don't match */
+static unsigned int remap_src[32], remap_dst[32];
+static int remap_n;
+
+static void remap_setup(int n) {
+	int k;
+	remap_n = n;
+	for(k = 0; k < n; k++) {
+		remap_src[k] = rand() & 0xFFFFFF;
+		remap_dst[k] = rand() & 0xFFFFFF;
+	}
+	remap_src[0] = 0xFF00FF;
+}
+
+static void do_swap_colours(struct bitmap *src, long i) {
+	int k;
+	for(k = 0; k < remap_n; k++)
+		bm_swap_colour(src, remap_src[k] >> 16, (remap_src[k] >> 8) & 0xFF, remap_src[k] & 0xFF, 
+			remap_dst[k] >> 16, (remap_dst[k] >> 8) & 0xFF, remap_dst[k] & 0xFF);
+}
+
+static void do_remap(struct bitmap *src, long i) {
+	bm_remap_colours(src, remap_n, remap_src, remap_dst);
+}
+
+static struct bm_rle *rle;
+
+static void do_rle_blit(struct bitmap *src, long i) {
+	bm_rle_blit(screen, pos_x(src, i), pos_y(src, i), rle, 0, 0, src->w, src->h);
+}
+
+/* Indexed versions of the sprites and the screen */
+static struct bm_indexed *isprite, *iscreen;
+
+static struct bm_indexed *make_indexed(struct bitmap *src) {
+	int x, y;
+	unsigned int key = src->color & 0x00FFFFFF;
+	struct bm_indexed *b = bm_indexed_create(src->w, src->h);
+	for(x = 1; x < 256; x++)
+		bm_indexed_set_color(b, x, rand() & 0xFF, rand() & 0xFF, rand() & 0xFF);
+	for(y = 0; y < src->h; y++) {
+		for(x = 0; x < src->w; x++) {
+			if((bm_get_pixel(src, x, y) & 0x00FFFFFF) != key)
+				b->data[y * b->w + x] = 1 + rand() % 255;
+		}
+	}
+	return b;
+}
+
+static void do_indexed_maskedblit(struct bitmap *src, long i) {
+	bm_indexed_maskedblit(iscreen, pos_x(src, i), pos_y(src, i), isprite, 0, 0, src->w, src->h);
+}
+
+/* A palette effect costs a cycle plus a resolve of the whole screen */
+static void do_indexed_cycle(struct bitmap *src, long i) {
+	bm_indexed_cycle(iscreen, 1, 255, 1);
+	bm_indexed_resolve(src, 0, 0, iscreen);
+}
+
+/* Many small sprites, each in its own bitmap or packed in an atlas.
+ * The loose ones are spread over the heap like the ones loaded by 
+ * a game would be. small_area has their total number of pixels */
+#define NUM_SMALL	256
+static struct bitmap *small[NUM_SMALL], *small_area;
+static struct bm_sprite small_spr[NUM_SMALL];
+static void *small_gaps[NUM_SMALL];
+static struct bm_atlas *small_atlas;
+
+static void small_setup(void) {
+	int k;
+	small_atlas = bm_atlas_create(512, 512);
+	for(k = 0; k < NUM_SMALL; k++) {
+		small[k] = make_sprite(16, 16);
+		small_gaps[k] = malloc(4096 + rand() % 65536);
+		bm_atlas_add(small_atlas, small[k], &small_spr[k]);
+	}
+	small_area = bm_create(16 * 16, NUM_SMALL);
+}
+
+static void small_cleanup(void) {
+	int k;
+	for(k = 0; k < NUM_SMALL; k++) {
+		bm_free(small[k]);
+		free(small_gaps[k]);
+	}
+	bm_atlas_free(small_atlas);
+	bm_free(small_area);
+}
+
+static void do_small_sprites(struct bitmap *src, long i) {
+	int k;
+	for(k = 0; k < NUM_SMALL; k++)
+		bm_maskedblit(screen, pos_x(small[k], i + k * 31), pos_y(small[k], i + k * 17), small[k], 0, 0, 16, 16);
+}
+
+static void do_atlas_sprites(struct bitmap *src, long i) {
+	int k;
+	for(k = 0; k < NUM_SMALL; k++) {
+		struct bm_sprite *s = &small_spr[k];
+		s->bmp->color = s->color;
+		bm_maskedblit(screen, pos_x(small[k], i + k * 31), pos_y(small[k], i + k * 17), s->bmp, s->x, s->y, 16, 16);
+	}
+}
+
+/* A frame of sprites, shapes and text on the whole screen, for
+ * comparing deferred drawing with drawing directly */
+static struct bitmap *frame_sprite;
+
+static void do_frame(struct bitmap *src, long i) {
+	int k;
+	bm_set_color(src, 0, 0, 64);
+	bm_clear(src);
+	for(k = 0; k < 64; k++)
+		bm_maskedblit(src, pos_x(frame_sprite, i + k * 31), pos_y(frame_sprite, i + k * 17), 
+			frame_sprite, 0, 0, frame_sprite->w, frame_sprite->h);
+	bm_set_color(src, 255, 255, 0);
+	for(k = 0; k < 8; k++)
+		bm_fillcircle(src, pos_x(frame_sprite, i + k * 5), pos_y(frame_sprite, i + k * 3), 12);
+	for(k = 0; k < 4; k++)
+		bm_puts(src, 4, 4 + k * 10, "Score: 0001234");
+	bm_flush(src);
+}
+
+/* The same frame, recorded once and replayed */
+static struct bm_cmdlist *frame_cmds;
+
+static void do_frame_replay(struct bitmap *src, long i) {
+	bm_cmdlist_replay(frame_cmds, src);
+}
+
+/* Returns the number of times fun() can be called per second */
+static double run(bench_fun fun, struct bitmap *src) {
+	clock_t start = clock();
+	long n = 0, k;
+	double t;
+	do {
+		for(k = 0; k < 64; k++)
+			fun(src, n++);
+		t = (double)(clock() - start) / CLOCKS_PER_SEC;
+	} while(t < MIN_TIME);
+	return n / t;
+}
+
+/* The output formats */
+static enum { TABLE, CSV, JSON } format = TABLE;
+static int results = 0;
+
+/* Prints one result in Mpixels/s; gbs is the rate the pixels are
+ * written at in GB/s, or zero if it isn't reported */
+static void report(const char *name, int w, int h, double value, double gbs) {
+	char size[32] = "", extra[32] = "";
+	switch(format) {
+		case TABLE:
+			snprintf(size, sizeof size, "%4dx%-4d", w, h);
+			if(gbs > 0)
+				snprintf(extra, sizeof extra, " %8.2f GB/s", gbs);
+			printf("%-18s %9s %10.2f Mpixels/s%s\n", name, size, value, extra);
+			break;
+		case CSV:
+			if(gbs > 0)
+				snprintf(extra, sizeof extra, "%.2f", gbs);
+			printf("%d,%d,\"%s\",%d,%d,%.2f,Mpixels/s,%s\n", screen->w, screen->h, name, w, h, value, extra);
+			break;
+		case JSON:
+			if(gbs > 0)
+				snprintf(extra, sizeof extra, ", \"gbs\": %.2f", gbs);
+			printf("%s\n  {\"screen\": [%d, %d], \"name\": \"%s\", \"size\": [%d, %d], \"value\": %.2f, \"unit\": \"Mpixels/s\"%s}", 
+					results ? "," : "", screen->w, screen->h, name, w, h, value, extra);
+			break;
+	}
+	results++;
+}
+
+static void bench(const char *name, bench_fun fun, struct bitmap *src) {
+	report(name, src->w, src->h, run(fun, src) * src->w * src->h / 1e6, 0);
+}
+
+/* Returns how many pixels fun() draws per call on the screen, on
+ * average over the calls run() starts with, by counting the pixels
+ * it changes on a white screen */
+static double drawn_pixels(bench_fun fun, struct bitmap *src) {
+	long k, n = 0;
+	int x, y;
+	for(k = 0; k < 256; k++) {
+		bm_set_color(screen, 0xFF, 0xFF, 0xFF);
+		bm_clear(screen);
+		fun(src, k);
+		for(y = 0; y < screen->h; y++)
+			for(x = 0; x < screen->w; x++)
+				if((bm_get_pixel(screen, x, y) & 0xFFFFFF) != 0xFFFFFF)
+					n++;
+	}
+	return n / 256.0;
+}
+
+/* For the primitives, whose pixels don't fill src's area: 
+ * The rate is in terms of the pixels they actually draw, with 
+ * the rate they write memory at as well */
+static void bench_drawn(const char *name, bench_fun fun, struct bitmap *src) {
+	double px = drawn_pixels(fun, src) * run(fun, src);
+	report(name, src->w, src->h, px / 1e6, px * 4 / 1e9);
+}
+
+/* The file is saved once before it is loaded, and removed after */
+static void bench_file(const char *name, const char *fname, struct bitmap *src) {
+	char label[32];
+	file_name = fname;
+	snprintf(label, sizeof label, "bm_save %s", name);
+	bench(label, do_save, src);
+	snprintf(label, sizeof label, "bm_load %s", name);
+	bench(label, do_load, src);
+	remove(fname);
+}
+
+/* Runs all the benchmarks on a sw by sh screen */
+static void bench_screen(int sw, int sh) {
+	int i;
+	struct bitmap *sprites[3];
+	
+	screen = bm_create(sw, sh);
+	sprites[0] = make_sprite(16, 16);
+	sprites[1] = make_sprite(32, 32);
+	sprites[2] = make_sprite(sw, sh);
+	
+	if(format == TABLE)
+		printf("Screen %dx%d\n", sw, sh);
+	bench_drawn("bm_clear", do_clear, screen);
+	for(i = 0; i < 3; i++)
+		bench_drawn("bm_fillrect", do_fillrect, sprites[i]);
+	bench_drawn("bm_line", do_line, screen);
+	bench_drawn("bm_line clipped", do_line_clipped, screen);
+	bench_drawn("bm_rect", do_rect, screen);
+	for(i = 1; i < 3; i++)
+		bench_drawn("bm_circle", do_circle, sprites[i]);
+	for(i = 1; i < 3; i++)
+		bench("bm_fillcircle", do_fillcircle, sprites[i]);
+	for(i = 1; i < 3; i++)
+		bench("bm_fillellipse", do_fillellipse, sprites[i]);
+	fill_setup();
+	bench("bm_fill", do_fill, screen);
+	for(i = 0; i < 3; i++)
+		bench("bm_blit", do_blit, sprites[i]);
+	for(i = 0; i < 3; i++)
+		bench("bm_maskedblit", do_maskedblit, sprites[i]);
+	for(i = 0; i < 3; i++)
+		bench("bm_blit flipped", do_blit_flip, sprites[i]);
+	for(i = 0; i < 3; i++)
+		bench("bm_maskedblit flip", do_maskedblit_flip, sprites[i]);
+	for(i = 0; i < 3; i++) {
+		struct bitmap *baked = bm_copy(sprites[i]);
+		bm_mask_alpha(baked);
+		bench("bm_maskedblit a", do_maskedblit, baked);
+		bm_free(baked);
+	}
+	for(i = 0; i < 3; i++)
+		bench("bm_blit clipped", do_blit_clipped, sprites[i]);
+	for(i = 0; i < 3; i++)
+		bench("bm_maskedblit clip", do_maskedblit_clipped, sprites[i]);
+	for(i = 0; i < 3; i++) {
+		rle = bm_rle_create(sprites[i], 0, 0, sprites[i]->w, sprites[i]->h);
+		bench("bm_rle_blit", do_rle_blit, sprites[i]);
+		bm_rle_free(rle);
+	}
+	small_setup();
+	bench("sprites loose", do_small_sprites, small_area);
+	bench("sprites atlas", do_atlas_sprites, small_area);
+	small_cleanup();
+	iscreen = make_indexed(screen);
+	for(i = 0; i < 3; i++) {
+		isprite = make_indexed(sprites[i]);
+		bench("bm_indexed_mask", do_indexed_maskedblit, sprites[i]);
+		bm_indexed_free(isprite);
+	}
+	bench("bm_indexed_cycle", do_indexed_cycle, screen);
+	bm_indexed_free(iscreen);
+	for(i = 0; i < 3; i++)
+		bench("bm_blit_alpha", do_blit_alpha, sprites[i]);
+	bench("bm_blit_ex", do_blit_ex, sprites[2]);
+	frame_sprite = sprites[1];
+	bench("frame", do_frame, screen);
+	bm_defer(screen, 1);
+	bench("frame deferred", do_frame, screen);
+	bm_defer(screen, 0);
+	frame_cmds = bm_cmdlist_create();
+	bm_cmdlist_begin(frame_cmds, screen);
+	do_frame(screen, 0);
+	bm_cmdlist_end(frame_cmds);
+	bench("frame cmdlist", do_frame_replay, screen);
+	bm_cmdlist_free(frame_cmds);
+	bench("bm_blit_ex bilin", do_blit_ex_bilinear, sprites[2]);
+	for(i = 1; i < 3; i++)
+		bench("bm_rotozoom", do_rotozoom, sprites[i]);
+	bench("bm_rotozoom bilin", do_rotozoom_bilinear, sprites[2]);
+	text_area = bm_create(bm_text_width(screen, text_line), bm_text_height(screen, text_line));
+	bench("bm_puts", do_puts, text_area);
+	bm_free(text_area);
+	bench_file("bmp", "bench.tmp.bmp", sprites[2]);
+	bench_file("png", "bench.tmp.png", sprites[2]);
+	
+	/* These modify the sprites, so they go last */
+	bench("bm_smooth", do_smooth, sprites[2]);
+	bench("bm_median", do_median, sprites[2]);
+	bench("bm_resample x2", do_resample, sprites[2]);
+	remap_setup(6);
+	bench("bm_swap_colour 6", do_swap_colours, sprites[2]);
+	bench("bm_remap 6", do_remap, sprites[2]);
+	remap_setup(32);
+	bench("bm_remap 32", do_remap, sprites[2]);
+	
+	for(i = 0; i < 3; i++)
+		bm_free(sprites[i]);
+	bm_free(screen);
+}
+
+int main(int argc, char *argv[]) {
+	int i = 1, sw, sh;
+	
+	if(i < argc && !strcmp(argv[i], "-c")) {
+		format = CSV;
+		i++;
+	} else if(i < argc && !strcmp(argv[i], "-j")) {
+		format = JSON;
+		i++;
+	}
+	if((argc - i) % 2) {
+		fprintf(stderr, "Usage: %s [-c | -j] [width height ...]\n", argv[0]);
+		return 1;
+	}
+	
+	if(format == CSV)
+		printf("screen_w,screen_h,name,w,h,value,unit,gbs\n");
+	else if(format == JSON)
+		printf("[");
+	
+	do {
+		sw = 320;
+		sh = 240;
+		if(i < argc) {
+			sw = atoi(argv[i++]);
+			sh = atoi(argv[i++]);
+			if(sw <= 32 || sh <= 32) {
+				fprintf(stderr, "Screen %dx%d is too small\n", sw, sh);
+				return 1;
+			}
+		}
+		srand(1);
+		bench_screen(sw, sh);
+	} while(i < argc);
+	
+	if(format == JSON)
+		printf("\n]\n");
+	return 0;
+}
@@ -2,9 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <ctype.h>
 #include <assert.h>
+#include <math.h>
 
 /*
 Use the -DUSEPNG compiler option to enable PNG support via libpng.
@@ -17,6 +19,40 @@ you may not want to import a bunch of third party libraries.
 #	include <png.h>
 #endif
 
+/*
+Use the -DBM_NO_SIMD compiler option to disable the fast paths
+in the blitting functions and fall back to the plain
+pixel-by-pixel loops. The plain loops are slower, but they serve
+as a reference implementation if you suspect a problem with the
+fast paths.
+The SSE2 (and SSSE3 and AVX2, if you compile with -mssse3 or 
+-mavx2) paths are only used if the compiler targets those 
+instruction sets.
+*/
+#if !defined(BM_NO_SIMD) && defined(__SSE2__)
+#	define BM_SSE2
+#	include <emmintrin.h>
+#	ifdef __SSSE3__
+#		define BM_SSSE3
+#		include <tmmintrin.h>
+#	endif
+#	ifdef __AVX2__
+#		define BM_AVX2
+#		include <immintrin.h>
+#	endif
+#endif
+
+/*
+Use the -DBM_THREADS compiler option to split the heavier filters 
+(like bm_smooth() and bm_resample()) into bands of rows that are 
+processed on a pool of worker threads. It uses POSIX threads, so
+you need to link with -pthread.
+*/
+#ifdef BM_THREADS
+#	include <pthread.h>
+#	include <unistd.h>
+#endif
+
 #include "bmp.h"
 
 /*
@@ -91,7 +127,20 @@ struct bmpfile_colinfo {
 
 #define BM_BPP			4 /* Bytes per Pixel */
 #define BM_BLOB_SIZE(B)	(B->w * B->h * BM_BPP)
-#define BM_ROW_SIZE(B)	(B->w * BM_BPP)
+/* Bytes from one row to the next, which is more than the width 
+ * of the row in bytes for views. See bm_view() */
+#define BM_ROW_SIZE(B)	((B)->stride)
+
+/* Whether there are no gaps between the rows of B */
+#define BM_CONTIGUOUS(B)	((B)->stride == (B)->w * BM_BPP)
+
+/* The bitmap that owns the pixels of B */
+#define BM_ROOT(B)		((B)->parent ? (B)->parent : (B))
+
+/* Whether the pixels of A and B may overlap, because they are the 
+ * same bitmap or views of the same one */
+#define BM_ALIASED(A, B)	((uintptr_t)(A)->data < (uintptr_t)(B)->data + (size_t)(B)->h * (B)->stride \
+		&& (uintptr_t)(B)->data < (uintptr_t)(A)->data + (size_t)(A)->h * (A)->stride)
 
 #define BM_SET(BMP, X, Y, R, G, B, A) do { \
 		int _p = ((Y) * BM_ROW_SIZE(BMP) + (X)*BM_BPP);	\
@@ -106,8 +155,448 @@ struct bmpfile_colinfo {
 #define BM_GETB(B,X,Y) (B->data[((Y) * BM_ROW_SIZE(B) + (X) * BM_BPP) + 2])
 #define BM_GETA(B,X,Y) (B->data[((Y) * BM_ROW_SIZE(B) + (X) * BM_BPP) + 3])
 
-struct bitmap *bm_create(int w, int h) {	
+/* Address of the pixel at X,Y */
+#define BM_PIXEL(B,X,Y) (B->data + (Y) * BM_ROW_SIZE(B) + (X) * BM_BPP)
+
+/* Packed pixels: Each pixel is a 32-bit value with the bytes
+ * R,G,B,A in that order in memory, regardless of the byte order
+ * of the platform. See bm_pack() 
+ */
+#define BM_ROW32(B,Y)			((uint32_t *)((B)->data + (Y) * BM_ROW_SIZE(B)))
+#define BM_GET_PIXEL(B,X,Y)		(BM_ROW32(B,Y)[X])
+#define BM_SET_PIXEL(B,X,Y,C)	(BM_ROW32(B,Y)[X] = (C))
+
+/* Individual components of a packed colour, like the pen */
+#define BM_COMP(C,I)	(((unsigned char *)&(C))[I])
+
+/* Masks out the alpha of a packed pixel so that only 
+ * the RGB components are compared to the mask colour */
+#define BM_RGB_MASK		bm_pack(0xFF, 0xFF, 0xFF, 0x00)
+
+/* The mask and key that masked blits from B compare the pixels
+ * with: A pixel is skipped if (pixel & BM_KEY_MASK(B)) == BM_KEY(B).
+ * See bm_mask_alpha() */
+#define BM_KEY_MASK(B)	(((B)->flags & BM_ALPHA_MASK) ? bm_pack(0x00, 0x00, 0x00, 0xFF) : BM_RGB_MASK)
+#define BM_KEY(B)		(((B)->flags & BM_ALPHA_MASK) ? 0 : (B)->color & BM_RGB_MASK)
+
+/* Divides x by 255 with rounding, for 0 <= x <= 255*255 */
+#define BM_DIV255(x)	(((x) + 128 + (((x) + 128) >> 8)) >> 8)
+
+/* Packs R,G,B,A into a 32-bit value with the same
+ * byte order as the pixels in the bitmap's data, so 
+ * that it can be compared directly against a pixel.
+ */
+static uint32_t bm_pack(unsigned char R, unsigned char G, unsigned char B, unsigned char A) {
+	unsigned char c[4];
+	uint32_t p;
+	c[0] = R; c[1] = G; c[2] = B; c[3] = A;
+	memcpy(&p, c, sizeof p);
+	return p;
+}
+
+/* Worker pool:
+ * bm_run_bands() calls fun(arg, y0, y1) for bands of rows that 
+ * together cover the rows 0 to h-1, and returns once they're all done.
+ * With BM_THREADS the bands are shared between the calling thread
+ * and a pool of workers that is started on first use. Without it, or
+ * if the pool is busy, the whole range is processed on the caller.
+ */
+typedef void (*bm_band_fun)(void *arg, int y0, int y1);
+
+/* Rows of work below which it isn't worth waking the workers */
+#define BM_MIN_BAND_ROWS	16
+#define BM_MAX_THREADS		8
+
+#ifdef BM_THREADS
+static struct {
+	pthread_mutex_t lock, busy;
+	pthread_cond_t work, done;
+	int nthreads, started;
+	unsigned int job;
+	
+	/* The current job */
+	bm_band_fun fun;
+	void *arg;
+	int h, nbands, next, remaining;
+} bm_pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, 
+		PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+/* Grabs bands of the current job until there are none left. 
+ * Called with bm_pool.lock held. */
+static void bm_pool_bands(void) {
+	while(bm_pool.next < bm_pool.nbands) {
+		int k = bm_pool.next++;
+		int y0 = k * bm_pool.h / bm_pool.nbands, y1 = (k + 1) * bm_pool.h / bm_pool.nbands;
+		pthread_mutex_unlock(&bm_pool.lock);
+		bm_pool.fun(bm_pool.arg, y0, y1);
+		pthread_mutex_lock(&bm_pool.lock);
+		if(--bm_pool.remaining == 0)
+			pthread_cond_signal(&bm_pool.done);
+	}
+}
+
+static void *bm_pool_worker(void *unused) {
+	unsigned int job = 0;
+	(void)unused;
+	pthread_mutex_lock(&bm_pool.lock);
+	for(;;) {
+		while(bm_pool.job == job)
+			pthread_cond_wait(&bm_pool.work, &bm_pool.lock);
+		job = bm_pool.job;
+		bm_pool_bands();
+	}
+	return NULL;
+}
+
+static void bm_pool_start(void) {
+	int i, n = 4;
+	pthread_t t;
+#ifdef _SC_NPROCESSORS_ONLN
+	n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if(n > BM_MAX_THREADS)
+		n = BM_MAX_THREADS;
+	/* The caller does its share of the work too */
+	for(i = 0; i < n - 1; i++) {
+		if(pthread_create(&t, NULL, bm_pool_worker, NULL))
+			break;
+		pthread_detach(t);
+	}
+	bm_pool.nthreads = i;
+	bm_pool.started = 1;
+}
+#endif
+
+static void bm_run_bands(bm_band_fun fun, void *arg, int h) {
+#ifdef BM_THREADS
+	if(h >= 2 * BM_MIN_BAND_ROWS && !pthread_mutex_trylock(&bm_pool.busy)) {
+		pthread_mutex_lock(&bm_pool.lock);
+		if(!bm_pool.started)
+			bm_pool_start();
+		if(bm_pool.nthreads > 0) {
+			int nbands = (bm_pool.nthreads + 1) * 2;
+			if(nbands > h / BM_MIN_BAND_ROWS)
+				nbands = h / BM_MIN_BAND_ROWS;
+			bm_pool.fun = fun;
+			bm_pool.arg = arg;
+			bm_pool.h = h;
+			bm_pool.nbands = nbands;
+			bm_pool.remaining = nbands;
+			bm_pool.next = 0;
+			bm_pool.job++;
+			pthread_cond_broadcast(&bm_pool.work);
+			bm_pool_bands();
+			while(bm_pool.remaining > 0)
+				pthread_cond_wait(&bm_pool.done, &bm_pool.lock);
+			pthread_mutex_unlock(&bm_pool.lock);
+			pthread_mutex_unlock(&bm_pool.busy);
+			return;
+		}
+		pthread_mutex_unlock(&bm_pool.lock);
+		pthread_mutex_unlock(&bm_pool.busy);
+	}
+#endif
+	fun(arg, 0, h);
+}
+
+/* Scratch memory for the filters, so that they don't have to
+ * allocate a new bitmap on every call. 
+ * Only the calling thread may resize it. */
+static void *bm_scratch_mem;
+static size_t bm_scratch_size;
+
+static void *bm_scratch(size_t size) {
+	if(size > bm_scratch_size) {
+		void *m = realloc(bm_scratch_mem, size);
+		if(!m)
+			return NULL;
+		bm_scratch_mem = m;
+		bm_scratch_size = size;
+	}
+	return bm_scratch_mem;
+}
+
+/* Dirty rectangles:
+ * When tracking is enabled, the drawing functions record the 
+ * (clipped) bounding boxes of what they draw so that callers only
+ * need to copy the changed parts of the bitmap to the screen.
+ * Overlapping and touching rectangles are merged as they are added.
+ * When the list is full the new rectangle is merged with whichever
+ * one grows the least, so the list stays short and cheap to use.
+ * Override the length of the list with -DBM_MAX_DIRTY=n */
+#ifndef BM_MAX_DIRTY
+#	define BM_MAX_DIRTY	16
+#endif
+
+struct bm_dirty {
+	int n;
+	struct {
+		int x0, y0;
+		int x1, y1;
+	} r[BM_MAX_DIRTY];
+};
+
+/* Records the box from <x0,y0> to <x1,y1> (inclusive, in any order)
+ * if dirty rectangles are being tracked, clipped like the drawing 
+ * functions are. Views pass it on to their parent */
+#define BM_DIRTY(B, X0, Y0, X1, Y1) do { \
+		if((B)->dirty || (B)->parent) bm_dirty_box(B, X0, Y0, X1, Y1); \
+	} while(0)
+
+/* Area of the box around rectangle i and <X0,Y0>-<X1,Y1> */
+#define BM_UNION_AREA(D, i, X0, Y0, X1, Y1) \
+	((long)(MAX((D)->r[i].x1, X1) - MIN((D)->r[i].x0, X0)) * (MAX((D)->r[i].y1, Y1) - MIN((D)->r[i].y0, Y0)))
+
+void bm_dirty_add(struct bitmap *b, int x0, int y0, int x1, int y1) {
+	struct bm_dirty *d = b->dirty;
+	int i;
+	if(!d && !b->parent)
+		return;
+	x0 = MAX(x0, 0);
+	y0 = MAX(y0, 0);
+	x1 = MIN(x1, b->w);
+	y1 = MIN(y1, b->h);
+	if(x1 <= x0 || y1 <= y0)
+		return;
+	
+	if(b->parent) {
+		/* The view's position on its parent */
+		size_t offset = b->data - b->parent->data;
+		int vx = (int)(offset % b->stride) / BM_BPP, vy = (int)(offset / b->stride);
+		bm_dirty_add(b->parent, x0 + vx, y0 + vy, x1 + vx, y1 + vy);
+		if(!d)
+			return;
+	}
+	
+	for(i = 0; i < d->n; i++) {
+		if(x0 >= d->r[i].x0 && y0 >= d->r[i].y0 && x1 <= d->r[i].x1 && y1 <= d->r[i].y1)
+			return;
+	}
+	
+	/* Absorb every rectangle that overlaps or touches the new one. 
+	 * The new one grows as it does, so start over after each merge */
+	for(i = 0; i < d->n; i++) {
+		if(x0 <= d->r[i].x1 && d->r[i].x0 <= x1 && y0 <= d->r[i].y1 && d->r[i].y0 <= y1) {
+			x0 = MIN(x0, d->r[i].x0);
+			y0 = MIN(y0, d->r[i].y0);
+			x1 = MAX(x1, d->r[i].x1);
+			y1 = MAX(y1, d->r[i].y1);
+			d->r[i] = d->r[--d->n];
+			i = -1;
+		}
+	}
+	
+	if(d->n == BM_MAX_DIRTY) {
+		int best = 0;
+		long grow, best_grow = LONG_MAX;
+		for(i = 0; i < d->n; i++) {
+			grow = BM_UNION_AREA(d, i, x0, y0, x1, y1) 
+				- (long)(d->r[i].x1 - d->r[i].x0) * (d->r[i].y1 - d->r[i].y0);
+			if(grow < best_grow) {
+				best_grow = grow;
+				best = i;
+			}
+		}
+		/* Merging may now overlap others, so add the union again */
+		x0 = MIN(x0, d->r[best].x0);
+		y0 = MIN(y0, d->r[best].y0);
+		x1 = MAX(x1, d->r[best].x1);
+		y1 = MAX(y1, d->r[best].y1);
+		d->r[best] = d->r[--d->n];
+		bm_dirty_add(b, x0, y0, x1, y1);
+		return;
+	}
+	
+	d->r[d->n].x0 = x0;
+	d->r[d->n].y0 = y0;
+	d->r[d->n].x1 = x1;
+	d->r[d->n].y1 = y1;
+	d->n++;
+}
+
+static void bm_dirty_box(struct bitmap *b, int x0, int y0, int x1, int y1) {
+	if(x1 < x0) {
+		int t = x0; x0 = x1; x1 = t;
+	}
+	if(y1 < y0) {
+		int t = y0; y0 = y1; y1 = t;
+	}
+	bm_dirty_add(b, MAX(x0, b->clip.x0), MAX(y0, b->clip.y0), 
+		MIN(x1, b->clip.x1 - 1) + 1, MIN(y1, b->clip.y1 - 1) + 1);
+}
+
+static void bm_dirty_all(struct bitmap *b) {
+	if(b->dirty || b->parent)
+		bm_dirty_add(b, 0, 0, b->w, b->h);
+}
+
+void bm_dirty_track(struct bitmap *b, int enable) {
+	if(enable && !b->dirty) {
+		b->dirty = malloc(sizeof *b->dirty);
+		if(!b->dirty)
+			return;
+		b->dirty->n = 0;
+	} else if(!enable && b->dirty) {
+		free(b->dirty);
+		b->dirty = NULL;
+	}
+}
+
+int bm_dirty_count(struct bitmap *b) {
+	return b->dirty ? b->dirty->n : 1;
+}
+
+void bm_dirty_get(struct bitmap *b, int i, int *x0, int *y0, int *x1, int *y1) {
+	if(!b->dirty) {
+		*x0 = 0; *y0 = 0;
+		*x1 = b->w; *y1 = b->h;
+		return;
+	}
+	assert(i >= 0 && i < b->dirty->n);
+	*x0 = b->dirty->r[i].x0;
+	*y0 = b->dirty->r[i].y0;
+	*x1 = b->dirty->r[i].x1;
+	*y1 = b->dirty->r[i].y1;
+}
+
+void bm_dirty_reset(struct bitmap *b) {
+	if(b->dirty)
+		b->dirty->n = 0;
+}
+
+/* Command lists and deferred drawing:
+ * While b->cmds is set, the drawing functions append their arguments
+ * to that list instead of drawing. Lists are replayed once for every 
+ * band of rows from bm_run_bands(), on a copy of the target bitmap 
+ * whose clipping rectangle is limited to the band, so that the bands
+ * never touch the same pixels. Every primitive clips exactly, so the
+ * result is the same as drawing directly.
+ * A bitmap in deferred mode owns a list that bm_flush() replays onto 
+ * it. The sources of its recorded blits are kept in a set, so that 
+ * changing or freeing one flushes the lists that still have to read it.
+ * Lists from bm_cmdlist_create() are only replayed when asked to.
+ * Lists can be stacked on a bitmap, through bm_cmdlist.saved, if one
+ * is recorded while the bitmap is deferred.
+ */
+enum bm_cmd_op {
+	BM_CMD_PIXEL,		/* a[0],a[1]; The pixel value is in color */
+	BM_CMD_PUTPIXEL,
+	BM_CMD_CLEAR,
+	BM_CMD_LINE,
+	BM_CMD_RECT,
+	BM_CMD_FILLRECT,
+	BM_CMD_CIRCLE,
+	BM_CMD_FILLCIRCLE,	/* data[0] is the bm_circle_rows() table */
+	BM_CMD_ELLIPSE,
+	BM_CMD_FILLELLIPSE,
+	BM_CMD_ROUNDRECT,
+	BM_CMD_FILLROUNDRECT,	/* data[0] is the bm_circle_rows() table */
+	BM_CMD_TEXT,		/* data[0] is the text, data[1] the glyphs */
+	BM_CMD_BLIT,
+	BM_CMD_MASKEDBLIT,
+	BM_CMD_BLIT_ALPHA,
+	BM_CMD_BLIT_EX,
+	BM_CMD_RLE_BLIT,
+	BM_CMD_ROTOZOOM
+};
+
+struct bm_cmd {
+	int op;
+	
+	/* The box the command can draw in, x0,y0,x1,y1 inclusive, and
+	 * the part of it inside the clipping rectangle and the target */
+	int box[4], area[4];
+	
+	/* The state of the bitmap when the command was recorded */
+	uint32_t color;
+	const unsigned char *font;
+	int font_spacing;
+	int clip[4];
+	
+	/* The source of blits, and the source bitmap's colour (its mask)
+	 * and flags */
+	const void *src;
+	uint32_t key;
+	unsigned int src_flags;
+	
+	int a[9];
+	
+	/* Offsets of variable length arguments in bm_cmdlist.data */
+	size_t data[2];
+};
+
+struct bm_cmdlist {
+	/* The bitmap being recorded, and the list it had before */
+	struct bitmap *owner;
+	struct bm_cmdlist *saved;
+	int deferred;
+	
+	/* cmds and order both have room for a commands */
+	int n, a;
+	struct bm_cmd *cmds;
+	
+	unsigned char *data;
+	size_t ndata, adata;
+	
+	/* Open addressed set of the blit sources; asrcs is a power of 2 */
+	const void **srcs;
+	int nsrcs, asrcs;
+	
+	/* Consecutive text commands with the same font share glyphs */
+	const unsigned char *font;
+	size_t glyphs;
+	
+	/* The replay: The bitmap it draws on and the indexes of the 
+	 * commands to draw, in the order to draw them. See bm_plan() */
+	struct bitmap *target;
+	int *order, norder;
+	int culled, moved, serial;
+	
+	/* Dirty rectangles of each band, merged after the replay */
+	struct bm_dirty *bands;
+	int nbands;
+	
+	int busy;
+	
+	/* Lists of deferred bitmaps are linked together */
+	struct bm_cmdlist *next;
+};
+
+/* Number of bitmaps in deferred mode. It is 0 while a list is being 
+ * replayed, which disables the hooks below on the worker threads */
+static int bm_deferring;
+static struct bm_cmdlist *bm_cmdlists;
+
+static struct bm_cmd *bm_record(struct bitmap *b, int op, int x0, int y0, int x1, int y1, const void *src, int n, ...);
+static int bm_record_data(struct bitmap *b, struct bm_cmd *c, int i, const void *p, size_t size);
+static void bm_sync(const void *src);
+
+/* Called before a function reads the pixels of B. 
+ * The pixels of a view are the parent's, so it is flushed too */
+#define BM_READ(B) do { \
+		if(bm_deferring) { \
+			if((B)->cmds) bm_flush(B); \
+			if((B)->parent && (B)->parent->cmds) bm_flush((B)->parent); \
+		} \
+	} while(0)
+
+/* Called before a function changes the pixels of B without recording it.
+ * Lists that use B, or any view of the same pixels, as a source are 
+ * drawn first; Their sets of sources hold the bitmaps' roots */
+#define BM_WRITE(B) do { \
+		if(bm_deferring) { \
+			if((B)->cmds) bm_flush(B); \
+			if((B)->parent && (B)->parent->cmds) bm_flush((B)->parent); \
+			bm_sync(BM_ROOT(B)); \
+		} \
+	} while(0)
+
+/* Creates a bitmap without clearing the pixels,
+ * for loaders that are about to overwrite all of them anyway */
+static struct bitmap *bm_create_raw(int w, int h) {
 	struct bitmap *b = malloc(sizeof *b);
+	if(!b)
+		return NULL;
 	
 	b->w = w;
 	b->h = h;
@@ -118,8 +607,17 @@ struct bitmap *bm_create(int w, int h) {
 	b->clip.y1 = h;
 		
 	b->data = malloc(BM_BLOB_SIZE(b));
-	memset(b->data, 0x00, BM_BLOB_SIZE(b));
+	if(!b->data) {
+		free(b);
+		return NULL;
+	}
+	b->stride = w * BM_BPP;
 	
+	b->color = 0;
+	b->dirty = NULL;
+	b->cmds = NULL;
+	b->flags = 0;
+	b->parent = NULL;
 	bm_std_font(b, BM_FONT_NORMAL);
 	bm_set_color(b, 255, 255, 255);
 	bm_set_alpha(b, 255);
@@ -127,6 +625,13 @@ struct bitmap *bm_create(int w, int h) {
 	return b;
 }
 
+struct bitmap *bm_create(int w, int h) {	
+	struct bitmap *b = bm_create_raw(w, h);
+	if(b)
+		memset(b->data, 0x00, BM_BLOB_SIZE(b));
+	return b;
+}
+
 struct bitmap *bm_load(const char *filename) {	
 	struct bitmap *bmp;
 	FILE *f = fopen(filename, "rb");
@@ -160,16 +665,192 @@ struct bitmap *bm_load_fp(FILE *f) {
 #endif
 }
 
+/* Premultiplies the alpha of a row of pixels for bm_blit_alpha() */
+static void bm_premul_row(unsigned char *p, int w) {
+	for(; w > 0; w--, p += BM_BPP) {
+		int a = p[3];
+		if(a == 0xFF)
+			continue;
+		p[0] = BM_DIV255(p[0] * a);
+		p[1] = BM_DIV255(p[1] * a);
+		p[2] = BM_DIV255(p[2] * a);
+	}
+}
+
+/* Row converters for the BMP loader: Each converts a row of w pixels
+ * in the file's format to the bitmap's pixels. The source rows have 
+ * at least BM_ROW_SLACK bytes to spare at the end, so that the fast
+ * paths may read a little past the last pixel. */
+#define BM_ROW_SLACK	16
+
+/* 8-bit: Expands the palette indices through a table of packed pixels */
+static void bm_lut_row(uint32_t *d, const unsigned char *s, int w, const uint32_t *lut) {
+	int i;
+	for(i = 0; i < w; i++)
+		d[i] = lut[s[i]];
+}
+
+#ifdef BM_SSE2
+/* Swaps the bytes 0 and 2 of each pixel: BGRA to RGBA */
+static __m128i bm_swap_rb4(__m128i v) {
+	__m128i ga = _mm_set1_epi32(0xFF00FF00), lo = _mm_set1_epi32(0xFF);
+	return _mm_or_si128(_mm_and_si128(v, ga), 
+		_mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), lo), _mm_slli_epi32(_mm_and_si128(v, lo), 16)));
+}
+#endif
+
+/* 24-bit: BGR to RGBA, opaque */
+static void bm_bgr_row(uint32_t *d, const unsigned char *s, int w) {
+	int i = 0;
+#if defined(BM_SSSE3)
+	/* Shuffle 4 pixels at a time from 12 of the 16 bytes loaded */
+	__m128i shuf = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+	__m128i alpha = _mm_set1_epi32(0xFF000000);
+	for(; i + 4 <= w; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i * 3));
+		_mm_storeu_si128((__m128i *)(d + i), _mm_or_si128(_mm_shuffle_epi8(v, shuf), alpha));
+	}
+#elif defined(BM_SSE2)
+	/* Gather 4 pixels with unaligned 32-bit loads, then swizzle them */
+	__m128i alpha = _mm_set1_epi32(0xFF000000);
+	for(; i + 4 <= w; i += 4) {
+		uint32_t p[4];
+		memcpy(&p[0], s + i * 3, 4);
+		memcpy(&p[1], s + i * 3 + 3, 4);
+		memcpy(&p[2], s + i * 3 + 6, 4);
+		memcpy(&p[3], s + i * 3 + 9, 4);
+		_mm_storeu_si128((__m128i *)(d + i), 
+			_mm_or_si128(bm_swap_rb4(_mm_loadu_si128((const __m128i *)p)), alpha));
+	}
+#endif
+	for(; i < w; i++)
+		d[i] = bm_pack(s[i * 3 + 2], s[i * 3 + 1], s[i * 3], 0xFF);
+}
+
+/* 32-bit: BGRA to RGBA. The alpha byte is kept if alpha is set, 
+ * otherwise it is unused and the pixels are made opaque. */
+static void bm_bgra_row(uint32_t *d, const unsigned char *s, int w, int alpha) {
+	int i = 0;
+#ifdef BM_SSE2
+	__m128i fill = _mm_set1_epi32(alpha ? 0 : 0xFF000000);
+	__m128i keep = _mm_set1_epi32(alpha ? 0xFFFFFFFF : 0x00FFFFFF);
+	for(; i + 4 <= w; i += 4) {
+		__m128i v = bm_swap_rb4(_mm_loadu_si128((const __m128i *)(s + i * 4)));
+		_mm_storeu_si128((__m128i *)(d + i), _mm_or_si128(_mm_and_si128(v, keep), fill));
+	}
+#endif
+	for(; i < w; i++)
+		d[i] = bm_pack(s[i * 4 + 2], s[i * 4 + 1], s[i * 4], alpha ? s[i * 4 + 3] : 0xFF);
+}
+
+/* Any other 16- or 32-bit layout, described by channel masks */
+struct bm_bitfields {
+	uint32_t mask[4]; /* R, G, B, A. The alpha mask may be 0 */
+	int shift[4], bits[4];
+};
+
+static void bm_bitfields_init(struct bm_bitfields *bf) {
+	int c;
+	for(c = 0; c < 4; c++) {
+		uint32_t m = bf->mask[c];
+		bf->shift[c] = 0;
+		bf->bits[c] = 0;
+		if(!m)
+			continue;
+		for(; !(m & 1); m >>= 1)
+			bf->shift[c]++;
+		for(; m & 1; m >>= 1)
+			bf->bits[c]++;
+	}
+}
+
+static unsigned char bm_bitfield(const struct bm_bitfields *bf, int c, uint32_t px) {
+	uint32_t v = (px & bf->mask[c]) >> bf->shift[c];
+	/* An empty mask has nothing to scale: Without alpha the pixel is opaque */
+	if(!bf->bits[c])
+		return c == 3 ? 0xFF : 0;
+	if(bf->bits[c] >= 8)
+		return v >> (bf->bits[c] - 8);
+	return v * 255 / ((1u << bf->bits[c]) - 1);
+}
+
+static void bm_bitfields_row(uint32_t *d, const unsigned char *s, int w, int bpp, const struct bm_bitfields *bf) {
+	int i;
+	for(i = 0; i < w; i++) {
+		uint32_t px;
+		if(bpp == 16) {
+			px = s[0] | (s[1] << 8);
+			s += 2;
+		} else {
+			px = s[0] | (s[1] << 8) | (s[2] << 16) | ((uint32_t)s[3] << 24);
+			s += 4;
+		}
+		d[i] = bm_pack(bm_bitfield(bf, 0, px), bm_bitfield(bf, 1, px), bm_bitfield(bf, 2, px), 
+			bf->mask[3] ? bm_bitfield(bf, 3, px) : 0xFF);
+	}
+}
+
+static void bm_fill32(uint32_t *p, size_t n, uint32_t c);
+
+/* Decodes 8-bit run length encoded (BI_RLE8) pixel data. 
+ * Pixels that the encoding skips over are left as they are */
+static int bm_read_rle8(FILE *f, struct bitmap *b, const uint32_t *lut) {
+	int x = 0, y = b->h - 1, n, c;
+	for(;;) {
+		if((n = getc(f)) == EOF || (c = getc(f)) == EOF)
+			return 0;
+		if(n > 0) {
+			/* A run of n pixels of colour c */
+			if(y >= 0)
+				bm_fill32(BM_ROW32(b, y) + x, MIN(n, b->w - x), lut[c]);
+			x = MIN(x + n, b->w);
+		} else if(c == 0) {
+			/* End of line */
+			x = 0;
+			y--;
+		} else if(c == 1) {
+			/* End of bitmap */
+			return 1;
+		} else if(c == 2) {
+			/* Delta */
+			int dx = getc(f), dy = getc(f);
+			if(dx == EOF || dy == EOF)
+				return 0;
+			x = MIN(x + dx, b->w);
+			y -= dy;
+		} else {
+			/* Absolute mode: c literal pixels, padded to 16 bits */
+			int i;
+			for(i = 0; i < c; i++) {
+				int p = getc(f);
+				if(p == EOF)
+					return 0;
+				if(y >= 0 && x < b->w)
+					BM_ROW32(b, y)[x++] = lut[p];
+			}
+			if((c & 1) && getc(f) == EOF)
+				return 0;
+		}
+	}
+}
+
+/* Compression types */
+#define BM_BI_RGB		0
+#define BM_BI_RLE8		1
+#define BM_BI_BITFIELDS	3
+
 static struct bitmap *bm_load_bmp_fp(FILE *f) {	
 	struct bmpfile_magic magic; 
 	struct bmpfile_header hdr;
 	struct bmpfile_dibinfo dib;
-	struct bmpfile_colinfo *palette = NULL;
+	struct bmpfile_colinfo palette[256];
+	uint32_t lut[256];
+	struct bm_bitfields bf;
 	
 	struct bitmap *b = NULL;
 	
-	int rs, i, j;
-	char *data = NULL;
+	int w, h, topdown, rs, i, j;
+	unsigned char *row = NULL;
 	
 	long start_offset = ftell(f);
 		
@@ -184,76 +865,123 @@ static struct bitmap *bm_load_bmp_fp(FILE *f) {
 		return NULL;
 	}
 	
-	if(fread(&dib, sizeof dib, 1, f) != 1) {
+	if(fread(&dib, sizeof dib, 1, f) != 1 || dib.header_sz < sizeof dib) {
 		return NULL;
 	}
 	
-	if((dib.bitspp != 8 && dib.bitspp != 24) || dib.compress_type != 0) {
-		/* Unsupported BMP type. TODO (maybe): support more types? */
-		return NULL;
+	switch(dib.compress_type) {
+		case BM_BI_RGB: 
+			if(dib.bitspp != 8 && dib.bitspp != 16 && dib.bitspp != 24 && dib.bitspp != 32)
+				return NULL;
+			break;
+		case BM_BI_RLE8: 
+			if(dib.bitspp != 8)
+				return NULL;
+			break;
+		case BM_BI_BITFIELDS: 
+			if(dib.bitspp != 16 && dib.bitspp != 32)
+				return NULL;
+			break;
+		default:
+			/* Unsupported BMP type. TODO (maybe): support more types? */
+			return NULL;
 	}
 	
-	b = bm_create(dib.width, dib.height);
-	if(!b) {
+	/* A negative height means the rows are stored top to bottom */
+	w = dib.width;
+	h = dib.height;
+	topdown = h < 0;
+	if(topdown)
+		h = -h;
+	if(w <= 0 || h <= 0 || (topdown && dib.compress_type == BM_BI_RLE8)) {
 		return NULL;
 	}
 	
-	if(dib.bitspp <= 8) {
-		if(!dib.ncolors) {
-			dib.ncolors = 1 << dib.bitspp;
-		}		
-		palette = calloc(dib.ncolors, sizeof *palette);		
-		if(!palette) {
-			goto error;
+	memset(&bf, 0, sizeof bf);
+	if(dib.bitspp == 8) {
+		/* The palette follows the header, which may be a newer 
+		 * version that is bigger than the one we read */
+		if(!dib.ncolors || dib.ncolors > 256) {
+			dib.ncolors = 256;
 		}
-		if(fread(palette, sizeof *palette, dib.ncolors, f) != dib.ncolors) {
-			goto error;
+		memset(palette, 0, sizeof palette);
+		if(fseek(f, start_offset + sizeof magic + sizeof hdr + dib.header_sz, SEEK_SET) != 0
+			|| fread(palette, sizeof *palette, dib.ncolors, f) != dib.ncolors) {
+			return NULL;
+		}
+		/* The 4th byte of a palette entry is reserved, and normally 0,
+		 * so the pixels are opaque like those of 24-bit files */
+		for(i = 0; i < 256; i++) {
+			lut[i] = bm_pack(palette[i].r, palette[i].g, palette[i].b, 0xFF);
+		}
+	} else if(dib.bitspp != 24) {
+		if(dib.compress_type == BM_BI_BITFIELDS) {
+			/* The masks follow the 40 byte header. The alpha mask is 
+			 * only there in the newer (bigger) versions of the header */
+			if(fread(bf.mask, sizeof bf.mask[0], dib.header_sz >= 56 ? 4 : 3, f) != (dib.header_sz >= 56 ? 4 : 3)) {
+				return NULL;
+			}
+			/* Every colour needs some bits */
+			if(!bf.mask[0] || !bf.mask[1] || !bf.mask[2]) {
+				return NULL;
+			}
+		} else if(dib.bitspp == 32) {
+			bf.mask[0] = 0x00FF0000;
+			bf.mask[1] = 0x0000FF00;
+			bf.mask[2] = 0x000000FF;
+		} else {
+			bf.mask[0] = 0x7C00;
+			bf.mask[1] = 0x03E0;
+			bf.mask[2] = 0x001F;
 		}
+		bm_bitfields_init(&bf);
+	}
+	
+	/* Pixels skipped by RLE8 are left transparent black */
+	b = dib.compress_type == BM_BI_RLE8 ? bm_create(w, h) : bm_create_raw(w, h);
+	if(!b) {
+		return NULL;
 	}
 		
 	if(fseek(f, hdr.bmp_offset + start_offset, SEEK_SET) != 0) {
 		goto error;
 	}
-
-	rs = ((dib.width * dib.bitspp / 8) + 3) & ~3;
-	assert(rs % 4 == 0);
 	
-	data = malloc(rs * b->h);
-	if(!data) {
+	if(dib.compress_type == BM_BI_RLE8) {
+		if(!bm_read_rle8(f, b, lut))
+			goto error;
+		return b;
+	}
+
+	/* Rows are padded to 4 bytes. Read and convert one at a time */
+	rs = ((w * dib.bitspp + 31) / 32) * 4;
+	row = malloc(rs + BM_ROW_SLACK);
+	if(!row) {
 		goto error;
 	}
 	
-	if(dib.bmp_bytesz == 0) {		
-		if(fread(data, 1, rs * b->h, f) != rs * b->h) {
+	for(j = 0; j < h; j++) {
+		uint32_t *d = BM_ROW32(b, topdown ? j : h - j - 1);
+		if(fread(row, 1, rs, f) != rs) {
 			goto error;
 		}
-	} else {		
-		if(fread(data, 1, dib.bmp_bytesz, f) != dib.bmp_bytesz) {
-			goto error;
+		if(dib.bitspp == 8) {
+			bm_lut_row(d, row, w, lut);
+		} else if(dib.bitspp == 24) {
+			bm_bgr_row(d, row, w);
+		} else if(dib.bitspp == 32 && bf.mask[0] == 0x00FF0000 && bf.mask[1] == 0x0000FF00 
+				&& bf.mask[2] == 0x000000FF && (bf.mask[3] == 0 || bf.mask[3] == 0xFF000000)) {
+			bm_bgra_row(d, row, w, bf.mask[3] != 0);
+		} else {
+			bm_bitfields_row(d, row, w, dib.bitspp, &bf);
 		}
-	}
-		
-	if(dib.bitspp == 8) {
-		for(j = 0; j < b->h; j++) {
-			for(i = 0; i < b->w; i++) {
-				uint8_t p = data[(b->h - (j) - 1) * rs + i];
-				assert(p < dib.ncolors);				
-				BM_SET(b, i, j, palette[p].r, palette[p].g, palette[p].b, palette[p].a);
-			}
-		}			
-	} else {	
-		for(j = 0; j < b->h; j++) {
-			for(i = 0; i < b->w; i++) {
-				int p = ((b->h - (j) - 1) * rs + (i)*3);			
-				BM_SET(b, i, j, data[p+2], data[p+1], data[p+0], 0xFF);
-			}
+		if(bf.mask[3]) {
+			bm_premul_row((unsigned char *)d, w);
 		}
 	}
 	
 end:
-	if(data) free(data);	
-	if(palette != NULL) free(palette);
-	
+	if(row) free(row);
 	return b;
 error:
 	if(b) 
@@ -266,6 +994,7 @@ static int bm_save_bmp(struct bitmap *b, const char *fname);
 static int bm_save_png(struct bitmap *b, const char *fname);
 
 int bm_save(struct bitmap *b, const char *fname) {	
+	BM_READ(b);
 #ifdef USEPNG
 	/* If the filename contains ".bmp" save as BMP,
 		otherwise save as PNG */
@@ -350,16 +1079,18 @@ static int bm_save_bmp(struct bitmap *b, const char *fname) {
 http://zarb.org/~gc/html/libpng.html
 http://www.labbookpages.co.uk/software/imgProc/libPNG.html
 */
+/* libpng's transforms turn every kind of PNG into 8-bit RGBA, 
+ * which is the layout of the bitmap's pixels, so the rows are 
+ * decoded straight into the bitmap's data. */
 static struct bitmap *bm_load_png_fp(FILE *f) {
 	struct bitmap *bmp = NULL;
 	
 	unsigned char header[8];
 	png_structp png = NULL;
 	png_infop info = NULL;
-	int number_of_passes;
-	png_bytep * rows = NULL;
+	int number_of_passes, has_alpha;
 
-	int w, h, ct, bpp, x, y;
+	int w, h, ct, bpp, y, pass;
 
 	if((fread(header, 1, 8, f) != 8) || png_sig_cmp(header, 0, 8)) {
 		goto error;
@@ -385,45 +1116,49 @@ static struct bitmap *bm_load_png_fp(FILE *f) {
 	w = png_get_image_width(png, info);
 	h = png_get_image_height(png, info);
 	ct = png_get_color_type(png, info);
-	
 	bpp = png_get_bit_depth(png, info);
-	assert(bpp == 8);(void)bpp;
+	has_alpha = (ct & PNG_COLOR_MASK_ALPHA) != 0;
 	
-	if(ct != PNG_COLOR_TYPE_RGB && ct != PNG_COLOR_TYPE_RGBA) {
-		goto error;
+	if(bpp == 16)
+		png_set_strip_16(png);
+	if(ct == PNG_COLOR_TYPE_PALETTE)
+		png_set_palette_to_rgb(png);
+	if(ct == PNG_COLOR_TYPE_GRAY && bpp < 8)
+		png_set_expand_gray_1_2_4_to_8(png);
+	if(png_get_valid(png, info, PNG_INFO_tRNS)) {
+		png_set_tRNS_to_alpha(png);
+		has_alpha = 1;
 	}
+	if(ct == PNG_COLOR_TYPE_GRAY || ct == PNG_COLOR_TYPE_GRAY_ALPHA)
+		png_set_gray_to_rgb(png);
+	if(!has_alpha)
+		png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
 	
 	number_of_passes = png_set_interlace_handling(png);
-	(void)number_of_passes;
+	png_read_update_info(png, info);
 	
-	bmp = bm_create(w,h);
+	if(png_get_rowbytes(png, info) != (png_size_t)w * BM_BPP) {
+		/* Shouldn't happen with the transforms above */
+		goto error;
+	}
 	
-	if(setjmp(png_jmpbuf(png))) {
+	bmp = bm_create_raw(w, h);
+	if(!bmp) {
 		goto error;
 	}
 	
-	rows = malloc(h * sizeof *rows);
-	for(y = 0; y < h; y++)
-		rows[y] = malloc(png_get_rowbytes(png,info));
-
-	png_read_image(png, rows);
+	if(setjmp(png_jmpbuf(png))) {
+		goto error;
+	}
 	
-	/* Convert to my internal representation */
-	if(ct == PNG_COLOR_TYPE_RGBA) {
-		for(y = 0; y < h; y++) {
-			png_byte *row = rows[y];
-			for(x = 0; x < w; x++) {
-				png_byte *ptr = &(row[x * 4]);
-				BM_SET(bmp, x, y, ptr[0], ptr[1], ptr[2], ptr[3]);
-			}
-		}
-	} else if(ct == PNG_COLOR_TYPE_RGB) {
+	/* Interlaced images are read once per pass; libpng combines
+	 * each pass with the pixels already in the row. The alpha is
+	 * premultiplied as the final pass completes each row. */
+	for(pass = 0; pass < number_of_passes; pass++) {
 		for(y = 0; y < h; y++) {
-			png_byte *row = rows[y];
-			for(x = 0; x < w; x++) {
-				png_byte *ptr = &(row[x * 3]);
-				BM_SET(bmp, x, y, ptr[0], ptr[1], ptr[2], 0xFF);
-			}
+			png_read_row(png, BM_PIXEL(bmp, 0, y), NULL);
+			if(has_alpha && pass == number_of_passes - 1)
+				bm_premul_row(BM_PIXEL(bmp, 0, y), w);
 		}
 	}
 
@@ -433,13 +1168,7 @@ error:
 	bmp = NULL;
 done:
 	if (info != NULL) png_free_data(png, info, PNG_FREE_ALL, -1);
-	if (png != NULL) png_destroy_read_struct(&png, NULL, NULL);
-	if(rows) {
-		for(y = 0; y < h; y++) {
-			free(rows[y]);
-		}
-		free(rows);
-	}
+	if (png != NULL) png_destroy_read_struct(&png, info ? &info : NULL, NULL);
 	return bmp;
 }
 
@@ -447,7 +1176,9 @@ static int bm_save_png(struct bitmap *b, const char *fname) {
 	
 	png_structp png = NULL;
 	png_infop info = NULL;
-	int y, rv = 1;
+	/* It changes after setjmp(), so it has to be volatile */
+	png_bytep volatile row = NULL;
+	int x, y, rv = 1;
 	
 	FILE *f = fopen(fname, "wb");
 	if(!f) {
@@ -480,18 +1211,26 @@ static int bm_save_png(struct bitmap *b, const char *fname) {
 		
 	png_write_info(png, info);
 	
-	png_bytep row = malloc(4 * b->w * sizeof *row);
-	int x;
+	row = malloc(4 * b->w * sizeof *row);
+	if(!row) {
+		goto error;
+	}
 	for(y = 0; y < b->h; y++) {
 		png_bytep r = row;
 		for(x = 0; x < b->w; x++) {
-			*r++ = BM_GETR(b,x,y);
-			*r++ = BM_GETG(b,x,y);
-			*r++ = BM_GETB(b,x,y);
-			*r++ = BM_GETA(b,x,y);
+			/* Undo the premultiplied alpha of bm_load_png_fp() */
+			int i, a = BM_GETA(b,x,y);
+			for(i = 0; i < 3; i++) {
+				int c = BM_PIXEL(b,x,y)[i];
+				if(a > 0 && a < 255)
+					c = MIN((c * 255 + a / 2) / a, 255);
+				*r++ = c;
+			}
+			*r++ = a;
 		}
 		png_write_row(png, row);
 	}
+	png_write_end(png, NULL);
 	
 	if(setjmp(png_jmpbuf(png))) {
 		goto error;
@@ -501,18 +1240,26 @@ static int bm_save_png(struct bitmap *b, const char *fname) {
 error:
 	rv = 0;
 done:
+	free(row);
 	if(info) png_free_data(png, info, PNG_FREE_ALL, -1);
-	if(png) png_destroy_write_struct(&png, NULL);
+	if(png) png_destroy_write_struct(&png, info ? &info : NULL);
     fclose(f);
 	return rv;
 }
 #endif
 
 struct bitmap *bm_copy(struct bitmap *b) {
-	struct bitmap *out = bm_create(b->w, b->h);
-	memcpy(out->data, b->data, BM_BLOB_SIZE(b));
+	struct bitmap *out;
+	int y;
+	BM_READ(b);
+	out = bm_create_raw(b->w, b->h);
+	if(!out)
+		return NULL;
+	for(y = 0; y < b->h; y++)
+		memcpy(BM_ROW32(out, y), BM_ROW32(b, y), b->w * BM_BPP);
 	
-	out->r = b->r; out->g = b->g; out->b = b->b;
+	out->color = b->color;
+	out->flags = b->flags;
 	out->font = b->font;
 	out->font_spacing = b->font_spacing;
 	memcpy(&out->clip, &b->clip, sizeof b->clip);
@@ -520,18 +1267,69 @@ struct bitmap *bm_copy(struct bitmap *b) {
 	return out;
 }
 
+static int bm_nvariants;
+static void bm_remap_forget(const struct bitmap *b);
+
 void bm_free(struct bitmap *b) {
-	if(b->data) free(b->data);
+	/* Lists recording b just stop, and there's no point in drawing
+	 * the deferred commands now */
+	while(b->cmds && !b->cmds->deferred)
+		bm_cmdlist_end(b->cmds);
+	if(b->cmds) {
+		b->cmds->n = 0;
+		bm_defer(b, 0);
+	}
+	if(bm_deferring)
+		bm_sync(BM_ROOT(b));
+	if(bm_nvariants)
+		bm_remap_forget(b);
+	if(b->data && !b->parent) free(b->data);
+	if(b->dirty) free(b->dirty);
 	free(b);
 }
 
+struct bitmap *bm_view(struct bitmap *parent, int x, int y, int w, int h) {
+	struct bitmap *b;
+	if(x < 0) { w += x; x = 0; }
+	if(y < 0) { h += y; y = 0; }
+	if(x + w > parent->w) w = parent->w - x;
+	if(y + h > parent->h) h = parent->h - y;
+	if(w <= 0 || h <= 0)
+		return NULL;
+	
+	b = malloc(sizeof *b);
+	if(!b)
+		return NULL;
+	b->w = w;
+	b->h = h;
+	b->data = BM_PIXEL(parent, x, y);
+	b->stride = parent->stride;
+	b->parent = BM_ROOT(parent);
+	
+	b->clip.x0 = 0;
+	b->clip.y0 = 0;
+	b->clip.x1 = w;
+	b->clip.y1 = h;
+	
+	b->color = parent->color;
+	b->font = parent->font;
+	b->font_spacing = parent->font_spacing;
+	b->dirty = NULL;
+	b->cmds = NULL;
+	/* The mask is in the pixels, so it's the parent's */
+	b->flags = parent->flags;
+	return b;
+}
+
 void bm_flip_vertical(struct bitmap *b) {
 	int y;
-	size_t s = BM_ROW_SIZE(b);
+	size_t s = b->w * BM_BPP;
 	unsigned char *trow = malloc(s);
+	BM_WRITE(b);
+	bm_dirty_all(b);
 	for(y = 0; y < b->h/2; y++) {
-		unsigned char *row1 = &b->data[y * s];
-		unsigned char *row2 = &b->data[(b->h - y - 1) * s];
+		unsigned char *row1 = BM_PIXEL(b, 0, y);
+		unsigned char *row2 = BM_PIXEL(b, 0, b->h - y - 1);
 		memcpy(trow, row1, s);
 		memcpy(row1, row2, s);
 		memcpy(row2, trow, s);
@@ -540,32 +1338,66 @@ void bm_flip_vertical(struct bitmap *b) {
 }
 
 void bm_set(struct bitmap *b, int x, int y, unsigned char R, unsigned char G, unsigned char B) {
-	assert(x >= 0 && x < b->w && y >= 0 && y < b->h);
-	BM_SET(b, x, y, R, G, B, b->a);
+	bm_set_a(b, x, y, R, G, B, BM_COMP(b->color, 3));
 }
 
 void bm_set_a(struct bitmap *b, int x, int y, unsigned char R, unsigned char G, unsigned char B, unsigned char A) {
+	struct bm_cmd *c;
 	assert(x >= 0 && x < b->w && y >= 0 && y < b->h);
+	/* The pixels are stored premultiplied */
+	if(A < 0xFF) {
+		R = BM_DIV255(R * A);
+		G = BM_DIV255(G * A);
+		B = BM_DIV255(B * A);
+	}
+	if(b->cmds && (c = bm_record(b, BM_CMD_PIXEL, x, y, x, y, NULL, 2, x, y))) {
+		c->color = bm_pack(R, G, B, A);
+		return;
+	}
+	BM_WRITE(b);
 	BM_SET(b, x, y, R, G, B, A);
+	if(b->dirty) bm_dirty_add(b, x, y, x + 1, y + 1);
 }
 
 unsigned char bm_getr(struct bitmap *b, int x, int y) {
+	BM_READ(b);
 	return BM_GETR(b,x,y);
 }
 
 unsigned char bm_getg(struct bitmap *b, int x, int y) {
+	BM_READ(b);
 	return BM_GETG(b,x,y);
 }
 
 unsigned char bm_getb(struct bitmap *b, int x, int y) {
+	BM_READ(b);
 	return BM_GETB(b,x,y);
 }
 
 unsigned char bm_geta(struct bitmap *b, int x, int y) {
+	BM_READ(b);
 	return BM_GETA(b,x,y);
 }
 
-struct bitmap *bm_fromXbm(int w, int h, unsigned char *data) {
+unsigned int bm_get_pixel(struct bitmap *b, int x, int y) {
+	assert(x >= 0 && x < b->w && y >= 0 && y < b->h);
+	BM_READ(b);
+	return BM_GET_PIXEL(b, x, y);
+}
+
+void bm_set_pixel(struct bitmap *b, int x, int y, unsigned int c) {
+	struct bm_cmd *cmd;
+	assert(x >= 0 && x < b->w && y >= 0 && y < b->h);
+	if(b->cmds && (cmd = bm_record(b, BM_CMD_PIXEL, x, y, x, y, NULL, 2, x, y))) {
+		cmd->color = c;
+		return;
+	}
+	BM_WRITE(b);
+	BM_SET_PIXEL(b, x, y, c);
+	if(b->dirty) bm_dirty_add(b, x, y, x + 1, y + 1);
+}
+
+struct bitmap *bm_fromXbm(int w, int h, unsigned char *data) {
 	int x,y;
 		
 	struct bitmap *bmp = bm_create(w, h);
@@ -576,8 +1408,7 @@ struct bitmap *bm_fromXbm(int w, int h, unsigned char *data) {
 			int i, b;
 			b = data[byte++];
 			for(i = 0; i < 8 && x < w; i++) {
-				unsigned char c = (b & (1 << i))?0x00:0xFF;
-				BM_SET(bmp, x++, y, c, c, c, c);
+				BM_SET_PIXEL(bmp, x++, y, (b & (1 << i)) ? 0x00000000 : 0xFFFFFFFF);
 			}
 		}
 	return bmp;
@@ -612,254 +1443,1911 @@ void bm_unclip(struct bitmap *b) {
 	b->clip.y1 = b->h;
 }
 
-void bm_blit(struct bitmap *dst, int dx, int dy, struct bitmap *src, int sx, int sy, int w, int h) {
-	int x,y, i, j;
+/* Clips the area of a blit against the clipping rectangle <cx0,cy0>
+ * to <cx1,cy1> of the destination and the dimensions {{sw,sh}} of 
+ * the source. Returns 0 if there is nothing left to draw.
+ */
+static int bm_clip_area(int cx0, int cy0, int cx1, int cy1, int *dx, int *dy, int sw, int sh, int *sx, int *sy, int *w, int *h) {
+	if(*sx < 0) {
+		*dx -= *sx;
+		*w += *sx;
+		*sx = 0;
+	}
+	if(*sy < 0) {
+		*dy -= *sy;
+		*h += *sy;
+		*sy = 0;
+	}
 
-	if(dx < dst->clip.x0) {
-		int delta = dst->clip.x0 - dx;
-		sx += delta;
-		w -= delta;
-		dx = dst->clip.x0;
+	if(*dx < cx0) {
+		int delta = cx0 - *dx;
+		*sx += delta;
+		*w -= delta;
+		*dx = cx0;
 	}
 	
-	if(dx + w > dst->clip.x1) {
-		int delta = dx + w - dst->clip.x1;
-		w -= delta;
+	if(*dx + *w > cx1) {
+		int delta = *dx + *w - cx1;
+		*w -= delta;
 	}
 
-	if(dy < dst->clip.y0) {
-		int delta = dst->clip.y0 - dy;
-		sy += delta;
-		h -= delta;
-		dy = dst->clip.y0;
+	if(*dy < cy0) {
+		int delta = cy0 - *dy;
+		*sy += delta;
+		*h -= delta;
+		*dy = cy0;
 	}
 	
-	if(dy + h > dst->clip.y1) {
-		int delta = dy + h - dst->clip.y1;
-		h -= delta;
+	if(*dy + *h > cy1) {
+		int delta = *dy + *h - cy1;
+		*h -= delta;
 	}
 	
-	if(w <= 0 || h <= 0)
-		return;
-	if(dx >= dst->clip.x1 || dx + w < dst->clip.x0)
+	if(*sx + *w > sw) {
+		int delta = *sx + *w - sw;
+		*w -= delta;
+	}
+	
+	if(*sy + *h > sh) {
+		int delta = *sy + *h - sh;
+		*h -= delta;
+	}
+	
+	if(*w <= 0 || *h <= 0)
+		return 0;
+	
+	assert(*dx >= 0 && *dx + *w <= cx1);
+	assert(*dy >= 0 && *dy + *h <= cy1);	
+	assert(*sx >= 0 && *sx + *w <= sw);
+	assert(*sy >= 0 && *sy + *h <= sh);
+	
+	return 1;
+}
+
+/* bm_clip_area() against the clipping rectangle of dst */
+static int bm_clip_blit(struct bitmap *dst, int *dx, int *dy, int sw, int sh, int *sx, int *sy, int *w, int *h) {
+	if(!bm_clip_area(dst->clip.x0, dst->clip.y0, dst->clip.x1, dst->clip.y1, dx, dy, sw, sh, sx, sy, w, h))
+		return 0;
+	/* Everything that clips a blit this way draws on the area */
+	BM_DIRTY(dst, *dx, *dy, *dx + *w - 1, *dy + *h - 1);
+	return 1;
+}
+
+void bm_blit(struct bitmap *dst, int dx, int dy, struct bitmap *src, int sx, int sy, int w, int h) {
+	int y;
+
+	BM_READ(src);
+	if(dst->cmds && bm_record(dst, BM_CMD_BLIT, dx, dy, dx + w - 1, dy + h - 1, src, 6, dx, dy, sx, sy, w, h))
 		return;
-	if(dy >= dst->clip.y1 || dy + h < dst->clip.y0)
+	BM_WRITE(dst);
+	if(!bm_clip_blit(dst, &dx, &dy, src->w, src->h, &sx, &sy, &w, &h))
 		return;
 	
-	if(sx + w > src->w) {
-		int delta = sx + w - src->w;
-		w -= delta;
+#ifdef BM_NO_SIMD
+	{
+		int x, i, j = sy;
+		for(y = dy; y < dy + h; y++) {		
+			i = sx;
+			for(x = dx; x < dx + w; x++) {
+				int r = BM_GETR(src, i, j),
+					g = BM_GETG(src, i, j),
+					b = BM_GETB(src, i, j),
+					a = BM_GETA(src, i, j);
+				BM_SET(dst, x, y, r, g, b, a);
+				i++;
+			}
+			j++;
+		}
 	}
-	
-	if(sy + h > src->h) {
-		int delta = sy + h - src->h;
-		h -= delta;
+#else
+	if(w == src->w && w == dst->w && BM_CONTIGUOUS(src) && BM_CONTIGUOUS(dst) && !BM_ALIASED(src, dst)) {
+		/* The rows are contiguous in both bitmaps */
+		memcpy(dst->data + dy * BM_ROW_SIZE(dst), src->data + sy * BM_ROW_SIZE(src), h * BM_ROW_SIZE(src));
+	} else if(BM_ALIASED(src, dst) && BM_PIXEL(dst, dx, dy) > BM_PIXEL(src, sx, sy)) {
+		/* Blitting a bitmap onto itself (or a view of it): Copy the rows 
+		 * bottom-up so that overlapping rows aren't overwritten before 
+		 * they're read. 
+		 */
+		for(y = h - 1; y >= 0; y--) {
+			memmove(BM_PIXEL(dst, dx, dy + y), BM_PIXEL(src, sx, sy + y), w * BM_BPP);
+		}
+	} else {
+		for(y = 0; y < h; y++) {
+			memmove(BM_PIXEL(dst, dx, dy + y), BM_PIXEL(src, sx, sy + y), w * BM_BPP);
+		}
+	}
+#endif
+}
+
+#ifndef BM_NO_SIMD
+/* Copies the {{w}} pixels in {{s}} whose RGB components differ from 
+ * those of {{key}} to {{d}}. {{rgb}} masks out the alpha component. 
+ */
+static void bm_masked_row(unsigned char *d, const unsigned char *s, int w, uint32_t key, uint32_t rgb) {
+	int i = 0;
+	uint32_t p;
+#ifdef BM_AVX2
+	__m256i k8 = _mm256_set1_epi32(key), m8 = _mm256_set1_epi32(rgb);
+	for(; i + 8 <= w; i += 8) {
+		__m256i sp = _mm256_loadu_si256((const __m256i *)(s + i * BM_BPP));
+		__m256i dp = _mm256_loadu_si256((const __m256i *)(d + i * BM_BPP));
+		__m256i t = _mm256_cmpeq_epi32(_mm256_and_si256(sp, m8), k8);
+		_mm256_storeu_si256((__m256i *)(d + i * BM_BPP), _mm256_blendv_epi8(sp, dp, t));
+	}
+#endif
+#ifdef BM_SSE2
+	__m128i k = _mm_set1_epi32(key), m = _mm_set1_epi32(rgb);
+	for(; i + 4 <= w; i += 4) {
+		__m128i sp = _mm_loadu_si128((const __m128i *)(s + i * BM_BPP));
+		__m128i dp = _mm_loadu_si128((const __m128i *)(d + i * BM_BPP));
+		/* t is all 1s for pixels that match the mask colour */
+		__m128i t = _mm_cmpeq_epi32(_mm_and_si128(sp, m), k);
+		dp = _mm_or_si128(_mm_and_si128(t, dp), _mm_andnot_si128(t, sp));
+		_mm_storeu_si128((__m128i *)(d + i * BM_BPP), dp);
+	}
+#endif
+	for(; i < w; i++) {
+		memcpy(&p, s + i * BM_BPP, sizeof p);
+		if((p & rgb) != key)
+			memcpy(d + i * BM_BPP, &p, sizeof p);
 	}
+}
+#endif
+
+void bm_maskedblit(struct bitmap *dst, int dx, int dy, struct bitmap *src, int sx, int sy, int w, int h) {
+	int x,y, i, j;
+	uint32_t rgb = BM_KEY_MASK(src), key = BM_KEY(src);
+
+	BM_READ(src);
+	if(dst->cmds && bm_record(dst, BM_CMD_MASKEDBLIT, dx, dy, dx + w - 1, dy + h - 1, src, 6, dx, dy, sx, sy, w, h))
+		return;
+	BM_WRITE(dst);
+	if(!bm_clip_blit(dst, &dx, &dy, src->w, src->h, &sx, &sy, &w, &h))
+		return;
 	
-	assert(dx >= 0 && dx + w <= dst->clip.x1);
-	assert(dy >= 0 && dy + h <= dst->clip.y1);	
-	assert(sx >= 0 && sx + w <= src->w);
-	assert(sy >= 0 && sy + h <= src->h);
+#ifndef BM_NO_SIMD
+	if(!BM_ALIASED(src, dst)) {
+		for(y = 0; y < h; y++) {
+			bm_masked_row(BM_PIXEL(dst, dx, dy + y), BM_PIXEL(src, sx, sy + y), w, key, rgb);
+		}
+		return;
+	}
+#endif
 	
 	j = sy;
 	for(y = dy; y < dy + h; y++) {		
 		i = sx;
 		for(x = dx; x < dx + w; x++) {
-			int r = BM_GETR(src, i, j),
-				g = BM_GETG(src, i, j),
-				b = BM_GETB(src, i, j),
-				a = BM_GETA(src, i, j);
-			BM_SET(dst, x, y, r, g, b, a);
+			uint32_t p = BM_GET_PIXEL(src, i, j);
+			if((p & rgb) != key)
+				BM_SET_PIXEL(dst, x, y, p);
 			i++;
 		}
 		j++;
 	}
 }
 
-void bm_maskedblit(struct bitmap *dst, int dx, int dy, struct bitmap *src, int sx, int sy, int w, int h) {
-	int x,y, i, j;
+void bm_mask_alpha(struct bitmap *b) {
+	uint32_t rgb = BM_RGB_MASK, key = b->color & rgb;
+	int x, y;
+	
+	BM_WRITE(b);
+	bm_dirty_all(b);
+	for(y = 0; y < b->h; y++) {
+		uint32_t *row = BM_ROW32(b, y);
+		for(x = 0; x < b->w; x++) {
+			if((row[x] & rgb) == key)
+				row[x] = 0;
+		}
+	}
+	b->flags |= BM_ALPHA_MASK;
+}
+
+/* Alpha blending:
+ * Pixels are blended with premultiplied alpha, so that
+ * dst = src + dst * (255 - src.a) / 255 for all four components.
+ * The SIMD kernels use the same arithmetic as BM_DIV255() so that 
+ * the results are identical to the scalar code.
+ */
+/* Blends the premultiplied pixel s, scaled by the opacity
+ * alpha, over the pixel d */
+static uint32_t bm_blend_px(uint32_t d, uint32_t s, int alpha) {
+	unsigned char *dc = (unsigned char *)&d, *sc = (unsigned char *)&s;
+	int i, sa;
+	if(alpha < 255) {
+		for(i = 0; i < 4; i++)
+			sc[i] = BM_DIV255(sc[i] * alpha);
+	}
+	sa = 255 - sc[3];
+	/* The sum only overflows if s is not properly premultiplied */
+	for(i = 0; i < 4; i++)
+		dc[i] = MIN(sc[i] + BM_DIV255(dc[i] * sa), 255);
+	return d;
+}
+
+#ifdef BM_SSE2
+/* Blends 4 premultiplied pixels in s over d with the SSE2 instructions.
+ * The pixels are widened to 16 bits per component, two pixels per half. */
+static __m128i bm_div255_epi16(__m128i x) {
+	x = _mm_add_epi16(x, _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+static __m128i bm_blend_half(__m128i d, __m128i s, __m128i alpha) {
+	__m128i inv;
+	s = bm_div255_epi16(_mm_mullo_epi16(s, alpha));
+	/* Broadcast each pixel's alpha to all its components */
+	inv = _mm_shufflelo_epi16(s, _MM_SHUFFLE(3,3,3,3));
+	inv = _mm_shufflehi_epi16(inv, _MM_SHUFFLE(3,3,3,3));
+	inv = _mm_sub_epi16(_mm_set1_epi16(255), inv);
+	return _mm_add_epi16(s, bm_div255_epi16(_mm_mullo_epi16(d, inv)));
+}
+
+static __m128i bm_blend4(__m128i d, __m128i s, __m128i alpha) {
+	__m128i z = _mm_setzero_si128();
+	__m128i lo = bm_blend_half(_mm_unpacklo_epi8(d, z), _mm_unpacklo_epi8(s, z), alpha);
+	__m128i hi = bm_blend_half(_mm_unpackhi_epi8(d, z), _mm_unpackhi_epi8(s, z), alpha);
+	return _mm_packus_epi16(lo, hi);
+}
+#endif
+
+/* Blends the w premultiplied pixels in s over d with opacity alpha.
+ * Pixels whose RGB components match key are skipped, unless rgb is 0.
+ * If sstep is 0, s is a single pixel that is blended over the whole row.
+ */
+static void bm_blend_row(unsigned char *d, const unsigned char *s, int sstep, int w, int alpha, uint32_t key, uint32_t rgb) {
+	int i = 0;
+	uint32_t p, q;
+#ifdef BM_SSE2
+	__m128i a = _mm_set1_epi16(alpha), k = _mm_set1_epi32(key), m = _mm_set1_epi32(rgb);
+	for(; i + 4 <= w; i += 4) {
+		__m128i sp, dp, t;
+		if(sstep)
+			sp = _mm_loadu_si128((const __m128i *)(s + i * BM_BPP));
+		else {
+			memcpy(&p, s, sizeof p);
+			sp = _mm_set1_epi32(p);
+		}
+		dp = _mm_loadu_si128((const __m128i *)(d + i * BM_BPP));
+		/* t is all 1s for pixels that match the mask colour */
+		t = _mm_cmpeq_epi32(_mm_and_si128(sp, m), k);
+		if(!rgb)
+			t = _mm_setzero_si128();
+		sp = bm_blend4(dp, sp, a);
+		dp = _mm_or_si128(_mm_and_si128(t, dp), _mm_andnot_si128(t, sp));
+		_mm_storeu_si128((__m128i *)(d + i * BM_BPP), dp);
+	}
+#endif
+	for(; i < w; i++) {
+		memcpy(&p, s + i * sstep, sizeof p);
+		if(rgb && (p & rgb) == key)
+			continue;
+		memcpy(&q, d + i * BM_BPP, sizeof q);
+		q = bm_blend_px(q, p, alpha);
+		memcpy(d + i * BM_BPP, &q, sizeof q);
+	}
+}
+
+/* The pen of b, premultiplied by its alpha */
+static uint32_t bm_pen_premul(struct bitmap *b) {
+	int a = BM_COMP(b->color, 3);
+	return bm_pack(BM_DIV255(BM_COMP(b->color, 0) * a), 
+		BM_DIV255(BM_COMP(b->color, 1) * a), 
+		BM_DIV255(BM_COMP(b->color, 2) * a), a);
+}
+
+void bm_blit_alpha(struct bitmap *dst, int dx, int dy, struct bitmap *src, int sx, int sy, int w, int h, int alpha) {
+	int y;
+	/* Opaque pixels of the bitmap colour are drawn unless asked otherwise */
+	uint32_t rgb = (src->flags & BM_BLEND_KEY) ? BM_KEY_MASK(src) : 0, key = BM_KEY(src);
+	unsigned char *row = NULL;
+
+	if(alpha <= 0)
+		return;
+	if(alpha > 255)
+		alpha = 255;
+	
+	BM_READ(src);
+	if(dst->cmds && bm_record(dst, BM_CMD_BLIT_ALPHA, dx, dy, dx + w - 1, dy + h - 1, src, 7, dx, dy, sx, sy, w, h, alpha))
+		return;
+	BM_WRITE(dst);
+	if(!bm_clip_blit(dst, &dx, &dy, src->w, src->h, &sx, &sy, &w, &h))
+		return;
+	
+	if(BM_ALIASED(src, dst)) {
+		/* Blend from a copy of the source row if the areas may overlap */
+		row = malloc(w * BM_BPP);
+		if(!row)
+			return;
+	}
+	
+	for(y = 0; y < h; y++) {
+		int j = (row && BM_PIXEL(dst, dx, dy) > BM_PIXEL(src, sx, sy)) ? h - 1 - y : y;
+		unsigned char *s = BM_PIXEL(src, sx, sy + j);
+		if(row) {
+			memcpy(row, s, w * BM_BPP);
+			s = row;
+		}
+		bm_blend_row(BM_PIXEL(dst, dx, dy + j), s, BM_BPP, w, alpha, key, rgb);
+	}
+	free(row);
+}
+
+/* A run of opaque pixels on a row of a struct bm_rle */
+struct bm_span {
+	int x, len;
+	/* Index of the span's first pixel in bm_rle.pixels */
+	int offset;
+};
+
+struct bm_rle {
+	int w, h;
+	
+	/* The spans of row j are spans[rows[j]] to spans[rows[j+1] - 1],
+	 * sorted from left to right. */
+	int *rows;
+	struct bm_span *spans;
+	
+	/* The opaque pixels, in the same format as bitmap.data */
+	unsigned char *pixels;
+};
+
+struct bm_rle *bm_rle_create(struct bitmap *b, int sx, int sy, int w, int h) {
+	struct bm_rle *r;
+	int x, y, ns = 0, np = 0;
+	uint32_t rgb = BM_KEY_MASK(b), key = BM_KEY(b);
+	
+	BM_READ(b);
+	if(sx < 0) { w += sx; sx = 0; }
+	if(sy < 0) { h += sy; sy = 0; }
+	if(sx + w > b->w) w = b->w - sx;
+	if(sy + h > b->h) h = b->h - sy;
+	if(w < 0) w = 0;
+	if(h < 0) h = 0;
+	
+	/* First pass counts the spans and opaque pixels */
+	for(y = 0; y < h; y++) {
+		int in = 0;
+		for(x = 0; x < w; x++) {
+			int opaque = (BM_GET_PIXEL(b, sx + x, sy + y) & rgb) != key;
+			if(opaque) {
+				if(!in) ns++;
+				np++;
+			}
+			in = opaque;
+		}
+	}
+	
+	r = malloc(sizeof *r);
+	if(!r)
+		return NULL;
+	r->w = w;
+	r->h = h;
+	r->rows = malloc((h + 1) * sizeof *r->rows);
+	r->spans = malloc((ns ? ns : 1) * sizeof *r->spans);
+	r->pixels = malloc((np ? np : 1) * BM_BPP);
+	if(!r->rows || !r->spans || !r->pixels) {
+		bm_rle_free(r);
+		return NULL;
+	}
+	
+	/* Second pass records them */
+	ns = 0;
+	np = 0;
+	for(y = 0; y < h; y++) {
+		struct bm_span *span = NULL;
+		r->rows[y] = ns;
+		for(x = 0; x < w; x++) {
+			uint32_t p = BM_GET_PIXEL(b, sx + x, sy + y);
+			if((p & rgb) != key) {
+				if(!span) {
+					span = &r->spans[ns++];
+					span->x = x;
+					span->len = 0;
+					span->offset = np;
+				}
+				memcpy(r->pixels + np * BM_BPP, &p, BM_BPP);
+				span->len++;
+				np++;
+			} else {
+				span = NULL;
+			}
+		}
+	}
+	r->rows[h] = ns;
+	
+	return r;
+}
+
+void bm_rle_free(struct bm_rle *r) {
+	if(!r) return;
+	if(bm_deferring)
+		bm_sync(r);
+	free(r->rows);
+	free(r->spans);
+	free(r->pixels);
+	free(r);
+}
+
+void bm_rle_blit(struct bitmap *dst, int dx, int dy, struct bm_rle *src, int sx, int sy, int w, int h) {
+	int y, i;
+	
+	if(dst->cmds && bm_record(dst, BM_CMD_RLE_BLIT, dx, dy, dx + w - 1, dy + h - 1, src, 6, dx, dy, sx, sy, w, h))
+		return;
+	BM_WRITE(dst);
+	if(!bm_clip_blit(dst, &dx, &dy, src->w, src->h, &sx, &sy, &w, &h))
+		return;
+	
+	for(y = 0; y < h; y++) {
+		int j = sy + y;
+		for(i = src->rows[j]; i < src->rows[j + 1]; i++) {
+			struct bm_span *span = &src->spans[i];
+			int x0 = span->x, x1 = span->x + span->len;
+			if(x0 >= sx + w)
+				break;
+			if(x1 <= sx)
+				continue;
+			if(x0 < sx) x0 = sx;
+			if(x1 > sx + w) x1 = sx + w;
+			memcpy(BM_PIXEL(dst, dx + x0 - sx, dy + y), 
+				src->pixels + (span->offset + x0 - span->x) * BM_BPP, 
+				(x1 - x0) * BM_BPP);
+		}
+	}
+}
+
+/* Atlases:
+ * Small bitmaps are copied into shared pages so that the sprites drawn
+ * in a frame are close together in memory. Every page is packed with
+ * a skyline: A list of segments, left to right, giving the height up to
+ * which the columns they span are used. A sprite goes where its top
+ * ends up lowest, and its segment replaces the ones under it.
+ * Every sprite has a 1 pixel border of its edge pixels around it, so
+ * that bilinear filtering doesn't pick up its neighbours.
+ */
+struct bm_skyline {
+	int x, y, w;
+};
+
+struct bm_atlas_page {
+	struct bitmap *bmp;
+	struct bm_skyline *sky;
+	int nsky;
+	struct bm_atlas_page *next;
+};
+
+struct bm_atlas {
+	int w, h;
+	struct bm_atlas_page *pages;
+};
+
+struct bm_atlas *bm_atlas_create(int w, int h) {
+	struct bm_atlas *a;
+	if(w <= 2 || h <= 2)
+		return NULL;
+	a = calloc(1, sizeof *a);
+	if(!a)
+		return NULL;
+	a->w = w;
+	a->h = h;
+	return a;
+}
+
+void bm_atlas_free(struct bm_atlas *a) {
+	if(!a) return;
+	while(a->pages) {
+		struct bm_atlas_page *p = a->pages;
+		a->pages = p->next;
+		bm_free(p->bmp);
+		free(p->sky);
+		free(p);
+	}
+	free(a);
+}
+
+int bm_atlas_pages(struct bm_atlas *a) {
+	struct bm_atlas_page *p;
+	int n = 0;
+	for(p = a->pages; p; p = p->next)
+		n++;
+	return n;
+}
+
+/* Returns the y at which a w*h area fits on the skyline at segment i,
+ * or -1 if it doesn't */
+static int bm_skyline_fit(struct bm_atlas_page *p, int i, int w, int h) {
+	int x = p->sky[i].x, y = 0;
+	if(x + w > p->bmp->w)
+		return -1;
+	for(; w > 0; i++) {
+		assert(i < p->nsky);
+		y = MAX(y, p->sky[i].y);
+		if(y + h > p->bmp->h)
+			return -1;
+		w -= p->sky[i].w;
+	}
+	return y;
+}
+
+/* Finds a place for a w*h area on page p. Returns 0 if it's full */
+static int bm_skyline_add(struct bm_atlas_page *p, int w, int h, int *x, int *y) {
+	int i, j, best = -1, by = 0, bw = 0, fy;
+	struct bm_skyline *s;
+	
+	for(i = 0; i < p->nsky; i++) {
+		fy = bm_skyline_fit(p, i, w, h);
+		if(fy < 0)
+			continue;
+		if(best < 0 || fy < by || (fy == by && p->sky[i].w < bw)) {
+			best = i;
+			by = fy;
+			bw = p->sky[i].w;
+		}
+	}
+	if(best < 0)
+		return 0;
+	
+	/* The new segment can add one to the list */
+	s = realloc(p->sky, (p->nsky + 1) * sizeof *s);
+	if(!s)
+		return 0;
+	p->sky = s;
+	*x = s[best].x;
+	*y = by;
+	memmove(s + best + 1, s + best, (p->nsky - best) * sizeof *s);
+	p->nsky++;
+	s[best].x = *x;
+	s[best].y = by + h;
+	s[best].w = w;
+	
+	/* Shrink or remove the segments the new one covers */
+	for(i = best + 1; i < p->nsky; ) {
+		int shrink = s[best].x + s[best].w - s[i].x;
+		if(shrink <= 0)
+			break;
+		s[i].x += shrink;
+		s[i].w -= shrink;
+		if(s[i].w > 0)
+			break;
+		memmove(s + i, s + i + 1, (p->nsky - i - 1) * sizeof *s);
+		p->nsky--;
+	}
+	
+	/* Merge neighbours of the same height */
+	for(i = 0, j = 1; j < p->nsky; j++) {
+		if(s[j].y == s[i].y)
+			s[i].w += s[j].w;
+		else
+			s[++i] = s[j];
+	}
+	p->nsky = i + 1;
+	return 1;
+}
+
+static struct bm_atlas_page *bm_atlas_new_page(struct bm_atlas *a) {
+	struct bm_atlas_page *p = calloc(1, sizeof *p), **q;
+	if(!p)
+		return NULL;
+	p->bmp = bm_create(a->w, a->h);
+	p->sky = malloc(sizeof *p->sky);
+	if(!p->bmp || !p->sky) {
+		if(p->bmp) bm_free(p->bmp);
+		free(p->sky);
+		free(p);
+		return NULL;
+	}
+	p->sky[0].x = 0;
+	p->sky[0].y = 0;
+	p->sky[0].w = a->w;
+	p->nsky = 1;
+	/* Append it, so that the fuller pages are tried first */
+	for(q = &a->pages; *q; q = &(*q)->next);
+	*q = p;
+	return p;
+}
+
+int bm_atlas_add(struct bm_atlas *a, struct bitmap *b, struct bm_sprite *s) {
+	struct bm_atlas_page *p;
+	int x, y, i, w = b->w + 2, h = b->h + 2;
+	
+	if(w > a->w || h > a->h || (b->flags & BM_ALPHA_MASK))
+		return 0;
+	for(p = a->pages; p; p = p->next) {
+		if(bm_skyline_add(p, w, h, &x, &y))
+			break;
+	}
+	if(!p) {
+		p = bm_atlas_new_page(a);
+		if(!p || !bm_skyline_add(p, w, h, &x, &y))
+			return 0;
+	}
+	
+	BM_READ(b);
+	BM_WRITE(p->bmp);
+	for(i = -1; i <= b->h; i++) {
+		uint32_t *src = BM_ROW32(b, MIN(MAX(i, 0), b->h - 1)), 
+			*dst = BM_ROW32(p->bmp, y + 1 + i) + x;
+		dst[0] = src[0];
+		memcpy(dst + 1, src, b->w * BM_BPP);
+		dst[w - 1] = src[b->w - 1];
+	}
+	
+	s->bmp = p->bmp;
+	s->x = x + 1;
+	s->y = y + 1;
+	s->w = b->w;
+	s->h = b->h;
+	s->color = b->color;
+	s->flags = b->flags & BM_BLEND_KEY;
+	return 1;
+}
+
+int bm_sprite_clip(const struct bm_sprite *s, int *dx, int *dy, int *sx, int *sy, int *w, int *h) {
+	if(*sx < 0) {
+		*dx -= *sx;
+		*w += *sx;
+		*sx = 0;
+	}
+	if(*sy < 0) {
+		*dy -= *sy;
+		*h += *sy;
+		*sy = 0;
+	}
+	if(*sx + *w > s->w)
+		*w = s->w - *sx;
+	if(*sy + *h > s->h)
+		*h = s->h - *sy;
+	*sx += s->x;
+	*sy += s->y;
+	return *w > 0 && *h > 0;
+}
+
+/* Interpolates between the packed pixels a and b; f is 0-256 */
+static uint32_t bm_lerp_px(uint32_t a, uint32_t b, int f) {
+	unsigned char *ca = (unsigned char *)&a, *cb = (unsigned char *)&b;
+	int i;
+	for(i = 0; i < 4; i++)
+		ca[i] = (ca[i] * (256 - f) + cb[i] * f) >> 8;
+	return a;
+}
+
+/* Indexed bitmaps:
+ * One byte per pixel that selects a colour in a 256 entry palette.
+ * Blitting between indexed bitmaps copies indices, so they should 
+ * share a palette. The palette is only applied when the indexed 
+ * bitmap is drawn on an RGBA bitmap with bm_indexed_resolve(), so 
+ * palette effects cost O(256) instead of O(pixels).
+ */
+struct bm_indexed *bm_indexed_create(int w, int h) {
+	struct bm_indexed *b = calloc(1, sizeof *b);
+	if(!b)
+		return NULL;
+	b->w = w;
+	b->h = h;
+	b->data = calloc((size_t)w * h, 1);
+	if(!b->data) {
+		free(b);
+		return NULL;
+	}
+	return b;
+}
+
+struct bm_indexed *bm_indexed_from_bitmap(struct bitmap *bm) {
+	uint32_t rgb = BM_KEY_MASK(bm), key = BM_KEY(bm);
+	struct bm_indexed *b;
+	int x, y, n = 0, last = 0;
+	
+	BM_READ(bm);
+	b = bm_indexed_create(bm->w, bm->h);
+	if(!b)
+		return NULL;
+	
+	for(y = 0; y < bm->h; y++) {
+		uint32_t *row = BM_ROW32(bm, y);
+		unsigned char *d = b->data + y * b->w;
+		for(x = 0; x < bm->w; x++) {
+			/* Neighbouring pixels tend to be the same colour */
+			int i = last;
+			if(b->palette[i] != row[x] || i >= n) {
+				for(i = 0; i < n && b->palette[i] != row[x]; i++);
+				if(i == n) {
+					if(n == 256) {
+						bm_indexed_free(b);
+						return NULL;
+					}
+					b->palette[n++] = row[x];
+				}
+				last = i;
+			}
+			d[x] = i;
+		}
+	}
+	
+	/* The bitmap's mask colour becomes the mask index; If no pixel has
+	 * it, it gets an entry of its own so that the mask skips nothing */
+	for(x = 0; x < n && (b->palette[x] & rgb) != key; x++);
+	if(x == n) {
+		if(n == 256) {
+			bm_indexed_free(b);
+			return NULL;
+		}
+		b->palette[n] = bm->color;
+	}
+	b->mask = x;
+	return b;
+}
+
+void bm_indexed_free(struct bm_indexed *b) {
+	if(b->data) free(b->data);
+	free(b);
+}
+
+void bm_indexed_set_color(struct bm_indexed *b, int i, int R, int G, int B) {
+	assert(i >= 0 && i < 256);
+	b->palette[i] = bm_pack(R, G, B, 0xFF);
+}
+
+void bm_indexed_clear(struct bm_indexed *b, int i) {
+	memset(b->data, i, (size_t)b->w * b->h);
+}
+
+void bm_indexed_fillrect(struct bm_indexed *b, int x0, int y0, int x1, int y1, int i) {
+	int y;
+	if(x1 < x0) {
+		int t = x0; x0 = x1; x1 = t;
+	}
+	if(y1 < y0) {
+		int t = y0; y0 = y1; y1 = t;
+	}
+	x0 = MAX(x0, 0);
+	y0 = MAX(y0, 0);
+	x1 = MIN(x1 + 1, b->w);
+	y1 = MIN(y1 + 1, b->h);
+	if(x1 <= x0)
+		return;
+	for(y = y0; y < y1; y++)
+		memset(b->data + y * b->w + x0, i, x1 - x0);
+}
+
+void bm_indexed_blit(struct bm_indexed *dst, int dx, int dy, struct bm_indexed *src, int sx, int sy, int w, int h) {
+	int y;
+	if(!bm_clip_area(0, 0, dst->w, dst->h, &dx, &dy, src->w, src->h, &sx, &sy, &w, &h))
+		return;
+	for(y = 0; y < h; y++)
+		memmove(dst->data + (dy + y) * dst->w + dx, src->data + (sy + y) * src->w + sx, w);
+}
+
+void bm_indexed_maskedblit(struct bm_indexed *dst, int dx, int dy, struct bm_indexed *src, int sx, int sy, int w, int h) {
+	int x, y;
+	unsigned char mask = src->mask;
+	if(!bm_clip_area(0, 0, dst->w, dst->h, &dx, &dy, src->w, src->h, &sx, &sy, &w, &h))
+		return;
+	for(y = 0; y < h; y++) {
+		unsigned char *d = dst->data + (dy + y) * dst->w + dx;
+		const unsigned char *s = src->data + (sy + y) * src->w + sx;
+		x = 0;
+#ifdef BM_SSE2
+		if(src != dst) {
+			/* 16 pixels at a time: Keep d where s is the mask index */
+			__m128i m = _mm_set1_epi8((char)mask);
+			for(; x + 16 <= w; x += 16) {
+				__m128i sv = _mm_loadu_si128((const __m128i *)(s + x));
+				__m128i dv = _mm_loadu_si128((const __m128i *)(d + x));
+				__m128i k = _mm_cmpeq_epi8(sv, m);
+				_mm_storeu_si128((__m128i *)(d + x), 
+					_mm_or_si128(_mm_and_si128(k, dv), _mm_andnot_si128(k, sv)));
+			}
+		}
+#endif
+		for(; x < w; x++) {
+			if(s[x] != mask)
+				d[x] = s[x];
+		}
+	}
+}
+
+void bm_indexed_cycle(struct bm_indexed *b, int first, int last, int steps) {
+	uint32_t tmp[256];
+	int n, i;
+	if(first > last) {
+		int t = first; first = last; last = t;
+	}
+	first = MAX(first, 0);
+	last = MIN(last, 255);
+	n = last - first + 1;
+	if(n <= 1)
+		return;
+	steps %= n;
+	if(steps < 0)
+		steps += n;
+	/* Entry i moves to i + steps, wrapping around within the range */
+	for(i = 0; i < n; i++)
+		tmp[(i + steps) % n] = b->palette[first + i];
+	memcpy(b->palette + first, tmp, n * sizeof *tmp);
+}
+
+void bm_indexed_fade(struct bm_indexed *b, const unsigned int *from, int R, int G, int B, int amount) {
+	uint32_t c = bm_pack(R, G, B, 0xFF);
+	int i;
+	amount = MAX(0, MIN(amount, 255));
+	/* bm_lerp_px() goes to 256 for the full target colour */
+	amount += amount >> 7;
+	for(i = 0; i < 256; i++)
+		b->palette[i] = bm_lerp_px(from[i], c, amount);
+}
+
+void bm_indexed_resolve(struct bitmap *dst, int dx, int dy, struct bm_indexed *src) {
+	int y, sx = 0, sy = 0, w = src->w, h = src->h;
+	BM_WRITE(dst);
+	if(!bm_clip_blit(dst, &dx, &dy, src->w, src->h, &sx, &sy, &w, &h))
+		return;
+	for(y = 0; y < h; y++)
+		bm_lut_row(BM_ROW32(dst, dy + y) + dx, src->data + (sy + y) * src->w + sx, w, src->palette);
+}
+
+void bm_indexed_draw(struct bitmap *dst, int dx, int dy, struct bm_indexed *src, int sx, int sy, int w, int h) {
+	int x, y;
+	unsigned char mask = src->mask;
+	BM_WRITE(dst);
+	if(!bm_clip_blit(dst, &dx, &dy, src->w, src->h, &sx, &sy, &w, &h))
+		return;
+	for(y = 0; y < h; y++) {
+		uint32_t *d = BM_ROW32(dst, dy + y) + dx;
+		const unsigned char *s = src->data + (sy + y) * src->w + sx;
+		for(x = 0; x < w; x++) {
+			if(s[x] != mask)
+				d[x] = src->palette[s[x]];
+		}
+	}
+}
+
+/* Source coordinate of each destination column or row of bm_blit_ex(),
+ * with the fraction towards the next source pixel (0-255) for
+ * the bilinear filter. 
+ */
+struct bm_step {
+	int i, f;
+};
+
+/* Computes the source coordinates for the destination pixels n0 to n1-1
+ * of a d pixels wide area scaled from the s pixels at s0. 
+ * The coordinates are 16.16 fixed point, sampled at the pixel centres.
+ * Returns the number of leading pixels that fall outside of the 
+ * source bitmap of size lim (to be skipped) and stores the number
+ * of usable pixels in *n.
+ */
+static int bm_make_steps(struct bm_step *t, int n0, int n1, int d, int s0, int s, int lim, int bilinear, int *n) {
+	int i, first = -1, last = -1;
+	long step = ((long)s << 16) / d, u;
+	
+	/* Centre of the first pixel; The bilinear filter is offset by half 
+	 * a source pixel so that it interpolates between pixel centres */
+	u = n0 * step + step / 2;
+	if(bilinear)
+		u -= 0x8000;
+	
+	for(i = 0; i < n1 - n0; i++, u += step) {
+		long c = u < 0 ? 0 : u;
+		int k = s0 + (int)(c >> 16);
+		t[i].i = k;
+		t[i].f = bilinear ? (int)((c >> 8) & 0xFF) : 0;
+		/* Don't interpolate past the right edge of the source area */
+		if(k >= s0 + s - 1)
+			t[i].f = 0;
+		if(k >= 0 && k < lim) {
+			if(first < 0)
+				first = i;
+			last = i;
+		}
+	}
+	if(first < 0) {
+		*n = 0;
+		return 0;
+	}
+	*n = last - first + 1;
+	return first;
+}
+
+/* Moves the n steps at t+skip to the start of t, in reverse order */
+static void bm_reverse_steps(struct bm_step *t, int skip, int n) {
+	int i;
+	memmove(t, t + skip, n * sizeof *t);
+	for(i = 0; i < n / 2; i++) {
+		struct bm_step s = t[i];
+		t[i] = t[n - 1 - i];
+		t[n - 1 - i] = s;
+	}
+}
+
+/* Blends the pixels p00,p01 above p10,p11 with the fractions fx,fy 
+ * (0-255) of the bilinear filter into *p. Returns 0 if it comes out
+ * as the mask colour, and must not be drawn */
+static int bm_bilinear_px(uint32_t p00, uint32_t p01, uint32_t p10, uint32_t p11, int fx, int fy, int mask, uint32_t rgb, uint32_t key, uint32_t *p) {
+	if(mask && ((p00 & rgb) == key || (p01 & rgb) == key 
+				|| (p10 & rgb) == key || (p11 & rgb) == key)) {
+		/* Don't bleed the mask colour into the edges:
+		 * Use the nearest pixel instead */
+		*p = fy < 128 ? (fx < 128 ? p00 : p01) : (fx < 128 ? p10 : p11);
+		return (*p & rgb) != key;
+	}
+	*p = bm_lerp_px(bm_lerp_px(p00, p01, fx), bm_lerp_px(p10, p11, fx), fy);
+	return 1;
+}
+
+/* Copies the w pixels at s to d in reverse order, leaving out those 
+ * that match the mask colour if mask is set */
+static void bm_reverse_row(uint32_t *d, const uint32_t *s, int w, int mask, uint32_t key, uint32_t rgb) {
+	int i = 0;
+	uint32_t p;
+#ifdef BM_AVX2
+	__m256i rev8 = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	__m256i k8 = _mm256_set1_epi32(key), m8 = _mm256_set1_epi32(rgb);
+	for(; i + 8 <= w; i += 8) {
+		__m256i sp = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i *)(s + w - 8 - i)), rev8);
+		if(mask) {
+			__m256i dp = _mm256_loadu_si256((const __m256i *)(d + i));
+			sp = _mm256_blendv_epi8(sp, dp, _mm256_cmpeq_epi32(_mm256_and_si256(sp, m8), k8));
+		}
+		_mm256_storeu_si256((__m256i *)(d + i), sp);
+	}
+#endif
+#ifdef BM_SSE2
+	__m128i k4 = _mm_set1_epi32(key), m4 = _mm_set1_epi32(rgb);
+	for(; i + 4 <= w; i += 4) {
+		__m128i sp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(s + w - 4 - i)), _MM_SHUFFLE(0, 1, 2, 3));
+		if(mask) {
+			__m128i dp = _mm_loadu_si128((const __m128i *)(d + i));
+			__m128i t = _mm_cmpeq_epi32(_mm_and_si128(sp, m4), k4);
+			sp = _mm_or_si128(_mm_and_si128(t, dp), _mm_andnot_si128(t, sp));
+		}
+		_mm_storeu_si128((__m128i *)(d + i), sp);
+	}
+#endif
+	for(; i < w; i++) {
+		p = s[w - 1 - i];
+		if(!mask || (p & rgb) != key)
+			d[i] = p;
+	}
+}
+
+/* bm_blit_ex() without scaling, but mirrored by the BM_BLIT_FLIP_H
+ * and BM_BLIT_FLIP_V flags: The source is walked backwards, so
+ * no flipped copy is needed. */
+static void bm_blit_flipped(struct bitmap *dst, int dx, int dy, struct bitmap *src, int sx, int sy, int w, int h, int flags) {
+	int y, k, fh = flags & BM_BLIT_FLIP_H, fv = flags & BM_BLIT_FLIP_V;
+	uint32_t rgb = BM_KEY_MASK(src), key = BM_KEY(src);
+	
+	/* Clip to the source: Cutting columns off the left of a flipped 
+	 * source takes them off the right of the destination, and so on */
+	if(sx < 0) {
+		if(!fh)
+			dx -= sx;
+		w += sx;
+		sx = 0;
+	}
+	if(sx + w > src->w) {
+		if(fh)
+			dx += sx + w - src->w;
+		w = src->w - sx;
+	}
+	if(sy < 0) {
+		if(!fv)
+			dy -= sy;
+		h += sy;
+		sy = 0;
+	}
+	if(sy + h > src->h) {
+		if(fv)
+			dy += sy + h - src->h;
+		h = src->h - sy;
+	}
+	if(w <= 0 || h <= 0)
+		return;
+	if(BM_ALIASED(src, dst)) {
+		/* Mirroring in place would overwrite pixels before they're read */
+		struct bitmap *tmp = bm_create(w, h);
+		if(!tmp)
+			return;
+		tmp->color = src->color;
+		tmp->flags = src->flags;
+		bm_blit(tmp, 0, 0, src, sx, sy, w, h);
+		bm_blit_flipped(dst, dx, dy, tmp, 0, 0, w, h, flags);
+		bm_free(tmp);
+		return;
+	}
+	
+	/* Clip to the destination's clipping rectangle */
+	if(dx < dst->clip.x0) {
+		k = dst->clip.x0 - dx;
+		if(!fh)
+			sx += k;
+		dx += k;
+		w -= k;
+	}
+	if(dx + w > dst->clip.x1) {
+		k = dx + w - dst->clip.x1;
+		if(fh)
+			sx += k;
+		w -= k;
+	}
+	if(dy < dst->clip.y0) {
+		k = dst->clip.y0 - dy;
+		if(!fv)
+			sy += k;
+		dy += k;
+		h -= k;
+	}
+	if(dy + h > dst->clip.y1) {
+		k = dy + h - dst->clip.y1;
+		if(fv)
+			sy += k;
+		h -= k;
+	}
+	if(w <= 0 || h <= 0)
+		return;
+	BM_DIRTY(dst, dx, dy, dx + w - 1, dy + h - 1);
+	
+	for(y = 0; y < h; y++) {
+		uint32_t *d = BM_ROW32(dst, dy + y) + dx;
+		const uint32_t *s = BM_ROW32(src, fv ? sy + h - 1 - y : sy + y) + sx;
+		if(fh) {
+			bm_reverse_row(d, s, w, flags & BM_BLIT_MASK, key, rgb);
+		} else if(flags & BM_BLIT_MASK) {
+#ifdef BM_NO_SIMD
+			int x;
+			for(x = 0; x < w; x++) {
+				if((s[x] & rgb) != key)
+					d[x] = s[x];
+			}
+#else
+			bm_masked_row((unsigned char *)d, (const unsigned char *)s, w, key, rgb);
+#endif
+		} else {
+			memcpy(d, s, w * BM_BPP);
+		}
+	}
+}
+
+void bm_blit_ex(struct bitmap *dst, int dx, int dy, int dw, int dh, struct bitmap *src, int sx, int sy, int sw, int sh, int flags) {
+	int x, y, x0, x1, y0, y1, nx, ny, skip;
+	int mask = flags & BM_BLIT_MASK, bilinear = flags & BM_BLIT_BILINEAR;
+	int flip = flags & (BM_BLIT_FLIP_H | BM_BLIT_FLIP_V);
+	uint32_t rgb = BM_KEY_MASK(src), key = BM_KEY(src);
+	struct bm_step *xt, *yt;
+	
+	BM_READ(src);
+	if(dst->cmds && bm_record(dst, BM_CMD_BLIT_EX, dx, dy, dx + dw - 1, dy + dh - 1, src, 9, dx, dy, dw, dh, sx, sy, sw, sh, flags))
+		return;
+	BM_WRITE(dst);
+	if(sw == dw && sh == dh) {
+		if(flip) {
+			bm_blit_flipped(dst, dx, dy, src, sx, sy, dw, dh, flags);
+		} else if(mask) {
+			bm_maskedblit(dst, dx, dy, src, sx, sy, dw, dh);
+		} else {
+			bm_blit(dst, dx, dy, src, sx, sy, dw, dh);
+		}
+		return;
+	}
+	
+	if(sw <= 0 || sh <= 0 || dw <= 0 || dh <= 0)
+		return;
+	
+	/* Clip the destination area once, up front */
+	x0 = MAX(dx, dst->clip.x0);
+	x1 = MIN(dx + dw, dst->clip.x1);
+	y0 = MAX(dy, dst->clip.y0);
+	y1 = MIN(dy + dh, dst->clip.y1);
+	if(x0 >= x1 || y0 >= y1)
+		return;
+	BM_DIRTY(dst, x0, y0, x1 - 1, y1 - 1);
+	
+	/* Precompute the source column of every destination column,
+	 * and the source row of every destination row */
+	xt = malloc((x1 - x0) * sizeof *xt);
+	yt = malloc((y1 - y0) * sizeof *yt);
+	if(!xt || !yt)
+		goto done;
+	
+	if(flags & BM_BLIT_FLIP_H) {
+		/* Column x samples what column dw-1-x would without the flip */
+		skip = bm_make_steps(xt, dx + dw - x1, dx + dw - x0, dw, sx, sw, src->w, bilinear, &nx);
+		x0 = x1 - skip - nx;
+		bm_reverse_steps(xt, skip, nx);
+	} else {
+		skip = bm_make_steps(xt, x0 - dx, x1 - dx, dw, sx, sw, src->w, bilinear, &nx);
+		x0 += skip;
+		memmove(xt, xt + skip, nx * sizeof *xt);
+	}
+	if(flags & BM_BLIT_FLIP_V) {
+		skip = bm_make_steps(yt, dy + dh - y1, dy + dh - y0, dh, sy, sh, src->h, bilinear, &ny);
+		y0 = y1 - skip - ny;
+		bm_reverse_steps(yt, skip, ny);
+	} else {
+		skip = bm_make_steps(yt, y0 - dy, y1 - dy, dh, sy, sh, src->h, bilinear, &ny);
+		y0 += skip;
+		memmove(yt, yt + skip, ny * sizeof *yt);
+	}
+	
+	for(y = 0; y < ny; y++) {
+		uint32_t *s = BM_ROW32(src, yt[y].i), *d = BM_ROW32(dst, y0 + y) + x0;
+		if(bilinear) {
+			int fy = yt[y].f;
+			uint32_t *s1 = fy && yt[y].i + 1 < src->h ? BM_ROW32(src, yt[y].i + 1) : s;
+			for(x = 0; x < nx; x++) {
+				int i = xt[x].i, fx = xt[x].f, j = fx && i + 1 < src->w ? i + 1 : i;
+				uint32_t p;
+				if(bm_bilinear_px(s[i], s[j], s1[i], s1[j], fx, fy, mask, rgb, key, &p))
+					d[x] = p;
+			}
+		} else if(mask) {
+			for(x = 0; x < nx; x++) {
+				uint32_t p = s[xt[x].i];
+				if((p & rgb) != key)
+					d[x] = p;
+			}
+		} else {
+			for(x = 0; x < nx; x++)
+				d[x] = s[xt[x].i];
+		}
+	}
+done:
+	free(xt);
+	free(yt);
+}
+
+/* bm_blit_rotozoom() maps every destination pixel back to the source.
+ * The inverse of the rotation and scale is kept in 16.16 fixed point 
+ * as ca = cos(angle)/scale and sa = sin(angle)/scale: The source
+ * position moves by ca,-sa for every pixel to the right and by sa,ca
+ * for every row down. The pixels of a row that land in the source area
+ * form a single span, which is solved for exactly, so the loop that 
+ * draws it does no tests.
+ * Command lists record ca and sa rather than the angle and the scale,
+ * so a replay draws exactly the same pixels.
+ */
+
+/* Rounds n/d towards minus infinity */
+static int64_t bm_floor_div(int64_t n, int64_t d) {
+	int64_t q = n / d;
+	if((n % d) && ((n < 0) != (d < 0)))
+		q--;
+	return q;
+}
+
+/* Narrows k0..k1 to the steps k where lo <= f + k*df < hi */
+static void bm_span_limit(int64_t f, int64_t df, int64_t lo, int64_t hi, int64_t *k0, int64_t *k1) {
+	if(df == 0) {
+		if(f < lo || f >= hi)
+			*k1 = *k0 - 1;
+	} else if(df > 0) {
+		*k0 = MAX(*k0, -bm_floor_div(f - lo, df));
+		*k1 = MIN(*k1, bm_floor_div(hi - 1 - f, df));
+	} else {
+		*k0 = MAX(*k0, -bm_floor_div(f - hi + 1, df));
+		*k1 = MIN(*k1, bm_floor_div(lo - f, df));
+	}
+}
+
+/* The box x0,y0,x1,y1 (inclusive) that a sw*sh area centred on cx,cy 
+ * covers when it is rotated and scaled by ca,sa */
+static void bm_rotozoom_box(int cx, int cy, int sw, int sh, int ca, int sa, int box[4]) {
+	double k = 65536.0 / ((double)ca * ca + (double)sa * sa);
+	double c = abs(ca) * k, s = abs(sa) * k;
+	double hw = MIN((c * sw + s * sh) / 2, 1 << 28), hh = MIN((s * sw + c * sh) / 2, 1 << 28);
+	/* Leave a pixel for rounding; The spans are exact anyway */
+	box[0] = cx - (int)hw - 2;
+	box[1] = cy - (int)hh - 2;
+	box[2] = cx + (int)hw + 2;
+	box[3] = cy + (int)hh + 2;
+}
+
+static void bm_rotozoom(struct bitmap *dst, int cx, int cy, struct bitmap *src, int sx, int sy, int sw, int sh, int ca, int sa, int flags) {
+	int x, y, x0, y0, x1, y1, n, box[4], umax, vmax;
+	int mask = flags & BM_BLIT_MASK, bilinear = flags & BM_BLIT_BILINEAR;
+	uint32_t rgb = BM_KEY_MASK(src), key = BM_KEY(src), p;
+	int64_t uc, vc, ulo, uhi, vlo, vhi;
+	int ux, uy, vx, vy;
+	
+	if(sw <= 0 || sh <= 0 || (!ca && !sa))
+		return;
+	bm_rotozoom_box(cx, cy, sw, sh, ca, sa, box);
+	if(dst->cmds && bm_record(dst, BM_CMD_ROTOZOOM, box[0], box[1], box[2], box[3], src, 9, cx, cy, sx, sy, sw, sh, ca, sa, flags))
+		return;
+	BM_WRITE(dst);
+	if(ca == 0x10000 && sa == 0) {
+		/* Neither rotated nor scaled; The filter has nothing to do */
+		if(flags & (BM_BLIT_FLIP_H | BM_BLIT_FLIP_V))
+			bm_blit_flipped(dst, cx - (sw + 1) / 2, cy - (sh + 1) / 2, src, sx, sy, sw, sh, flags);
+		else if(mask)
+			bm_maskedblit(dst, cx - (sw + 1) / 2, cy - (sh + 1) / 2, src, sx, sy, sw, sh);
+		else
+			bm_blit(dst, cx - (sw + 1) / 2, cy - (sh + 1) / 2, src, sx, sy, sw, sh);
+		return;
+	}
+	
+	x0 = MAX(box[0], dst->clip.x0);
+	x1 = MIN(box[2] + 1, dst->clip.x1);
+	y0 = MAX(box[1], dst->clip.y0);
+	y1 = MIN(box[3] + 1, dst->clip.y1);
+	
+	/* The centre of the source area maps to cx,cy, but only the part 
+	 * of the area that is inside src is drawn */
+	uc = (2 * (int64_t)sx + sw) * 0x8000;
+	vc = (2 * (int64_t)sy + sh) * 0x8000;
+	umax = MIN(sx + sw, src->w);
+	vmax = MIN(sy + sh, src->h);
+	if(x0 >= x1 || y0 >= y1 || umax <= MAX(sx, 0) || vmax <= MAX(sy, 0))
+		return;
+	ulo = (int64_t)MAX(sx, 0) << 16;
+	vlo = (int64_t)MAX(sy, 0) << 16;
+	uhi = (int64_t)umax << 16;
+	vhi = (int64_t)vmax << 16;
+	BM_DIRTY(dst, x0, y0, x1 - 1, y1 - 1);
+	
+	/* How u and v change along x and y; A flip turns the source 
+	 * around its centre, so it changes their signs */
+	ux = flags & BM_BLIT_FLIP_H ? -ca : ca;
+	uy = flags & BM_BLIT_FLIP_H ? -sa : sa;
+	vx = flags & BM_BLIT_FLIP_V ? sa : -sa;
+	vy = flags & BM_BLIT_FLIP_V ? -ca : ca;
+	
+	for(y = y0; y < y1; y++) {
+		/* The source position of the centre of pixel x0 */
+		int64_t ex = 2 * ((int64_t)x0 - cx) + 1, ey = 2 * ((int64_t)y - cy) + 1;
+		int64_t u64 = uc + ((ux * ex + uy * ey) >> 1), v64 = vc + ((vx * ex + vy * ey) >> 1);
+		int64_t k0 = 0, k1 = x1 - x0 - 1;
+		uint32_t *d;
+		int u, v;
+		
+		bm_span_limit(u64, ux, ulo, uhi, &k0, &k1);
+		bm_span_limit(v64, vx, vlo, vhi, &k0, &k1);
+		if(k0 > k1)
+			continue;
+		d = BM_ROW32(dst, y) + x0 + k0;
+		n = (int)(k1 - k0 + 1);
+		u = (int)(u64 + k0 * ux);
+		v = (int)(v64 + k0 * vx);
+		x = 0;
+		
+		if(bilinear) {
+			/* The filter is offset by half a source pixel so that it
+			 * interpolates between pixel centres, and stops at the 
+			 * edges of the area */
+			for(; x < n; x++, u += ux, v += vx) {
+				int fu = MAX(u - 0x8000, (int)ulo), fv = MAX(v - 0x8000, (int)vlo);
+				int i = fu >> 16, j = fv >> 16, i1 = MIN(i + 1, umax - 1);
+				uint32_t *s0 = BM_ROW32(src, j), *s1 = BM_ROW32(src, MIN(j + 1, vmax - 1));
+				if(bm_bilinear_px(s0[i], s0[i1], s1[i], s1[i1], (fu >> 8) & 0xFF, (fv >> 8) & 0xFF, mask, rgb, key, &p))
+					d[x] = p;
+			}
+			continue;
+		}
+#ifdef BM_AVX2
+		if(n >= 8) {
+			/* Gather 8 source pixels at a time */
+			__m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+			__m256i u8 = _mm256_add_epi32(_mm256_set1_epi32(u), _mm256_mullo_epi32(lane, _mm256_set1_epi32(ux)));
+			__m256i v8 = _mm256_add_epi32(_mm256_set1_epi32(v), _mm256_mullo_epi32(lane, _mm256_set1_epi32(vx)));
+			__m256i du8 = _mm256_set1_epi32(8 * ux), dv8 = _mm256_set1_epi32(8 * vx);
+			__m256i row8 = _mm256_set1_epi32(BM_ROW_SIZE(src) / BM_BPP);
+			__m256i k8 = _mm256_set1_epi32(key), m8 = _mm256_set1_epi32(rgb);
+			for(; x + 8 <= n; x += 8) {
+				__m256i at = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srai_epi32(v8, 16), row8), _mm256_srai_epi32(u8, 16));
+				__m256i sp = _mm256_i32gather_epi32((const int *)src->data, at, 4);
+				if(mask) {
+					__m256i dp = _mm256_loadu_si256((const __m256i *)(d + x));
+					sp = _mm256_blendv_epi8(sp, dp, _mm256_cmpeq_epi32(_mm256_and_si256(sp, m8), k8));
+				}
+				_mm256_storeu_si256((__m256i *)(d + x), sp);
+				u8 = _mm256_add_epi32(u8, du8);
+				v8 = _mm256_add_epi32(v8, dv8);
+			}
+			u += x * ux;
+			v += x * vx;
+		}
+#endif
+		if(mask) {
+			for(; x < n; x++, u += ux, v += vx) {
+				p = BM_ROW32(src, v >> 16)[u >> 16];
+				if((p & rgb) != key)
+					d[x] = p;
+			}
+		} else {
+			for(; x < n; x++, u += ux, v += vx)
+				d[x] = BM_ROW32(src, v >> 16)[u >> 16];
+		}
+	}
+}
+
+void bm_blit_rotozoom(struct bitmap *dst, int cx, int cy, struct bitmap *src, int sx, int sy, int sw, int sh, double angle, double scale, int flags) {
+	double r = fmod(angle, 360.0) * 3.14159265358979323846 / 180.0, f;
+	BM_READ(src);
+	/* Below 1/256 the whole area shrinks to a pixel or less */
+	if(!(scale >= 1.0 / 256) || isnan(r))
+		return;
+	f = 65536.0 / scale;
+	bm_rotozoom(dst, cx, cy, src, sx, sy, sw, sh, (int)floor(cos(r) * f + 0.5), (int)floor(sin(r) * f + 0.5), flags);
+}
+
+/* bm_smooth() is a separable 3x3 box filter: The horizontal pass 
+ * stores the sums of each pixel and its left and right neighbours in 
+ * 16-bit scratch memory, and the vertical pass adds three rows of 
+ * sums and divides by the number of pixels that were summed. 
+ */
+struct bm_filter_job {
+	struct bitmap *b;
+	const struct bitmap *in;
+	void *tmp;
+	
+	/* For bm_resample() */
+	int taps_x, taps_y, *ix, *iy, *wx, *wy;
+};
+
+static void bm_smooth_h(void *arg, int y0, int y1) {
+	struct bm_filter_job *job = arg;
+	struct bitmap *b = job->b;
+	int x, y, c, w = b->w;
+	for(y = y0; y < y1; y++) {
+		const unsigned char *row = b->data + y * BM_ROW_SIZE(b);
+		uint16_t *sum = (uint16_t *)job->tmp + y * w * BM_BPP;
+		x = 0;
+#ifdef BM_SSE2
+		if(w > 2) {
+			__m128i z = _mm_setzero_si128();
+			for(x = 1; x + 5 <= w; x += 4) {
+				__m128i l = _mm_loadu_si128((const __m128i *)(row + (x - 1) * BM_BPP));
+				__m128i m = _mm_loadu_si128((const __m128i *)(row + x * BM_BPP));
+				__m128i r = _mm_loadu_si128((const __m128i *)(row + (x + 1) * BM_BPP));
+				__m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(l, z), _mm_unpacklo_epi8(m, z)), _mm_unpacklo_epi8(r, z));
+				__m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(l, z), _mm_unpackhi_epi8(m, z)), _mm_unpackhi_epi8(r, z));
+				_mm_storeu_si128((__m128i *)(sum + x * BM_BPP), lo);
+				_mm_storeu_si128((__m128i *)(sum + x * BM_BPP + 8), hi);
+			}
+			/* Column 0 is done below */
+			for(c = 0; c < BM_BPP; c++)
+				sum[c] = row[c] + row[BM_BPP + c];
+			if(x == 1)
+				x = 0;
+		}
+#endif
+		for(; x < w; x++) {
+			for(c = 0; c < BM_BPP; c++) {
+				int v = row[x * BM_BPP + c];
+				if(x > 0) v += row[(x - 1) * BM_BPP + c];
+				if(x < w - 1) v += row[(x + 1) * BM_BPP + c];
+				sum[x * BM_BPP + c] = v;
+			}
+		}
+	}
+}
+
+static void bm_smooth_v(void *arg, int y0, int y1) {
+	struct bm_filter_job *job = arg;
+	struct bitmap *b = job->b;
+	int x, y, c, w = b->w, h = b->h;
+	for(y = y0; y < y1; y++) {
+		const uint16_t *s0 = (uint16_t *)job->tmp + (y > 0 ? y - 1 : y) * w * BM_BPP,
+			*s1 = (uint16_t *)job->tmp + y * w * BM_BPP,
+			*s2 = (uint16_t *)job->tmp + (y < h - 1 ? y + 1 : y) * w * BM_BPP;
+		int cy = 1 + (y > 0) + (y < h - 1);
+		unsigned char *row = b->data + y * BM_ROW_SIZE(b);
+		x = 0;
+#ifdef BM_SSE2
+		if(cy == 3 && w > 2) {
+			/* (v * 7282) >> 16 == v / 9 for all the possible sums */
+			__m128i ninth = _mm_set1_epi16(7282);
+			for(x = 1; x + 3 <= w; x += 2) {
+				__m128i v = _mm_add_epi16(_mm_add_epi16(
+						_mm_loadu_si128((const __m128i *)(s0 + x * BM_BPP)),
+						_mm_loadu_si128((const __m128i *)(s1 + x * BM_BPP))),
+						_mm_loadu_si128((const __m128i *)(s2 + x * BM_BPP)));
+				v = _mm_mulhi_epu16(v, ninth);
+				_mm_storel_epi64((__m128i *)(row + x * BM_BPP), _mm_packus_epi16(v, v));
+			}
+			for(c = 0; c < BM_BPP; c++)
+				row[c] = (s0[c] + s1[c] + s2[c]) / 6;
+			if(x == 1)
+				x = 0;
+		}
+#endif
+		for(; x < w; x++) {
+			int cx = 1 + (x > 0) + (x < w - 1);
+			for(c = 0; c < BM_BPP; c++) {
+				int v = s1[x * BM_BPP + c];
+				if(y > 0) v += s0[x * BM_BPP + c];
+				if(y < h - 1) v += s2[x * BM_BPP + c];
+				row[x * BM_BPP + c] = v / (cx * cy);
+			}
+		}
+	}
+}
+
+void bm_smooth(struct bitmap *b) {
+	struct bm_filter_job job;
+	job.b = b;
+	BM_WRITE(b);
+	job.tmp = bm_scratch((size_t)b->w * b->h * BM_BPP * sizeof(uint16_t));
+	if(!job.tmp)
+		return;
+	bm_dirty_all(b);
+	bm_run_bands(bm_smooth_h, &job, b->h);
+	bm_run_bands(bm_smooth_v, &job, b->h);
+}
+
+/* Median of 9 values with a sorting network. See
+ * "Fast median search: an ANSI C implementation" by Nicolas Devillard. 
+ * BM_SORT2() works on bytes or on 16 bytes at once with SSE2.
+ */
+#define BM_MEDIAN9(p, BM_SORT2) do { \
+	BM_SORT2(p[1], p[2]); BM_SORT2(p[4], p[5]); BM_SORT2(p[7], p[8]); \
+	BM_SORT2(p[0], p[1]); BM_SORT2(p[3], p[4]); BM_SORT2(p[6], p[7]); \
+	BM_SORT2(p[1], p[2]); BM_SORT2(p[4], p[5]); BM_SORT2(p[7], p[8]); \
+	BM_SORT2(p[0], p[3]); BM_SORT2(p[5], p[8]); BM_SORT2(p[4], p[7]); \
+	BM_SORT2(p[3], p[6]); BM_SORT2(p[1], p[4]); BM_SORT2(p[2], p[5]); \
+	BM_SORT2(p[4], p[7]); BM_SORT2(p[4], p[2]); BM_SORT2(p[6], p[4]); \
+	BM_SORT2(p[4], p[2]); \
+} while(0)
+
+#define BM_SORT2_BYTE(a, b) do { \
+	unsigned char t_ = a; \
+	if(t_ > b) { a = b; b = t_; } \
+} while(0)
+
+#ifdef BM_SSE2
+#	define BM_SORT2_SSE2(a, b) do { \
+	__m128i t_ = a; \
+	a = _mm_min_epu8(t_, b); b = _mm_max_epu8(t_, b); \
+} while(0)
+#endif
+
+/* The median of the 3x3 pixels around column x of the rows r, with
+ * the edges clamped, for each component */
+static void bm_median_px(unsigned char *row, const unsigned char *r[3], int x, int w) {
+	int xs[3], i, c;
+	xs[0] = x > 0 ? x - 1 : x;
+	xs[1] = x;
+	xs[2] = x < w - 1 ? x + 1 : x;
+	for(c = 0; c < BM_BPP; c++) {
+		unsigned char p[9];
+		for(i = 0; i < 9; i++)
+			p[i] = r[i / 3][xs[i % 3] * BM_BPP + c];
+		BM_MEDIAN9(p, BM_SORT2_BYTE);
+		row[x * BM_BPP + c] = p[4];
+	}
+}
+
+static void bm_median_rows(void *arg, int y0, int y1) {
+	struct bm_filter_job *job = arg;
+	struct bitmap *b = job->b;
+	int x, y, i, w = b->w, h = b->h;
+	const unsigned char *src = job->tmp;
+	for(y = y0; y < y1; y++) {
+		const unsigned char *r[3];
+		unsigned char *row = b->data + y * BM_ROW_SIZE(b);
+		r[0] = src + (y > 0 ? y - 1 : y) * w * BM_BPP;
+		r[1] = src + y * w * BM_BPP;
+		r[2] = src + (y < h - 1 ? y + 1 : y) * w * BM_BPP;
+		x = 0;
+#ifdef BM_SSE2
+		bm_median_px(row, r, 0, w);
+		/* 4 pixels, all 4 components of each, per step */
+		for(x = 1; x + 5 <= w; x += 4) {
+			__m128i p[9];
+			for(i = 0; i < 3; i++) {
+				p[i * 3 + 0] = _mm_loadu_si128((const __m128i *)(r[i] + (x - 1) * BM_BPP));
+				p[i * 3 + 1] = _mm_loadu_si128((const __m128i *)(r[i] + x * BM_BPP));
+				p[i * 3 + 2] = _mm_loadu_si128((const __m128i *)(r[i] + (x + 1) * BM_BPP));
+			}
+			BM_MEDIAN9(p, BM_SORT2_SSE2);
+			_mm_storeu_si128((__m128i *)(row + x * BM_BPP), p[4]);
+		}
+#endif
+		for(; x < w; x++) 
+			bm_median_px(row, r, x, w);
+	}
+	(void)i;
+}
+
+void bm_median(struct bitmap *b) {
+	struct bm_filter_job job;
+	int y;
+	job.b = b;
+	BM_WRITE(b);
+	job.tmp = bm_scratch(BM_BLOB_SIZE(b));
+	if(!job.tmp)
+		return;
+	for(y = 0; y < b->h; y++)
+		memcpy((unsigned char *)job.tmp + y * b->w * BM_BPP, BM_ROW32(b, y), b->w * BM_BPP);
+	bm_dirty_all(b);
+	bm_run_bands(bm_median_rows, &job, b->h);
+}
+
+/* bm_resample() is separable as well: Each output column (and row) 
+ * is a weighted sum of up to taps source columns, with weights in 
+ * 2.14 fixed point that add up to 1.0. When enlarging, the weights 
+ * interpolate bilinearly between the two nearest source pixels; 
+ * When shrinking they're the areas of the source pixels covered
+ * by the output pixel.
+ * The horizontal pass stores its results scaled up by 64 in 16-bit 
+ * scratch memory, one row for every source row.
+ */
+#define BM_RS_BITS	14
+#define BM_RS_ONE	(1 << BM_RS_BITS)
 
-	if(dx < dst->clip.x0) {
-		int delta = dst->clip.x0 - dx;
-		sx += delta;
-		w -= delta;
-		dx = dst->clip.x0;
-	}
-	
-	if(dx + w > dst->clip.x1) {
-		int delta = dx + w - dst->clip.x1;
-		w -= delta;
+static int bm_resample_taps(int n_in, int n_out) {
+	return n_out >= n_in ? 2 : (n_in + n_out - 1) / n_out + 1;
+}
+
+static void bm_resample_weights(int n_in, int n_out, int taps, int *idx, int *wt) {
+	int o, k;
+	double scale = (double)n_in / n_out;
+	for(o = 0; o < n_out; o++) {
+		int *ix = idx + o * taps, *w = wt + o * taps, sum = 0, big = 0;
+		double f[32];
+		if(n_out >= n_in) {
+			double c = (o + 0.5) * scale - 0.5;
+			int i0 = (int)(c < 0 ? 0 : c);
+			double t = c - i0;
+			if(t < 0) t = 0;
+			ix[0] = i0;
+			ix[1] = i0 + 1 < n_in ? i0 + 1 : i0;
+			f[0] = 1.0 - t;
+			f[1] = t;
+		} else {
+			double a = o * scale, e = a + scale;
+			int i0 = (int)a;
+			for(k = 0; k < taps; k++) {
+				double l = i0 + k, r = l + 1;
+				if(l < a) l = a;
+				if(r > e) r = e;
+				ix[k] = i0 + k < n_in ? i0 + k : n_in - 1;
+				f[k] = r > l ? (r - l) / scale : 0.0;
+			}
+		}
+		for(k = 0; k < taps; k++) {
+			w[k] = (int)(f[k] * BM_RS_ONE + 0.5);
+			sum += w[k];
+			if(w[k] > w[big])
+				big = k;
+		}
+		/* Make the weights add up to exactly 1.0 */
+		w[big] += BM_RS_ONE - sum;
 	}
+}
 
-	if(dy < dst->clip.y0) {
-		int delta = dst->clip.y0 - dy;
-		sy += delta;
-		h -= delta;
-		dy = dst->clip.y0;
+static void bm_resample_h(void *arg, int y0, int y1) {
+	struct bm_filter_job *job = arg;
+	const struct bitmap *in = job->in;
+	int x, y, k, c, nw = job->b->w, taps = job->taps_x;
+	for(y = y0; y < y1; y++) {
+		const unsigned char *row = in->data + y * BM_ROW_SIZE(in);
+		int16_t *out = (int16_t *)job->tmp + y * nw * BM_BPP;
+		x = 0;
+#ifdef BM_SSE2
+		for(; x < nw; x++) {
+			const int *ix = job->ix + x * taps, *wx = job->wx + x * taps;
+			__m128i z = _mm_setzero_si128(), acc = _mm_set1_epi32(1 << (BM_RS_BITS - 7));
+			for(k = 0; k < taps; k += 2) {
+				/* Two taps at a time: Interleave the components of the 
+				 * two pixels and multiply-add them with their weights */
+				uint32_t pa, pb = 0;
+				int wb = 0;
+				memcpy(&pa, row + ix[k] * BM_BPP, sizeof pa);
+				if(k + 1 < taps) {
+					memcpy(&pb, row + ix[k + 1] * BM_BPP, sizeof pb);
+					wb = wx[k + 1];
+				}
+				acc = _mm_add_epi32(acc, _mm_madd_epi16(
+						_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(pa), z), _mm_unpacklo_epi8(_mm_cvtsi32_si128(pb), z)),
+						_mm_set1_epi32((wb << 16) | wx[k])));
+			}
+			acc = _mm_srai_epi32(acc, BM_RS_BITS - 6);
+			_mm_storel_epi64((__m128i *)(out + x * BM_BPP), _mm_packs_epi32(acc, acc));
+		}
+#endif
+		for(; x < nw; x++) {
+			const int *ix = job->ix + x * taps, *wx = job->wx + x * taps;
+			int acc[BM_BPP] = {0, 0, 0, 0};
+			for(k = 0; k < taps; k++) {
+				const unsigned char *p = row + ix[k] * BM_BPP;
+				for(c = 0; c < BM_BPP; c++)
+					acc[c] += p[c] * wx[k];
+			}
+			/* 255 * 64 still fits in a signed 16 bit value */
+			for(c = 0; c < BM_BPP; c++)
+				out[x * BM_BPP + c] = (acc[c] + (1 << (BM_RS_BITS - 7))) >> (BM_RS_BITS - 6);
+		}
 	}
-	
-	if(dy + h > dst->clip.y1) {
-		int delta = dy + h - dst->clip.y1;
-		h -= delta;
+}
+
+static void bm_resample_v(void *arg, int y0, int y1) {
+	struct bm_filter_job *job = arg;
+	struct bitmap *out = job->b;
+	int i, y, k, n = out->w * BM_BPP, taps = job->taps_y;
+	const int16_t *tmp = job->tmp;
+	const int round = 1 << (BM_RS_BITS + 5);
+	for(y = y0; y < y1; y++) {
+		const int *iy = job->iy + y * taps, *wy = job->wy + y * taps;
+		unsigned char *row = out->data + y * BM_ROW_SIZE(out);
+		i = 0;
+#ifdef BM_SSE2
+		for(; i + 8 <= n; i += 8) {
+			__m128i a0 = _mm_set1_epi32(round), a1 = a0;
+			for(k = 0; k < taps; k++) {
+				__m128i t = _mm_loadu_si128((const __m128i *)(tmp + iy[k] * n + i));
+				__m128i w = _mm_set1_epi16(wy[k]);
+				/* 16x16 -> 32 bit products */
+				__m128i lo = _mm_mullo_epi16(t, w), hi = _mm_mulhi_epi16(t, w);
+				a0 = _mm_add_epi32(a0, _mm_unpacklo_epi16(lo, hi));
+				a1 = _mm_add_epi32(a1, _mm_unpackhi_epi16(lo, hi));
+			}
+			a0 = _mm_srai_epi32(a0, BM_RS_BITS + 6);
+			a1 = _mm_srai_epi32(a1, BM_RS_BITS + 6);
+			a0 = _mm_packs_epi32(a0, a1);
+			_mm_storel_epi64((__m128i *)(row + i), _mm_packus_epi16(a0, a0));
+		}
+#endif
+		for(; i < n; i++) {
+			int acc = round;
+			for(k = 0; k < taps; k++)
+				acc += tmp[iy[k] * n + i] * wy[k];
+			acc >>= BM_RS_BITS + 6;
+			row[i] = acc < 0 ? 0 : (acc > 255 ? 255 : acc);
+		}
 	}
+}
+
+struct bitmap *bm_resample(const struct bitmap *in, int nw, int nh) {
+	struct bitmap *out;
+	struct bm_filter_job job;
 	
-	if(w <= 0 || h <= 0)
-		return;
-	if(dx >= dst->clip.x1 || dx + w < dst->clip.x0)
-		return;
-	if(dy >= dst->clip.y1 || dy + h < dst->clip.y0)
-		return;
+	if(nw <= 0 || nh <= 0)
+		return NULL;
+	BM_READ((struct bitmap *)in);
 	
-	if(sx + w > src->w) {
-		int delta = sx + w - src->w;
-		w -= delta;
+	job.taps_x = bm_resample_taps(in->w, nw);
+	job.taps_y = bm_resample_taps(in->h, nh);
+	if(job.taps_x > 32 || job.taps_y > 32) {
+		/* Shrinking by more than 1/31: Shrink in two steps */
+		int tw = job.taps_x > 32 ? nw * 16 : nw, th = job.taps_y > 32 ? nh * 16 : nh;
+		struct bitmap *t = bm_resample(in, tw, th);
+		if(!t)
+			return NULL;
+		out = bm_resample(t, nw, nh);
+		bm_free(t);
+		return out;
 	}
 	
-	if(sy + h > src->h) {
-		int delta = sy + h - src->h;
-		h -= delta;
+	out = bm_create(nw, nh);
+	if(!out)
+		return NULL;
+	if(nw == in->w && nh == in->h) {
+		int y;
+		for(y = 0; y < nh; y++)
+			memcpy(BM_ROW32(out, y), BM_ROW32(in, y), nw * BM_BPP);
+		return out;
 	}
 	
-	assert(dx >= 0 && dx + w <= dst->clip.x1);
-	assert(dy >= 0 && dy + h <= dst->clip.y1);	
-	assert(sx >= 0 && sx + w <= src->w);
-	assert(sy >= 0 && sy + h <= src->h);
-	
-	j = sy;
-	for(y = dy; y < dy + h; y++) {		
-		i = sx;
-		for(x = dx; x < dx + w; x++) {
-			int r = BM_GETR(src, i, j),
-				g = BM_GETG(src, i, j),
-				b = BM_GETB(src, i, j),
-				a = BM_GETA(src, i, j);
-			if(r != src->r || g != src->g || b != src->b)
-				BM_SET(dst, x, y, r, g, b, a);
-			i++;
-		}
-		j++;
+	job.b = out;
+	job.in = in;
+	job.ix = malloc(nw * job.taps_x * sizeof *job.ix);
+	job.wx = malloc(nw * job.taps_x * sizeof *job.wx);
+	job.iy = malloc(nh * job.taps_y * sizeof *job.iy);
+	job.wy = malloc(nh * job.taps_y * sizeof *job.wy);
+	job.tmp = bm_scratch((size_t)nw * in->h * BM_BPP * sizeof(int16_t));
+	if(job.ix && job.wx && job.iy && job.wy && job.tmp) {
+		bm_resample_weights(in->w, nw, job.taps_x, job.ix, job.wx);
+		bm_resample_weights(in->h, nh, job.taps_y, job.iy, job.wy);
+		bm_run_bands(bm_resample_h, &job, in->h);
+		bm_run_bands(bm_resample_v, &job, nh);
+	} else {
+		bm_free(out);
+		out = NULL;
 	}
+	free(job.ix);
+	free(job.wx);
+	free(job.iy);
+	free(job.wy);
+	return out;
 }
 
-void bm_blit_ex(struct bitmap *dst, int dx, int dy, int dw, int dh, struct bitmap *src, int sx, int sy, int sw, int sh, int mask) {
-	int x, y;
-	int ssx = sx; 
-	int ynum = 0;
+void bm_swap_colour(struct bitmap *b, unsigned char sR, unsigned char sG, unsigned char sB, unsigned char dR, unsigned char dG, unsigned char dB) {
+	unsigned int s = (sR << 16) | (sG << 8) | sB, d = (dR << 16) | (dG << 8) | dB;
+	bm_remap_colours(b, 1, &s, &d);
+}
+
+/* Colour remapping:
+ * Every pixel is looked up once, with its alpha masked out, in a table
+ * of the source colours. Up to a few dozen colours it's faster to 
+ * compare four pixels at a time with all of them; Otherwise the colours
+ * go in an open addressed hash table. Sprites have long runs of the same 
+ * colour, so the last lookup is remembered.
+ */
+#define BM_REMAP_HASH(K)	((uint32_t)(K) * 2654435761u)
+
+/* Most colours compared four pixels at a time */
+#define BM_REMAP_SIMD_MAX	32
+
+static void bm_remap_rows(struct bitmap *b, int n, const uint32_t *s, const uint32_t *d) {
+	uint32_t rgb = BM_RGB_MASK, *keys, *vals, mask, last_k, last_v, k, v;
+	int x, y, i, j, shift, size;
 	
-	if(sw == dw && sh == dh) {
-		if(mask) {
-			bm_maskedblit(dst, dx, dy, src, sx, sy, dw, dh);
-		} else {
-			bm_blit(dst, dx, dy, src, sx, sy, dw, dh);
+#ifdef BM_SSE2
+	if(n <= BM_REMAP_SIMD_MAX) {
+		__m128i m4 = _mm_set1_epi32(rgb), s4[BM_REMAP_SIMD_MAX], d4[BM_REMAP_SIMD_MAX], 
+			last_c = _mm_set1_epi32(~rgb), r = _mm_setzero_si128(), hit = r;
+		for(j = 0; j < n; j++) {
+			s4[j] = _mm_set1_epi32(s[j]);
+			d4[j] = _mm_set1_epi32(d[j]);
+		}
+		/* The match of last_c is reused along runs of the same colours */
+		for(y = 0; y < b->h; y++) {
+			uint32_t *row = BM_ROW32(b, y);
+			for(x = 0; x + 4 <= b->w; x += 4) {
+				__m128i p = _mm_loadu_si128((const __m128i *)(row + x)), 
+					c = _mm_and_si128(p, m4);
+				if(_mm_movemask_epi8(_mm_cmpeq_epi32(c, last_c)) != 0xFFFF) {
+					last_c = c;
+					r = hit = _mm_setzero_si128();
+					/* The keys are distinct, so at most one matches */
+					for(j = 0; j < n; j++) {
+						__m128i eq = _mm_cmpeq_epi32(c, s4[j]);
+						hit = _mm_or_si128(hit, eq);
+						r = _mm_or_si128(r, _mm_and_si128(eq, d4[j]));
+					}
+				}
+				/* r is zero where nothing matched */
+				p = _mm_or_si128(_mm_andnot_si128(_mm_and_si128(hit, m4), p), r);
+				_mm_storeu_si128((__m128i *)(row + x), p);
+			}
+			for(; x < b->w; x++) {
+				k = row[x] & rgb;
+				for(j = 0; j < n && s[j] != k; j++);
+				if(j < n)
+					row[x] = (row[x] & ~rgb) | d[j];
+			}
 		}
 		return;
 	}
+#endif
 	
-	if(sw <= 0 || sh <= 0 || dw <= 0 || dh <= 0)
-		return;
-	if(dx >= dst->clip.x1 || dx + dw < dst->clip.x0)
-		return;
-	if(dy >= dst->clip.y1 || dy + dh < dst->clip.y0)
+	/* At most half full; Empty slots have alpha bits that no masked
+	 * pixel has */
+	for(size = 16, shift = 28; size < 2 * n; size *= 2, shift--);
+	keys = malloc(size * sizeof *keys);
+	vals = malloc(size * sizeof *vals);
+	if(!keys || !vals) {
+		free(keys);
+		free(vals);
+		/* It'll do, slowly */
+		for(y = 0; y < b->h; y++) {
+			uint32_t *row = BM_ROW32(b, y);
+			for(x = 0; x < b->w; x++) {
+				k = row[x] & rgb;
+				for(j = 0; j < n && s[j] != k; j++);
+				if(j < n)
+					row[x] = (row[x] & ~rgb) | d[j];
+			}
+		}
 		return;
+	}
+	mask = size - 1;
+	for(i = 0; i < size; i++)
+		keys[i] = ~rgb;
+	for(j = 0; j < n; j++) {
+		for(i = BM_REMAP_HASH(s[j]) >> shift; keys[i] != ~rgb && keys[i] != s[j]; i = (i + 1) & mask);
+		keys[i] = s[j];
+		vals[i] = d[j];
+	}
 	
-	/*
-	Uses Bresenham's algoritm to implement a simple scaling while blitting.
-	See the article "Scaling Bitmaps with Bresenham" by Tim Kientzle in the
-	October 1995 issue of C/C++ Users Journal
-	
-	Or see these links:
-		http://www.drdobbs.com/image-scaling-with-bresenham/184405045
-		http://www.compuphase.com/graphic/scale.htm	
-	*/	
-	for(y = dy; y < dy + dh; y++){
-		int xnum = 0;			
-		sx = ssx;			
-		
-		if(sy >= src->h || y >= dst->clip.y1)
-			break;
-		
-		for(x = dx; x < dx + dw; x++) {
-			
-			if(sx >= src->w || x >= dst->clip.x1)
-				break;
-			
-			/* FIXME: The clipping can probably be better */
-			if(x >= dst->clip.x0 && x < dst->clip.x1 && y >= dst->clip.y0 && y < dst->clip.y1
-				&& sx >= 0 && sx < src->w && sy >= 0 && sy < src->h) {
-				int r = BM_GETR(src, sx, sy),
-					g = BM_GETG(src, sx, sy),
-					b = BM_GETB(src, sx, sy),
-					a = BM_GETA(src, sx, sy);
-				if(!mask || r != src->r || g != src->g || b != src->b)
-					BM_SET(dst, x, y, r, g, b, a);
-			}
-			
-			xnum += sw;
-			while(xnum > dw) {
-				xnum -= dw;
-				sx++;
+	/* last_v is the replacement of last_k, or ~rgb if it has none */
+	last_k = ~rgb;
+	last_v = ~rgb;
+	for(y = 0; y < b->h; y++) {
+		uint32_t *row = BM_ROW32(b, y);
+		for(x = 0; x < b->w; x++) {
+			k = row[x] & rgb;
+			if(k != last_k) {
+				for(i = BM_REMAP_HASH(k) >> shift; keys[i] != ~rgb && keys[i] != k; i = (i + 1) & mask);
+				last_k = k;
+				last_v = keys[i] == k ? vals[i] : ~rgb;
 			}
-		}
-		
-		ynum += sh;
-		while(ynum > dh) {
-			ynum -= dh;
-			sy++;
+			v = last_v;
+			if(v != ~rgb)
+				row[x] = (row[x] & ~rgb) | v;
 		}
 	}
+	free(keys);
+	free(vals);
 }
 
-void bm_smooth(struct bitmap *b) {
-	struct bitmap *tmp = bm_create(b->w, b->h);
-	unsigned char *t = b->data;
-	int x, y;
-	assert(b->clip.y0 < b->clip.y1);
-	assert(b->clip.x0 < b->clip.x1);
-	for(y = 0; y < b->h; y++)
-		for(x = 0; x < b->w; x++) {			
-			int p, q, c = 0, R = 0, G = 0, B = 0, A = 0;
-			for(p = x-1; p < x+1; p++)
-				for(q = y-1; q < y+1; q++) {
-					if(p < 0 || p >= b->w || q < 0 || q >= b->h)
-						continue;
-					R += BM_GETR(b,p,q);
-					G += BM_GETG(b,p,q);
-					B += BM_GETB(b,p,q);
-					A += BM_GETA(b,p,q);
-					c++;					
-				}
-			BM_SET(tmp, x, y, R/c, G/c, B/c, A/c);
+void bm_remap_colours(struct bitmap *b, int n, const unsigned int *src, const unsigned int *dst) {
+	uint32_t s[BM_REMAP_SIMD_MAX], d[BM_REMAP_SIMD_MAX], *ps = s, *pd = d;
+	int i, j, m;
+	if(n <= 0)
+		return;
+	if(n > BM_REMAP_SIMD_MAX) {
+		ps = malloc(n * sizeof *ps);
+		pd = malloc(n * sizeof *pd);
+		if(!ps || !pd) {
+			free(ps);
+			free(pd);
+			return;
 		}
-	
-	b->data = tmp->data;
-	tmp->data = t;
-	bm_free(tmp);
+	}
+	/* Drop repeated source colours; The first mapping wins */
+	for(i = 0, m = 0; i < n; i++) {
+		uint32_t k = bm_pack((src[i] >> 16) & 0xFF, (src[i] >> 8) & 0xFF, src[i] & 0xFF, 0);
+		for(j = 0; j < m && ps[j] != k; j++);
+		if(j < m)
+			continue;
+		ps[m] = k;
+		pd[m++] = bm_pack((dst[i] >> 16) & 0xFF, (dst[i] >> 8) & 0xFF, dst[i] & 0xFF, 0);
+	}
+	BM_WRITE(b);
+	bm_dirty_all(b);
+	bm_remap_rows(b, m, ps, pd);
+	if(ps != s) {
+		free(ps);
+		free(pd);
+	}
 }
 
-void bm_swap_colour(struct bitmap *b, unsigned char sR, unsigned char sG, unsigned char sB, unsigned char dR, unsigned char dG, unsigned char dB) {
-	int x,y;
-	for(y = 0; y < b->h; y++)
-		for(x = 0; x < b->w; x++) {			
-			if(BM_GETR(b,x,y) == sR && BM_GETG(b,x,y) == sG && BM_GETB(b,x,y) == sB) {
-				int a = BM_GETA(b, x, y);
-				BM_SET(b, x, y, dR, dG, dB, a);
-			}
-		}
+/* Remapped variants from bm_remap_variant(), chained in buckets
+ * by the bitmap they were made from */
+#define BM_VARIANT_BUCKETS	64
+
+struct bm_variant {
+	const struct bitmap *src;
+	int id;
+	struct bitmap *bmp;
+	struct bm_variant *next;
+};
+
+static struct bm_variant *bm_variants[BM_VARIANT_BUCKETS];
+
+#define BM_VARIANT_BUCKET(B)	((unsigned int)(((uintptr_t)(B) >> 4) * 2654435761u) % BM_VARIANT_BUCKETS)
+
+struct bitmap *bm_remap_variant(struct bitmap *b, int id, int n, const unsigned int *src, const unsigned int *dst) {
+	struct bm_variant *v, **bucket = &bm_variants[BM_VARIANT_BUCKET(b)];
+	for(v = *bucket; v; v = v->next) {
+		if(v->src == b && v->id == id)
+			return v->bmp;
+	}
+	v = malloc(sizeof *v);
+	if(!v)
+		return NULL;
+	v->bmp = bm_copy(b);
+	if(!v->bmp) {
+		free(v);
+		return NULL;
+	}
+	bm_remap_colours(v->bmp, n, src, dst);
+	v->src = b;
+	v->id = id;
+	v->next = *bucket;
+	*bucket = v;
+	bm_nvariants++;
+	return v->bmp;
 }
 
-struct bitmap *bm_resample(const struct bitmap *in, int nw, int nh) {
-	struct bitmap *out = bm_create(nw, nh);
-	int x, y;
-	for(y = 0; y < nh; y++)
-		for(x = 0; x < nw; x++) {
-			int sx = x * in->w/nw;
-			int sy = y * in->h/nh;
-			assert(sx < in->w && sy < in->h);
-			BM_SET(out, x, y, BM_GETR(in,sx,sy), BM_GETG(in,sx,sy), BM_GETB(in,sx,sy), BM_GETA(in,sx,sy));
+static void bm_remap_forget(const struct bitmap *b) {
+	struct bm_variant **p = &bm_variants[BM_VARIANT_BUCKET(b)], *v;
+	while(*p) {
+		v = *p;
+		if(v->src == b) {
+			*p = v->next;
+			bm_nvariants--;
+			bm_free(v->bmp);
+			free(v);
+		} else {
+			p = &v->next;
 		}
-	return out;
+	}
 }
 
+
 void bm_set_color(struct bitmap *bm, int r, int g, int b) {
 	if(r < 0) r = 0;
 	if(r > 255) r = 255;
@@ -867,15 +3355,17 @@ void bm_set_color(struct bitmap *bm, int r, int g, int b) {
 	if(g > 255) g = 255;
 	if(b < 0) b = 0;
 	if(b > 255) b = 255;
-	bm->r = r;
-	bm->g = g;
-	bm->b = b;
+	bm->color = bm_pack(r, g, b, BM_COMP(bm->color, 3));
 }
 
 void bm_set_alpha(struct bitmap *bm, int a) {
 	if(a < 0) a = 0;
 	if(a > 255) a = 255;
-	bm->a = a;
+	BM_COMP(bm->color, 3) = a;
+}
+
+int bm_get_alpha(struct bitmap *bm) {
+	return BM_COMP(bm->color, 3);
 }
 
 /* Lookup table for bm_color_atoi() 
@@ -1128,25 +3618,25 @@ void bm_set_color_i(struct bitmap *bm, int col) {
 }
 
 void bm_get_color(struct bitmap *bm, int *r, int *g, int *b) {
-	*r = bm->r;
-	*g = bm->g;
-	*b = bm->b;
+	*r = BM_COMP(bm->color, 0);
+	*g = BM_COMP(bm->color, 1);
+	*b = BM_COMP(bm->color, 2);
 }
 
 int bm_get_color_i(struct bitmap *bm) {
-	return (bm->r << 16) | (bm->g << 8) | (bm->b << 0);
+	return (BM_COMP(bm->color, 0) << 16) | (BM_COMP(bm->color, 1) << 8) | (BM_COMP(bm->color, 2) << 0);
 }
 
 void bm_picker(struct bitmap *bm, int x, int y) {
 	if(x < 0 || x >= bm->w || y < 0 || y >= bm->h) 
 		return;
-	bm->r = BM_GETR(bm, x, y);
-	bm->g = BM_GETG(bm, x, y);
-	bm->b = BM_GETB(bm, x, y);
+	BM_READ(bm);
+	bm->color = (BM_GET_PIXEL(bm, x, y) & BM_RGB_MASK) | (bm->color & ~BM_RGB_MASK);
 }
 
 int bm_color_is(struct bitmap *bm, int x, int y, int r, int g, int b) {
-	return BM_GETR(bm,x,y) == r && BM_GETG(bm,x,y) == g && BM_GETB(bm,x,y) == b;
+	BM_READ(bm);
+	return (BM_GET_PIXEL(bm, x, y) & BM_RGB_MASK) == bm_pack(r, g, b, 0);
 }
 
 int bm_lerp(int color1, int color2, double t) {
@@ -1195,65 +3685,350 @@ int bm_height(struct bitmap *b) {
 	return b->h;
 }
 
+/* Fills larger than this many bytes use non-temporal stores, which
+ * bypass the cache instead of evicting everything else from it. 
+ * Override it with -DBM_STREAM_SIZE=n */
+#ifndef BM_STREAM_SIZE
+#	define BM_STREAM_SIZE	(1024 * 1024)
+#endif
+
+/* Sets the n packed pixels at p to c */
+static void bm_fill32(uint32_t *p, size_t n, uint32_t c) {
+	size_t i = 0;
+	unsigned char *cb = (unsigned char *)&c;
+	if(n < 16) {
+		/* Short spans, like the rows of glyphs and small shapes */
+		for(; i < n; i++)
+			p[i] = c;
+		return;
+	}
+	if(cb[0] == cb[1] && cb[0] == cb[2] && cb[0] == cb[3]) {
+		memset(p, cb[0], n * sizeof *p);
+		return;
+	}
+#ifdef BM_SSE2
+	{
+		__m128i c4 = _mm_set1_epi32(c);
+		/* Align the destination for the 16 byte stores; 
+		 * Pixels are always 4 byte aligned */
+		for(; i < n && ((uintptr_t)(p + i) & 15); i++)
+			p[i] = c;
+		if(n * sizeof *p > BM_STREAM_SIZE) {
+			for(; i + 16 <= n; i += 16) {
+				_mm_stream_si128((__m128i *)(p + i), c4);
+				_mm_stream_si128((__m128i *)(p + i + 4), c4);
+				_mm_stream_si128((__m128i *)(p + i + 8), c4);
+				_mm_stream_si128((__m128i *)(p + i + 12), c4);
+			}
+			_mm_sfence();
+		}
+		for(; i + 4 <= n; i += 4)
+			_mm_store_si128((__m128i *)(p + i), c4);
+	}
+#endif
+	for(; i < n; i++) 
+		p[i] = c;
+}
+
 void bm_clear(struct bitmap *b) {
-	int i, j;
-	for(j = 0; j < b->h; j++) 
-		for(i = 0; i < b->w; i++) {
-			BM_SET(b, i, j, b->r, b->g, b->b, b->a);
+	if(b->cmds && bm_record(b, BM_CMD_CLEAR, 0, 0, b->w - 1, b->h - 1, NULL, 0))
+		return;
+	BM_WRITE(b);
+	bm_dirty_all(b);
+	if(BM_CONTIGUOUS(b))
+		bm_fill32(BM_ROW32(b, 0), (size_t)b->w * b->h, b->color);
+	else {
+		int y;
+		for(y = 0; y < b->h; y++)
+			bm_fill32(BM_ROW32(b, y), b->w, b->color);
+	}
+}
+
+/* Filled shapes are drawn as horizontal spans: bm_hspan() fills the 
+ * pixels x0 to x1 (inclusive) on row y with the pen, clipped. 
+ * Like bm_fillrect(), it blends if the pen's alpha is less than 255, 
+ * so each shape must draw each row exactly once.
+ */
+static void bm_hspan(struct bitmap *b, int x0, int x1, int y) {
+	if(y < b->clip.y0 || y >= b->clip.y1)
+		return;
+	x0 = MAX(x0, b->clip.x0);
+	x1 = MIN(x1 + 1, b->clip.x1);
+	if(x1 <= x0)
+		return;
+	if(BM_COMP(b->color, 3) < 255) {
+		uint32_t p = bm_pen_premul(b);
+		bm_blend_row(BM_PIXEL(b, x0, y), (unsigned char *)&p, 0, x1 - x0, 255, 0, 0);
+	} else
+		bm_fill32(BM_ROW32(b, y) + x0, x1 - x0, b->color);
+}
+
+/* For shapes whose rows are easier to find from their outline, 
+ * bm_span_rows collects the leftmost and rightmost pixel of each 
+ * row (within the clip rectangle) so that they can be filled once. */
+struct bm_span_rows {
+	int y0, n;
+	int *l, *r;
+};
+
+static int bm_rows_init(struct bm_span_rows *sr, struct bitmap *b, int y0, int y1) {
+	int i;
+	y0 = MAX(y0, b->clip.y0);
+	y1 = MIN(y1, b->clip.y1 - 1);
+	sr->y0 = y0;
+	sr->n = y1 - y0 + 1;
+	if(sr->n <= 0)
+		return 0;
+	sr->l = malloc(2 * sr->n * sizeof *sr->l);
+	if(!sr->l)
+		return 0;
+	sr->r = sr->l + sr->n;
+	for(i = 0; i < sr->n; i++) {
+		sr->l[i] = INT_MAX;
+		sr->r[i] = INT_MIN;
+	}
+	return 1;
+}
+
+static void bm_rows_add(struct bm_span_rows *sr, int x0, int x1, int y) {
+	y -= sr->y0;
+	if(y < 0 || y >= sr->n)
+		return;
+	if(x0 < sr->l[y]) sr->l[y] = x0;
+	if(x1 > sr->r[y]) sr->r[y] = x1;
+}
+
+static void bm_rows_fill(struct bm_span_rows *sr, struct bitmap *b) {
+	int i;
+	for(i = 0; i < sr->n; i++) {
+		if(sr->l[i] <= sr->r[i])
+			bm_hspan(b, sr->l[i], sr->r[i], sr->y0 + i);
+	}
+	free(sr->l);
+}
+
+/* Circle span tables:
+ * hw[y] is the half width of row y (relative to the centre) of a 
+ * filled circle of radius r, as traced by the circle algorithm in
+ * bm_circle(), or -1 if the row is not drawn. Recently used radii
+ * are cached.
+ */
+#define BM_CIRCLE_CACHE	16
+
+static struct bm_circle_rows {
+	int r, *hw;
+} bm_circle_cache[BM_CIRCLE_CACHE];
+
+static const int *bm_circle_rows(int r) {
+	struct bm_circle_rows *c = &bm_circle_cache[r % BM_CIRCLE_CACHE];
+	int x = -r, y = 0, err = 2 - 2 * r, i;
+	if(c->hw && c->r == r)
+		return c->hw;
+	free(c->hw);
+	c->hw = malloc((r + 1) * sizeof *c->hw);
+	if(!c->hw)
+		return NULL;
+	c->r = r;
+	for(i = 0; i <= r; i++)
+		c->hw[i] = -1;
+	do {
+		/* x only increases, so the first x on a row is the widest */
+		if(c->hw[y] < 0)
+			c->hw[y] = -x;
+		i = err;
+		if(i > x) {
+			x++;
+			err += x*2 + 1;
+		}
+		if(i <= y) {
+			y++;
+			err += y * 2 + 1;
 		}
+	} while(x < 0);
+	return c->hw;
 }
 
 void bm_putpixel(struct bitmap *b, int x, int y) {
 	if(x < b->clip.x0 || x >= b->clip.x1 || y < b->clip.y0 || y >= b->clip.y1) 
 		return;
-	BM_SET(b, x, y, b->r, b->g, b->b, b->a);
+	if(b->cmds && bm_record(b, BM_CMD_PUTPIXEL, x, y, x, y, NULL, 2, x, y))
+		return;
+	BM_WRITE(b);
+	BM_SET_PIXEL(b, x, y, b->color);
+	if(b->dirty) bm_dirty_add(b, x, y, x + 1, y + 1);
+}
+
+/* Cohen-Sutherland outcodes of a point relative to the clip rectangle */
+#define BM_OUT_LEFT		1
+#define BM_OUT_RIGHT	2
+#define BM_OUT_TOP		4
+#define BM_OUT_BOTTOM	8
+
+static int bm_outcode(struct bitmap *b, int x, int y) {
+	int code = 0;
+	if(x < b->clip.x0)
+		code |= BM_OUT_LEFT;
+	else if(x >= b->clip.x1)
+		code |= BM_OUT_RIGHT;
+	if(y < b->clip.y0)
+		code |= BM_OUT_TOP;
+	else if(y >= b->clip.y1)
+		code |= BM_OUT_BOTTOM;
+	return code;
+}
+
+/* Opaque horizontal and vertical lines, inclusive and clipped.
+ * Unlike bm_hspan() these don't blend, like the rest of the outlines. */
+static void bm_hline(struct bitmap *b, int x0, int x1, int y) {
+	if(x1 < x0) {
+		int t = x0; x0 = x1; x1 = t;
+	}
+	if(y < b->clip.y0 || y >= b->clip.y1)
+		return;
+	x0 = MAX(x0, b->clip.x0);
+	x1 = MIN(x1 + 1, b->clip.x1);
+	if(x1 > x0)
+		bm_fill32(BM_ROW32(b, y) + x0, x1 - x0, b->color);
+}
+
+static void bm_vline(struct bitmap *b, int x, int y0, int y1) {
+	uint32_t *p;
+	if(y1 < y0) {
+		int t = y0; y0 = y1; y1 = t;
+	}
+	if(x < b->clip.x0 || x >= b->clip.x1)
+		return;
+	y0 = MAX(y0, b->clip.y0);
+	y1 = MIN(y1 + 1, b->clip.y1);
+	for(p = BM_ROW32(b, y0) + x; y0 < y1; y0++, p += b->stride / BM_BPP)
+		*p = b->color;
 }
 
+/* bm_line() draws exactly the pixels of the Bresenham line it has 
+ * always drawn, but clips it to the clip rectangle before it starts.
+ * 
+ * With M steps along the major axis and m along the minor axis,
+ * the Bresenham loop puts pixel k (0 <= k <= M) at minor offset
+ *   j(k) = floor((2*k*m + M - 1) / (2*M))
+ * so the range of k for which the pixel lies inside the clip 
+ * rectangle can be solved for directly instead of being found by 
+ * testing each pixel. Clipping the endpoints geometrically, as
+ * Cohen-Sutherland does, would round them to slightly different 
+ * lines; its outcodes are still used for the trivial accept and 
+ * reject cases.
+ */
 void bm_line(struct bitmap *b, int x0, int y0, int x1, int y1) {
-	int dx = x1 - x0;
-	int dy = y1 - y0;
-	int sx, sy;
-	int err, e2;
+	int c0 = bm_outcode(b, x0, y0), c1 = bm_outcode(b, x1, y1);
+	int dx = x1 - x0, dy = y1 - y0;
+	int sx = dx < 0 ? -1 : 1, sy = dy < 0 ? -1 : 1;
+	int M, m, su, sv, u0, v0, cu0, cu1, cv0, cv1;
+	int64_t k0, k1, lo, hi, j, num, M2, m2;
+	int step_u, step_v;
+	uint32_t *p;
+	
+	if(c0 & c1)
+		return;
+	if(b->cmds && bm_record(b, BM_CMD_LINE, MIN(x0, x1), MIN(y0, y1), MAX(x0, x1), MAX(y0, y1), NULL, 4, x0, y0, x1, y1))
+		return;
+	BM_WRITE(b);
+	BM_DIRTY(b, x0, y0, x1, y1);
+	if(dy == 0) {
+		bm_hline(b, x0, x1, y0);
+		return;
+	}
+	if(dx == 0) {
+		bm_vline(b, x0, y0, y1);
+		return;
+	}
 	
 	if(dx < 0) dx = -dx;
 	if(dy < 0) dy = -dy;
 	
-	if(x0 < x1) 
-		sx = 1; 
-	else 
-		sx = -1;
-	if(y0 < y1) 
-		sy = 1; 
-	else 
-		sy = -1;
+	/* Work in terms of a major axis u and a minor axis v */
+	if(dx >= dy) {
+		M = dx; m = dy;
+		u0 = x0; v0 = y0; su = sx; sv = sy;
+		cu0 = b->clip.x0; cu1 = b->clip.x1;
+		cv0 = b->clip.y0; cv1 = b->clip.y1;
+		step_u = sx; step_v = sy * (b->stride / BM_BPP);
+	} else {
+		M = dy; m = dx;
+		u0 = y0; v0 = x0; su = sy; sv = sx;
+		cu0 = b->clip.y0; cu1 = b->clip.y1;
+		cv0 = b->clip.x0; cv1 = b->clip.x1;
+		step_u = sy * (b->stride / BM_BPP); step_v = sx;
+	}
+	
+	M2 = 2 * (int64_t)M;
+	m2 = 2 * (int64_t)m;
+	k0 = 0;
+	k1 = M;
+	if(c0 | c1) {
+		/* Not trivially accepted: find the steps k0..k1 inside the clip. */
+		/* Steps where the major coordinate is inside the clip */
+		if(su > 0) {
+			k0 = MAX(k0, (int64_t)cu0 - u0);
+			k1 = MIN(k1, (int64_t)cu1 - 1 - u0);
+		} else {
+			k0 = MAX(k0, (int64_t)u0 - cu1 + 1);
+			k1 = MIN(k1, (int64_t)u0 - cu0);
+		}
+		/* Minor offsets j(k) inside the clip, and the steps that give them */
+		if(sv > 0) {
+			lo = (int64_t)cv0 - v0;
+			hi = (int64_t)cv1 - 1 - v0;
+		} else {
+			lo = (int64_t)v0 - cv1 + 1;
+			hi = (int64_t)v0 - cv0;
+		}
+		if(hi < 0)
+			return;
+		if(lo > 0)
+			k0 = MAX(k0, (M2 * lo - M + m2) / m2);
+		k1 = MIN(k1, (M2 * hi + M) / m2);
+		if(k1 < k0)
+			return;
+	}
 	
-	err = dx - dy;
+	num = k0 * m2 + M - 1;
+	j = num / M2;
+	num -= j * M2;
 	
+	if(dx >= dy)
+		p = BM_ROW32(b, v0 + sv * j) + u0 + su * k0;
+	else
+		p = BM_ROW32(b, u0 + su * k0) + v0 + sv * j;
 	for(;;) {
-		/* Clipping can probably be more effective... */
-		if(x0 >= b->clip.x0 && x0 < b->clip.x1 && y0 >= b->clip.y0 && y0 < b->clip.y1) 
-			BM_SET(b, x0, y0, b->r, b->g, b->b, b->a);
-			
-		if(x0 == x1 && y0 == y1) break;
-		
-		e2 = 2 * err;
-		
-		if(e2 > -dy) {
-			err -= dy;
-			x0 += sx;
-		}		
-		if(e2 < dx) {
-			err += dx;
-			y0 += sy;
-		}		
+		assert(p >= BM_ROW32(b, 0) && p < BM_ROW32(b, b->h));
+		*p = b->color;
+		if(k0++ == k1)
+			break;
+		p += step_u;
+		num += m2;
+		if(num >= M2) {
+			num -= M2;
+			p += step_v;
+		}
 	}
 }
 
+void bm_polyline(struct bitmap *b, const int *points, int n) {
+	int i;
+	if(n == 1)
+		bm_putpixel(b, points[0], points[1]);
+	for(i = 1; i < n; i++)
+		bm_line(b, points[2*i-2], points[2*i-1], points[2*i], points[2*i+1]);
+}
+
 void bm_rect(struct bitmap *b, int x0, int y0, int x1, int y1) {
-	bm_line(b, x0, y0, x1, y0);
-	bm_line(b, x1, y0, x1, y1);
-	bm_line(b, x1, y1, x0, y1);
-	bm_line(b, x0, y1, x0, y0);
+	if(b->cmds && bm_record(b, BM_CMD_RECT, MIN(x0, x1), MIN(y0, y1), MAX(x0, x1), MAX(y0, y1), NULL, 4, x0, y0, x1, y1))
+		return;
+	BM_WRITE(b);
+	BM_DIRTY(b, x0, y0, x1, y1);
+	bm_hline(b, x0, x1, y0);
+	bm_vline(b, x1, y0, y1);
+	bm_hline(b, x0, x1, y1);
+	bm_vline(b, x0, y0, y1);
 }
 
 void bm_fillrect(struct bitmap *b, int x0, int y0, int x1, int y1) {
@@ -1268,11 +4043,32 @@ void bm_fillrect(struct bitmap *b, int x0, int y0, int x1, int y1) {
 		y0 = y1;
 		y1 = y;
 	}
-	for(y = MAX(y0, b->clip.y0); y < MIN(y1 + 1, b->clip.y1); y++) {		
-		for(x = MAX(x0, b->clip.x0); x < MIN(x1 + 1, b->clip.x1); x++) {
-			assert(y >= 0 && y < b->h && x >= 0 && x < b->w);
-			BM_SET(b, x, y, b->r, b->g, b->b, b->a);
-		}
+	if(b->cmds && bm_record(b, BM_CMD_FILLRECT, x0, y0, x1, y1, NULL, 4, x0, y0, x1, y1))
+		return;
+	BM_WRITE(b);
+	BM_DIRTY(b, x0, y0, x1, y1);
+	x0 = MAX(x0, b->clip.x0);
+	x1 = MIN(x1 + 1, b->clip.x1);
+	if(BM_COMP(b->color, 3) < 255) {
+		uint32_t p = bm_pen_premul(b);
+		if(x1 <= x0)
+			return;
+		for(y = MAX(y0, b->clip.y0); y < MIN(y1 + 1, b->clip.y1); y++)
+			bm_blend_row(BM_PIXEL(b, x0, y), (unsigned char *)&p, 0, x1 - x0, 255, 0, 0);
+		return;
+	}
+	y0 = MAX(y0, b->clip.y0);
+	y1 = MIN(y1 + 1, b->clip.y1);
+	if(x1 <= x0 || y1 <= y0)
+		return;
+	assert(x0 >= 0 && x1 <= b->w && y0 >= 0 && y1 <= b->h);
+	if(x0 == 0 && x1 == b->w && BM_CONTIGUOUS(b)) {
+		/* The rows are contiguous */
+		bm_fill32(BM_ROW32(b, y0), (size_t)b->w * (y1 - y0), b->color);
+		return;
+	}
+	for(y = y0; y < y1; y++) {
+		bm_fill32(BM_ROW32(b, y) + x0, x1 - x0, b->color);
 	}	
 }
 
@@ -1280,28 +4076,32 @@ void bm_circle(struct bitmap *b, int x0, int y0, int r) {
 	int x = -r;
 	int y = 0;
 	int err = 2 - 2 * r;
+	if(b->cmds && bm_record(b, BM_CMD_CIRCLE, x0 - r, y0 - r, x0 + r, y0 + r, NULL, 3, x0, y0, r))
+		return;
+	BM_WRITE(b);
+	BM_DIRTY(b, x0 - r, y0 - r, x0 + r, y0 + r);
 	do {
 		int xp, yp;
 		
 		/* Lower Right */
 		xp = x0 - x; yp = y0 + y;
 		if(xp >= b->clip.x0 && xp < b->clip.x1 && yp >= b->clip.y0 && yp < b->clip.y1)
-			BM_SET(b, xp, yp, b->r, b->g, b->b, b->a);
+			BM_SET_PIXEL(b, xp, yp, b->color);
 		
 		/* Lower Left */
 		xp = x0 - y; yp = y0 - x;
 		if(xp >= b->clip.x0 && xp < b->clip.x1 && yp >= b->clip.y0 && yp < b->clip.y1)
-			BM_SET(b, xp, yp, b->r, b->g, b->b, b->a);
+			BM_SET_PIXEL(b, xp, yp, b->color);
 		
 		/* Upper Left */
 		xp = x0 + x; yp = y0 - y;
 		if(xp >= b->clip.x0 && xp < b->clip.x1 && yp >= b->clip.y0 && yp < b->clip.y1)
-			BM_SET(b, xp, yp, b->r, b->g, b->b, b->a);
+			BM_SET_PIXEL(b, xp, yp, b->color);
 		
 		/* Upper Right */
 		xp = x0 + y; yp = y0 + x;
 		if(xp >= b->clip.x0 && xp < b->clip.x1 && yp >= b->clip.y0 && yp < b->clip.y1)
-			BM_SET(b, xp, yp, b->r, b->g, b->b, b->a);
+			BM_SET_PIXEL(b, xp, yp, b->color);
 				
 		r = err;
 		if(r > x) {
@@ -1315,35 +4115,39 @@ void bm_circle(struct bitmap *b, int x0, int y0, int r) {
 	} while(x < 0);
 }
 
+/* Fills the circle with the rows hw from bm_circle_rows(r) */
+static void bm_fillcircle_rows(struct bitmap *b, int x0, int y0, int r, const int *hw) {
+	int y;
+	BM_DIRTY(b, x0 - r, y0 - r, x0 + r, y0 + r);
+	for(y = 0; y <= r; y++) {
+		if(hw[y] < 0)
+			continue;
+		bm_hspan(b, x0 - hw[y], x0 + hw[y], y0 + y);
+		if(y > 0)
+			bm_hspan(b, x0 - hw[y], x0 + hw[y], y0 - y);
+	}
+}
+
 void bm_fillcircle(struct bitmap *b, int x0, int y0, int r) {
-	int x = -r;
-	int y = 0;
-	int err = 2 - 2 * r;
-	do {
-		int i;
-		for(i = x0 + x; i <= x0 - x; i++) {
-			/* Maybe the clipping can be more effective... */
-			int yp = y0 + y;
-			if(i >= b->clip.x0 && i < b->clip.x1 && yp >= b->clip.y0 && yp < b->clip.y1)
-				BM_SET(b, i, yp, b->r, b->g, b->b, b->a);
-			yp = y0 - y;
-			if(i >= b->clip.x0 && i < b->clip.x1 && yp >= b->clip.y0 && yp < b->clip.y1)
-				BM_SET(b, i, yp, b->r, b->g, b->b, b->a);			
-		}		
-		
-		r = err;
-		if(r > x) {
-			x++;
-			err += x*2 + 1;
-		}
-		if(r <= y) {
-			y++;
-			err += y * 2 + 1;
-		}
-	} while(x < 0);
+	const int *hw;
+	struct bm_cmd *c;
+	if(r < 0 || x0 + r < b->clip.x0 || x0 - r >= b->clip.x1 
+		|| y0 + r < b->clip.y0 || y0 - r >= b->clip.y1)
+		return;
+	hw = bm_circle_rows(r);
+	if(!hw)
+		return;
+	/* The cache isn't safe to use from the bands, so the list gets a copy */
+	if(b->cmds && (c = bm_record(b, BM_CMD_FILLCIRCLE, x0 - r, y0 - r, x0 + r, y0 + r, NULL, 3, x0, y0, r))
+			&& bm_record_data(b, c, 0, hw, (r + 1) * sizeof *hw))
+		return;
+	BM_WRITE(b);
+	bm_fillcircle_rows(b, x0, y0, r, hw);
 }
 
-void bm_ellipse(struct bitmap *b, int x0, int y0, int x1, int y1) {
+/* Traces the outline of the ellipse in the rectangle from <x0,y0> to <x1,y1>, 
+ * calling plot() for every pixel of the outline. */
+static void bm_trace_ellipse(int x0, int y0, int x1, int y1, void (*plot)(void *ctx, int x, int y), void *ctx) {
 	int a = abs(x1-x0), b0 = abs(y1-y0), b1 = b0 & 1;
 	long dx = 4 * (1 - a) * b0 * b0,
 		dy = 4*(b1 + 1) * a * a;
@@ -1357,17 +4161,10 @@ void bm_ellipse(struct bitmap *b, int x0, int y0, int x1, int y1) {
 	b1 = 8 * b0 * b0;
 	
 	do {
-		if(x1 >= b->clip.x0 && x1 < b->clip.x1 && y0 >= b->clip.y0 && y0 < b->clip.y1)
-			BM_SET(b, x1, y0, b->r, b->g, b->b, b->a);	
-		
-		if(x0 >= b->clip.x0 && x0 < b->clip.x1 && y0 >= b->clip.y0 && y0 < b->clip.y1)
-			BM_SET(b, x0, y0, b->r, b->g, b->b, b->a);	
-		
-		if(x0 >= b->clip.x0 && x0 < b->clip.x1 && y1 >= b->clip.y0 && y1 < b->clip.y1)
-			BM_SET(b, x0, y1, b->r, b->g, b->b, b->a);	
-		
-		if(x1 >= b->clip.x0 && x1 < b->clip.x1 && y1 >= b->clip.y0 && y1 < b->clip.y1)
-			BM_SET(b, x1, y1, b->r, b->g, b->b, b->a);	
+		plot(ctx, x1, y0);
+		plot(ctx, x0, y0);
+		plot(ctx, x0, y1);
+		plot(ctx, x1, y1);
 		
 		e2 = 2 * err;
 		if(e2 <= dy) {
@@ -1379,28 +4176,56 @@ void bm_ellipse(struct bitmap *b, int x0, int y0, int x1, int y1) {
 	} while(x0 <= x1);
 	
 	while(y0 - y1 < b0) {
-		if(x0 - 1 >= b->clip.x0 && x0 - 1 < b->clip.x1 && y0 >= b->clip.y0 && y0 < b->clip.y1)
-			BM_SET(b, x0 - 1, y0, b->r, b->g, b->b, b->a);
-		
-		if(x1 + 1 >= b->clip.x0 && x1 + 1 < b->clip.x1 && y0 >= b->clip.y0 && y0 < b->clip.y1)
-			BM_SET(b, x1 + 1, y0, b->r, b->g, b->b, b->a);
+		plot(ctx, x0 - 1, y0);
+		plot(ctx, x1 + 1, y0);
 		y0++;
-		
-		if(x0 - 1 >= b->clip.x0 && x0 - 1 < b->clip.x1 && y0 >= b->clip.y0 && y0 < b->clip.y1)
-			BM_SET(b, x0 - 1, y1, b->r, b->g, b->b, b->a);
-		
-		if(x1 + 1 >= b->clip.x0 && x1 + 1 < b->clip.x1 && y0 >= b->clip.y0 && y0 < b->clip.y1)
-			BM_SET(b, x1 + 1, y1, b->r, b->g, b->b, b->a);	
+		plot(ctx, x0 - 1, y1);
+		plot(ctx, x1 + 1, y1);
 		y1--;
 	}
 }
 
+static void bm_plot_clipped(void *ctx, int x, int y) {
+	struct bitmap *b = ctx;
+	if(x >= b->clip.x0 && x < b->clip.x1 && y >= b->clip.y0 && y < b->clip.y1)
+		BM_SET_PIXEL(b, x, y, b->color);
+}
+
+void bm_ellipse(struct bitmap *b, int x0, int y0, int x1, int y1) {
+	if(b->cmds && bm_record(b, BM_CMD_ELLIPSE, MIN(x0, x1), MIN(y0, y1), MAX(x0, x1), MAX(y0, y1), NULL, 4, x0, y0, x1, y1))
+		return;
+	BM_WRITE(b);
+	BM_DIRTY(b, x0, y0, x1, y1);
+	bm_trace_ellipse(x0, y0, x1, y1, bm_plot_clipped, b);
+}
+
+static void bm_plot_row(void *ctx, int x, int y) {
+	bm_rows_add(ctx, x, x, y);
+}
+
+void bm_fillellipse(struct bitmap *b, int x0, int y0, int x1, int y1) {
+	struct bm_span_rows sr;
+	if(b->cmds && bm_record(b, BM_CMD_FILLELLIPSE, MIN(x0, x1), MIN(y0, y1), MAX(x0, x1), MAX(y0, y1), NULL, 4, x0, y0, x1, y1))
+		return;
+	BM_WRITE(b);
+	if(!bm_rows_init(&sr, b, MIN(y0, y1), MAX(y0, y1)))
+		return;
+	BM_DIRTY(b, x0, y0, x1, y1);
+	bm_trace_ellipse(x0, y0, x1, y1, bm_plot_row, &sr);
+	bm_rows_fill(&sr, b);
+}
+
 void bm_roundrect(struct bitmap *b, int x0, int y0, int x1, int y1, int r) {
 	int x = -r;
 	int y = 0;
 	int err = 2 - 2 * r;
 	int rad = r;
 	
+	if(b->cmds && bm_record(b, BM_CMD_ROUNDRECT, 
+			MIN(x0, x1 - r), MIN(y0, y1 - r), MAX(x1, x0 + r), MAX(y1, y0 + r), NULL, 5, x0, y0, x1, y1, r))
+		return;
+	BM_WRITE(b);
+	BM_DIRTY(b, MIN(x0, x1 - r), MIN(y0, y1 - r), MAX(x1, x0 + r), MAX(y1, y0 + r));
 	bm_line(b, x0 + r, y0, x1 - r, y0);
 	bm_line(b, x0, y0 + r, x0, y1 - r);
 	bm_line(b, x0 + r, y1, x1 - r, y1);
@@ -1412,22 +4237,22 @@ void bm_roundrect(struct bitmap *b, int x0, int y0, int x1, int y1, int r) {
 		/* Lower Right */
 		xp = x1 - x - rad; yp = y1 + y - rad;
 		if(xp >= b->clip.x0 && xp < b->clip.x1 && yp >= b->clip.y0 && yp < b->clip.y1)
-			BM_SET(b, xp, yp, b->r, b->g, b->b, b->a);
+			BM_SET_PIXEL(b, xp, yp, b->color);
 		
 		/* Lower Left */
 		xp = x0 - y + rad; yp = y1 - x - rad;
 		if(xp >= b->clip.x0 && xp < b->clip.x1 && yp >= b->clip.y0 && yp < b->clip.y1)
-			BM_SET(b, xp, yp, b->r, b->g, b->b, b->a);
+			BM_SET_PIXEL(b, xp, yp, b->color);
 		
 		/* Upper Left */
 		xp = x0 + x + rad; yp = y0 - y + rad;
 		if(xp >= b->clip.x0 && xp < b->clip.x1 && yp >= b->clip.y0 && yp < b->clip.y1)
-			BM_SET(b, xp, yp, b->r, b->g, b->b, b->a);
+			BM_SET_PIXEL(b, xp, yp, b->color);
 		
 		/* Upper Right */
 		xp = x1 + y - rad; yp = y0 + x + rad;
 		if(xp >= b->clip.x0 && xp < b->clip.x1 && yp >= b->clip.y0 && yp < b->clip.y1)
-			BM_SET(b, xp, yp, b->r, b->g, b->b, b->a);
+			BM_SET_PIXEL(b, xp, yp, b->color);
 		
 		r = err;
 		if(r > x) {
@@ -1441,42 +4266,40 @@ void bm_roundrect(struct bitmap *b, int x0, int y0, int x1, int y1, int r) {
 	} while(x < 0);
 }
 
-void bm_fillroundrect(struct bitmap *b, int x0, int y0, int x1, int y1, int r) {
-	int x = -r;
-	int y = 0;
-	int err = 2 - 2 * r;
-	int rad = r;
-	do {
-		int xp, xq, yp, i;
-		
-		xp = x0 + x + rad;
-		xq = x1 - x - rad;
-		for(i = xp; i <= xq; i++) {
-			yp = y1 + y - rad;
-			if(i >= b->clip.x0 && i < b->clip.x1 && yp >= b->clip.y0 && yp < b->clip.y1)
-				BM_SET(b, i, yp, b->r, b->g, b->b, b->a);
-			yp = y0 - y + rad;
-			if(i >= b->clip.x0 && i < b->clip.x1 && yp >= b->clip.y0 && yp < b->clip.y1)
-				BM_SET(b, i, yp, b->r, b->g, b->b, b->a);
-		}
-		
-		r = err;
-		if(r > x) {
-			x++;
-			err += x*2 + 1;
-		}
-		if(r <= y) {
-			y++;
-			err += y * 2 + 1;
-		}
-	} while(x < 0);
-	
-	for(y = MAX(y0 + rad + 1, b->clip.y0); y < MIN(y1 - rad, b->clip.y1); y++) {
-		for(x = MAX(x0, b->clip.x0); x <= MIN(x1,b->clip.x1 - 1); x++) {
-			assert(x >= 0 && x < b->w && y >= 0 && y < b->h);
-			BM_SET(b, x, y, b->r, b->g, b->b, b->a);
-		}			
+/* Fills the rounded rectangle with the rows hw from bm_circle_rows(r) */
+static void bm_fillroundrect_rows(struct bitmap *b, int x0, int y0, int x1, int y1, int r, const int *hw) {
+	struct bm_span_rows sr;
+	int y;
+	if(!bm_rows_init(&sr, b, MIN(y0, y1 - r), MAX(y1, y0 + r)))
+		return;
+	BM_DIRTY(b, MIN(x0, x1 - r), MIN(y0, y1 - r), MAX(x1, x0 + r), MAX(y1, y0 + r));
+	/* The corners. The top and bottom rows can overlap if the 
+	 * rectangle is small, so they're collected before filling */
+	for(y = 0; y <= r; y++) {
+		if(hw[y] < 0)
+			continue;
+		bm_rows_add(&sr, x0 + r - hw[y], x1 - r + hw[y], y1 + y - r);
+		bm_rows_add(&sr, x0 + r - hw[y], x1 - r + hw[y], y0 - y + r);
 	}
+	for(y = y0 + r + 1; y < y1 - r; y++)
+		bm_rows_add(&sr, x0, x1, y);
+	bm_rows_fill(&sr, b);
+}
+
+void bm_fillroundrect(struct bitmap *b, int x0, int y0, int x1, int y1, int r) {
+	const int *hw;
+	struct bm_cmd *c;
+	if(r < 0)
+		return;
+	hw = bm_circle_rows(r);
+	if(!hw)
+		return;
+	if(b->cmds && (c = bm_record(b, BM_CMD_FILLROUNDRECT, 
+			MIN(x0, x1 - r), MIN(y0, y1 - r), MAX(x1, x0 + r), MAX(y1, y0 + r), NULL, 5, x0, y0, x1, y1, r))
+			&& bm_record_data(b, c, 0, hw, (r + 1) * sizeof *hw))
+		return;
+	BM_WRITE(b);
+	bm_fillroundrect_rows(b, x0, y0, x1, y1, r, hw);
 }
 
 /* Bexier curve with 3 control points.
@@ -1503,87 +4326,88 @@ void bm_bezier3(struct bitmap *b, int x0, int y0, int x1, int y1, int x2, int y2
 }
 
 void bm_fill(struct bitmap *b, int x, int y) {
-	/* TODO: The function does not take the clipping into account. 
-	 * I'm not really sure how to handle it, to be honest.
-	 */	
-	struct node {int x; int y;} 
-		*queue,
-		n = {x, y};
+	/* Scanline flood fill: Each seed on the stack is filled by 
+	 * extending it left and right into a span. The rows above and 
+	 * below the span are then scanned, and one seed is pushed 
+	 * for each run of source-coloured pixels found there.
+	 */
+	struct seed {int x; int y;} 
+		*stack, n = {x, y};
 		
-	int qs = 0, /* queue size */
-		mqs = 128; /* Max queue size */
-	int sr, sg, sb; /* Source colour */
-	int dr, dg, db; /* Destination colour */
-			
-	bm_get_color(b, &dr, &dg, &db);
-	bm_picker(b, x, y);
-	bm_get_color(b, &sr, &sg, &sb);
+	int bx0 = x, by0 = y, bx1 = x, by1 = y; /* Bounding box */
+	int ss = 0, /* stack size */
+		mss = 128; /* Max stack size */
+	uint32_t rgb = BM_RGB_MASK;
+	uint32_t sc, /* Source colour */
+		dc = b->color; /* Destination colour */
+	
+	if(x < b->clip.x0 || x >= b->clip.x1 || y < b->clip.y0 || y >= b->clip.y1)
+		return;
+	/* It has to read the result of everything drawn before it */
+	BM_WRITE(b);
+	sc = BM_GET_PIXEL(b, x, y) & rgb;
 	
 	/* Don't fill if source == dest
 	 * It leads to major performance problems otherwise
 	 */
-	if(sr == dr && sg == dg && sb == db)
+	if(sc == (dc & rgb))
 		return;
 		
-	queue = calloc(mqs, sizeof *queue);
-	if(!queue)
+	stack = malloc(mss * sizeof *stack);
+	if(!stack)
 		return;
 		
-	queue[qs++] = n;
+	stack[ss++] = n;
 	
-	while(qs > 0) {
-		struct node w,e;
-		int i;
+	while(ss > 0) {
+		uint32_t *row;
+		int l, r, ny;
 		
-		n = queue[--qs];
-		w = n;
-		e = n;
+		n = stack[--ss];
+		row = BM_ROW32(b, n.y);
 		
-		if(!bm_color_is(b, n.x, n.y, sr, sg, sb))
+		if((row[n.x] & rgb) != sc)
 			continue;
 		
-		while(w.x > 0) {			
-			if(!bm_color_is(b, w.x-1, w.y, sr, sg, sb)) {
-				break;
-			}
-			w.x--;
-		}
-		while(e.x < b->w - 1) {
-			if(!bm_color_is(b, e.x+1, e.y, sr, sg, sb)) {
-				break;
-			}
-			e.x++;
-		}
-		for(i = w.x; i <= e.x; i++) {
-			assert(i >= 0 && i < b->w);
-			BM_SET(b, i, w.y, dr, dg, db, b->a);			
-			if(w.y > 0) {
-				if(bm_color_is(b, i, w.y - 1, sr, sg, sb)) {
-					struct node nn = {i, w.y - 1};
-					queue[qs++] = nn;
-					if(qs == mqs) {
-						mqs <<= 1;
-						queue = realloc(queue, mqs * sizeof *queue);
-						if(!queue)
-							return;
-					}
-				}
-			}
-			if(w.y < b->h - 1) {
-				if(bm_color_is(b, i, w.y + 1, sr, sg, sb)) {
-					struct node nn = {i, w.y + 1};
-					queue[qs++] = nn;
-					if(qs == mqs) {
-						mqs <<= 1;
-						queue = realloc(queue, mqs * sizeof *queue);
-						if(!queue)
-							return;
+		for(l = n.x; l > b->clip.x0 && (row[l - 1] & rgb) == sc; l--);
+		for(r = n.x; r < b->clip.x1 - 1 && (row[r + 1] & rgb) == sc; r++);
+		
+		bm_fill32(row + l, r - l + 1, dc);
+		bx0 = MIN(bx0, l);
+		bx1 = MAX(bx1, r);
+		by0 = MIN(by0, n.y);
+		by1 = MAX(by1, n.y);
+		
+		for(ny = n.y - 1; ny <= n.y + 1; ny += 2) {
+			uint32_t *nrow;
+			int i;
+			if(ny < b->clip.y0 || ny >= b->clip.y1)
+				continue;
+			nrow = BM_ROW32(b, ny);
+			for(i = l; i <= r; i++) {
+				if((nrow[i] & rgb) != sc)
+					continue;
+				if(ss == mss) {
+					struct seed *ns = realloc(stack, 2 * mss * sizeof *stack);
+					if(!ns) {
+						free(stack);
+						BM_DIRTY(b, bx0, by0, bx1, by1);
+						return;
 					}
+					stack = ns;
+					mss <<= 1;
 				}
+				stack[ss].x = i;
+				stack[ss].y = ny;
+				ss++;
+				/* Skip the rest of this run */
+				while(i < r && (nrow[i + 1] & rgb) == sc)
+					i++;
 			}
-		}		
+		}
 	}
-	free(queue);
+	free(stack);
+	BM_DIRTY(b, bx0, by0, bx1, by1);
 }
 
 void bm_set_font(struct bitmap *b, const unsigned char *font, int spacing) {
@@ -1673,55 +4497,217 @@ int bm_text_height(struct bitmap *b, const char *s) {
 	return height * 8;
 }
 
-void bm_putc(struct bitmap *b, int x, int y, char c) {
-	int frow, fcol, byte;
-	int i, j;
-	if(c < 32 || c > 127) return;
-	c -= 32;
-	fcol = c >> 3;
-	frow = c & 0x7;
-	byte = frow * FONT_WIDTH + fcol;
-	for(j = 0; j < 8 && y + j < b->clip.y1; j++) {
-		if(y + j >= b->clip.y0) {
-			char bits = b->font[byte];
-			for(i = 0; i < 8 && x + i < b->clip.x1; i++) {
-				if(x + i >= b->clip.x0 && !(bits & (1 << i))) {
-					BM_SET(b, x + i, y + j, b->r, b->g, b->b, b->a);
+/* Glyph cache:
+ * The first time a font is used, its XBM data is expanded into one 
+ * 64-bit mask per glyph, where bit (j * 8 + i) is set if pixel i 
+ * of row j of the glyph is lit. The cache is keyed on the font data
+ * pointer, so the font data should not change once it has been used.
+ */
+#define BM_GLYPH_FONTS	8
+#define BM_NUM_GLYPHS	96
+
+static struct bm_glyphs {
+	const unsigned char *font;
+	uint64_t glyph[BM_NUM_GLYPHS];
+} bm_glyph_cache[BM_GLYPH_FONTS];
+static int bm_glyph_next;
+
+static const uint64_t *bm_get_glyphs(const unsigned char *font) {
+	struct bm_glyphs *g;
+	int k, i, j;
+	for(k = 0; k < BM_GLYPH_FONTS; k++) {
+		if(bm_glyph_cache[k].font == font)
+			return bm_glyph_cache[k].glyph;
+	}
+	g = &bm_glyph_cache[bm_glyph_next];
+	bm_glyph_next = (bm_glyph_next + 1) % BM_GLYPH_FONTS;
+	for(k = 0; k < BM_NUM_GLYPHS; k++) {
+		int fcol = k >> 3, frow = k & 0x7;
+		int byte = frow * FONT_WIDTH + fcol;
+		uint64_t m = 0;
+		for(j = 0; j < 8; j++) {
+			unsigned char bits = font[byte];
+			for(i = 0; i < 8; i++) {
+				/* Lit pixels are 0 in the XBM data */
+				if(!(bits & (1 << i)))
+					m |= (uint64_t)1 << (j * 8 + i);
+			}
+			byte += FONT_WIDTH >> 3;
+		}
+		g->glyph[k] = m;
+	}
+	g->font = font;
+	return g->glyph;
+}
+
+/* Draws a horizontal span of w pixels at x,y, scaled by 2^s 
+ * vertically, clipped to b's clip rectangle. p is the pen;
+ * It is blended with the bitmap if blend is set. */
+static void bm_text_span(struct bitmap *b, int x, int y, int w, int s, uint32_t p, int blend) {
+	int y0 = MAX(y, b->clip.y0), y1 = MIN(y + (1 << s), b->clip.y1);
+	int x0 = MAX(x, b->clip.x0), x1 = MIN(x + w, b->clip.x1);
+	for(; y0 < y1 && x0 < x1; y0++) {
+		if(blend)
+			bm_blend_row(BM_PIXEL(b, x0, y0), (unsigned char *)&p, 0, x1 - x0, 255, 0, 0);
+		else
+			bm_fill32(BM_ROW32(b, y0) + x0, x1 - x0, p);
+	}
+}
+
+/* The pen colour to use for text; Premultiplied if it must be blended */
+static uint32_t bm_text_pen(struct bitmap *b, int *blend) {
+	*blend = BM_COMP(b->color, 3) < 255;
+	return *blend ? bm_pen_premul(b) : b->color;
+}
+
+/* Draws the glyph mask g at x,y scaled by 2^s, one run of lit pixels at a time */
+static void bm_draw_glyph(struct bitmap *b, int x, int y, int s, uint64_t g, uint32_t p, int blend) {
+	int j, size = 8 << s;
+	if(!g || x >= b->clip.x1 || y >= b->clip.y1 || x + size <= b->clip.x0 || y + size <= b->clip.y0)
+		return;
+	for(j = 0; j < 8; j++) {
+		unsigned int bits = (g >> (j * 8)) & 0xFF;
+		int i = 0;
+		while(bits) {
+			int i0;
+			for(; !(bits & 1); bits >>= 1) i++;
+			for(i0 = i; bits & 1; bits >>= 1) i++;
+			bm_text_span(b, x + (i0 << s), y + (j << s), (i - i0) << s, s, p, blend);
+		}
+	}
+}
+
+/* Text-run cache:
+ * bm_puts() and bm_putss() store the spans of lit pixels of each string
+ * they draw, keyed on the string, font, spacing and scale, so that 
+ * redrawing the same text on the next frame is just a list of fills.
+ */
+#define BM_RUN_CACHE_SIZE	64
+#define BM_RUN_MAX_LEN		256
+
+struct bm_text_span {
+	short x, y, w;
+};
+
+static struct bm_text_run {
+	/* The buffers are reused when an entry is replaced */
+	char text[BM_RUN_MAX_LEN];
+	const unsigned char *font;
+	int spacing, scale;
+	int nspans, aspans;
+	struct bm_text_span *spans;
+} bm_run_cache[BM_RUN_CACHE_SIZE];
+
+/* Lays out text at 0,0 like bm_putss(), storing each run of lit 
+ * pixels in r's spans. Returns 0 if it runs out of memory. */
+static int bm_layout_text(struct bitmap *b, int s, const char *text, struct bm_text_run *r) {
+	const uint64_t *glyphs = bm_get_glyphs(b->font);
+	int x = 0, y = 0, n = 0;
+	for(; text[0]; text++) {
+		if(text[0] == '\n') {
+			y += 8 << s;
+			x = 0;
+		} else if(text[0] == '\r') {
+			x = 0;
+		} else {
+			/* Tabs and unprintable characters are treated as spaces */
+			int c = (unsigned char)text[0];
+			if(c >= 32 && c <= 127) {
+				uint64_t g = glyphs[c - 32];
+				int j;
+				for(j = 0; j < 8 && g; j++) {
+					unsigned int bits = (g >> (j * 8)) & 0xFF;
+					int i = 0;
+					while(bits) {
+						int i0;
+						for(; !(bits & 1); bits >>= 1) i++;
+						for(i0 = i; bits & 1; bits >>= 1) i++;
+						if(n == r->aspans) {
+							int a = r->aspans ? r->aspans << 1 : 64;
+							struct bm_text_span *ns = realloc(r->spans, a * sizeof *ns);
+							if(!ns)
+								return 0;
+							r->spans = ns;
+							r->aspans = a;
+						}
+						r->spans[n].x = x + (i0 << s);
+						r->spans[n].y = y + (j << s);
+						r->spans[n].w = (i - i0) << s;
+						n++;
+					}
 				}
 			}
+			x += b->font_spacing << s;
 		}
-		byte += FONT_WIDTH >> 3;
 	}
+	r->nspans = n;
+	return 1;
 }
 
-void bm_puts(struct bitmap *b, int x, int y, const char *text) {
+static unsigned int bm_run_hash(const char *text, const unsigned char *font, int spacing, int s) {
+	/* djb2, with the font, spacing and scale mixed in */
+	unsigned int h = 5381 + (unsigned int)(uintptr_t)font + spacing * 31 + s;
+	for(; *text; text++)
+		h = (h << 5) + h + (unsigned char)*text;
+	return h;
+}
+
+/* Returns the cached spans for text, or NULL if it can't be cached */
+static struct bm_text_run *bm_get_run(struct bitmap *b, int s, const char *text) {
+	struct bm_text_run *r;
+	size_t len = strlen(text);
+	if(len >= BM_RUN_MAX_LEN || s > 4)
+		return NULL;
+	r = &bm_run_cache[bm_run_hash(text, b->font, b->font_spacing, s) % BM_RUN_CACHE_SIZE];
+	if(r->font == b->font && r->spacing == b->font_spacing && r->scale == s && !strcmp(r->text, text))
+		return r;
+	
+	r->font = NULL;
+	if(!bm_layout_text(b, s, text, r))
+		return NULL;
+	memcpy(r->text, text, len + 1);
+	r->font = b->font;
+	r->spacing = b->font_spacing;
+	r->scale = s;
+	return r;
+}
+
+/* Draws text with the glyph masks directly, without the text-run cache */
+static void bm_draw_text(struct bitmap *b, int x, int y, int s, const char *text, const uint64_t *glyphs, uint32_t p, int blend) {
 	int xs = x;
-	while(text[0]) {
-		if(text[0] == '\n') {
-			y += 8;
+	for(; text[0]; text++) {
+		int c = (unsigned char)text[0];
+		if(c == '\n') {
+			y += 8 << s;
 			x = xs;
-		} else if(text[0] == '\t') {
-			/* I briefly toyed with the idea of having tabs line up,
-			 * but it doesn't really make sense because
-			 * this isn't exactly a character based terminal.
-			 */
-			x += b->font_spacing;
-		} else if(text[0] == '\r') {
-			/* why would anyone find this useful? */
+		} else if(c == '\r') {
 			x = xs;
 		} else {
-			bm_putc(b, x, y, text[0]);
-			x += b->font_spacing;
+			if(c >= 32 && c <= 127)
+				bm_draw_glyph(b, x, y, s, glyphs[c - 32], p, blend);
+			x += b->font_spacing << s;
 		}
-		text++;
-		if(y > b->h) { 
-			/* I used to check x >= b->w as well,
-			but it doesn't take \n's into account */
+		if(y > b->h) 
 			return;
-		}
 	}
 }
 
+/* Marks the box that bm_putss() can draw in as dirty.
+ * Every character advances the pen, and the last glyph is 8 
+ * pixels wide even if the font spacing is less */
+static void bm_text_dirty(struct bitmap *b, int x, int y, int s, const char *text) {
+	BM_DIRTY(b, x, y, x + (((int)strlen(text) * b->font_spacing + 8) << s) - 1, 
+		y + (bm_text_height(b, text) << s) - 1);
+}
+
+void bm_putc(struct bitmap *b, int x, int y, char c) {
+	bm_putcs(b, x, y, 0, c);
+}
+
+void bm_puts(struct bitmap *b, int x, int y, const char *text) {
+	bm_putss(b, x, y, 0, text);
+}
+
 void bm_printf(struct bitmap *b, int x, int y, const char *fmt, ...) {
 	char buffer[256];
 	va_list arg;
@@ -1732,51 +4718,53 @@ void bm_printf(struct bitmap *b, int x, int y, const char *fmt, ...) {
 }
 
 void bm_putcs(struct bitmap *b, int x, int y, int s, char c) {
-	int frow, fcol, byte;
-	int i, j;
-	if(c < 32 || c > 127) return;
-	c -= 32;
-	fcol = c >> 3;
-	frow = c & 0x7;
-	
-	for(j = 0; j < (8 << s) && y + j < b->clip.y1; j++) {
-		byte = frow * FONT_WIDTH + fcol + (j >> s) * (FONT_WIDTH >> 3);		
-		if(y + j >= b->clip.y0) {
-			char bits = b->font[byte];
-			for(i = 0; i < (8 << s) && x + i < b->clip.x1; i++) {
-				if(x + i >= b->clip.x0 && !(bits & (1 << (i >> s)))) {
-					BM_SET(b, x + i, y + j, b->r, b->g, b->b, b->a);
-				}
-			}
-		}
+	int blend;
+	uint32_t p;
+	if((unsigned char)c < 32 || (unsigned char)c > 127) return;
+	if(b->cmds) {
+		/* Recorded as a one character string */
+		char text[2];
+		text[0] = c;
+		text[1] = '\0';
+		bm_putss(b, x, y, s, text);
+		return;
 	}
+	BM_WRITE(b);
+	p = bm_text_pen(b, &blend);
+	BM_DIRTY(b, x, y, x + (8 << s) - 1, y + (8 << s) - 1);
+	bm_draw_glyph(b, x, y, s, bm_get_glyphs(b->font)[c - 32], p, blend);
 }
 
 void bm_putss(struct bitmap *b, int x, int y, int s, const char *text) {
-	int xs = x;
-	while(text[0]) {
-		if(text[0] == '\n') {
-			y += 8 << s;
-			x = xs;
-		} else if(text[0] == '\t') {
-			/* I briefly toyed with the idea of having tabs line up,
-			 * but it doesn't really make sense because
-			 * this isn't exactly a character based terminal.
-			 */
-			x += b->font_spacing << s;
-		} else if(text[0] == '\r') {
-			/* why would anyone find this useful? */
-			x = xs;
-		} else {
-			bm_putcs(b, x, y, s, text[0]);
-			x += b->font_spacing << s;
-		}
-		text++;
-		if(y > b->h) { 
-			/* I used to check x >= b->w as well,
-			but it doesn't take \n's into account */
-			return;
+	int blend, k;
+	uint32_t p;
+	struct bm_text_run *r;
+	struct bm_cmd *c;
+	if(b->cmds && (c = bm_record(b, BM_CMD_TEXT, x, y, 
+			x + (((int)strlen(text) * b->font_spacing + 8) << s) - 1, y + (bm_text_height(b, text) << s) - 1, NULL, 3, x, y, s))
+			&& bm_record_data(b, c, 0, text, strlen(text) + 1)) {
+		/* The bands can't use the glyph cache, so the list keeps a copy */
+		struct bm_cmdlist *l = b->cmds;
+		if(l->font != b->font) {
+			if(!bm_record_data(b, c, 1, bm_get_glyphs(b->font), BM_NUM_GLYPHS * sizeof(uint64_t)))
+				goto direct;
+			l->font = b->font;
+			l->glyphs = c->data[1];
 		}
+		c->data[1] = l->glyphs;
+		return;
+	}
+direct:
+	BM_WRITE(b);
+	p = bm_text_pen(b, &blend);
+	r = bm_get_run(b, s, text);
+	bm_text_dirty(b, x, y, s, text);
+	if(r) {
+		for(k = 0; k < r->nspans; k++)
+			bm_text_span(b, x + r->spans[k].x, y + r->spans[k].y, r->spans[k].w, s, p, blend);
+	} else {
+		/* Too long to cache: Draw the glyphs directly */
+		bm_draw_text(b, x, y, s, text, bm_get_glyphs(b->font), p, blend);
 	}
 }
 
@@ -1792,3 +4780,546 @@ void bm_printfs(struct bitmap *b, int x, int y, int s, const char *fmt, ...) {
 		bm_puts(b, x, y, buffer);
 }
 
+
+/* Command lists and deferred drawing: See struct bm_cmdlist */
+
+static void bm_cmdlist_release(struct bm_cmdlist *l) {
+	free(l->cmds);
+	free(l->order);
+	free(l->data);
+	free(l->srcs);
+	free(l->bands);
+	free(l);
+}
+
+/* Returns the list that bm_flush() replays on b, if b is deferred */
+static struct bm_cmdlist *bm_deferred_list(struct bitmap *b) {
+	struct bm_cmdlist *l;
+	for(l = b->cmds; l && !l->deferred; l = l->saved);
+	return l;
+}
+
+void bm_defer(struct bitmap *b, int enable) {
+	struct bm_cmdlist *l, **p;
+	if(enable && !b->parent && !bm_deferred_list(b)) {
+		l = calloc(1, sizeof *l);
+		if(!l)
+			return;
+		l->owner = b;
+		l->deferred = 1;
+		l->next = bm_cmdlists;
+		bm_cmdlists = l;
+		/* Lists recorded with bm_cmdlist_begin() stay on top */
+		for(p = &b->cmds; *p; p = &(*p)->saved);
+		*p = l;
+		bm_deferring++;
+	} else if(!enable && (l = bm_deferred_list(b))) {
+		bm_flush(b);
+		for(p = &bm_cmdlists; *p != l; p = &(*p)->next);
+		*p = l->next;
+		for(p = &b->cmds; *p != l; p = &(*p)->saved);
+		*p = NULL;
+		bm_deferring--;
+		bm_cmdlist_release(l);
+	}
+}
+
+#define BM_SRC_HASH(P)	((unsigned int)(((uintptr_t)(P) >> 4) * 2654435761u))
+
+static int bm_srcs_has(struct bm_cmdlist *l, const void *src) {
+	unsigned int i, m = l->asrcs - 1;
+	if(!l->nsrcs)
+		return 0;
+	for(i = BM_SRC_HASH(src) & m; l->srcs[i]; i = (i + 1) & m) {
+		if(l->srcs[i] == src)
+			return 1;
+	}
+	return 0;
+}
+
+static void bm_srcs_insert(struct bm_cmdlist *l, const void *src) {
+	unsigned int i, m = l->asrcs - 1;
+	for(i = BM_SRC_HASH(src) & m; l->srcs[i]; i = (i + 1) & m);
+	l->srcs[i] = src;
+	l->nsrcs++;
+}
+
+static int bm_srcs_add(struct bm_cmdlist *l, const void *src) {
+	if(bm_srcs_has(l, src))
+		return 1;
+	/* Keep the set at most half full */
+	if(2 * (l->nsrcs + 1) > l->asrcs) {
+		const void **old = l->srcs;
+		int i, n = l->asrcs, a = n ? n * 2 : 16;
+		l->srcs = calloc(a, sizeof *l->srcs);
+		if(!l->srcs) {
+			l->srcs = old;
+			return 0;
+		}
+		l->asrcs = a;
+		l->nsrcs = 0;
+		for(i = 0; i < n; i++) {
+			if(old[i])
+				bm_srcs_insert(l, old[i]);
+		}
+		free(old);
+	}
+	bm_srcs_insert(l, src);
+	return 1;
+}
+
+/* A command that can't be recorded is drawn directly, so the commands
+ * before it in a deferred list have to be drawn first */
+static struct bm_cmd *bm_record_failed(struct bitmap *b) {
+	if(b->cmds->deferred)
+		bm_flush(b);
+	return NULL;
+}
+
+/* Appends a command with the n integer arguments to b's list.
+ * x0,y0 to x1,y1 is the box it can draw in. If it can't be recorded
+ * it returns NULL, so the caller draws directly */
+static struct bm_cmd *bm_record(struct bitmap *b, int op, int x0, int y0, int x1, int y1, const void *src, int n, ...) {
+	struct bm_cmdlist *l = b->cmds;
+	struct bm_cmd *c;
+	va_list args;
+	const void *root = src;
+	int i;
+	
+	assert(n <= (int)(sizeof c->a / sizeof c->a[0]));
+	if(src && op != BM_CMD_RLE_BLIT) {
+		const struct bitmap *sb = src;
+		if(l->deferred && BM_ALIASED(sb, b)) {
+			/* The bands would read each other's rows */
+			bm_flush(b);
+			return NULL;
+		}
+		/* Changing any view of the source's pixels flushes the list */
+		root = BM_ROOT(sb);
+	}
+	if(l->n == l->a) {
+		int a = l->a ? l->a * 2 : 64, *order;
+		c = realloc(l->cmds, a * sizeof *c);
+		if(!c)
+			return bm_record_failed(b);
+		l->cmds = c;
+		order = realloc(l->order, a * sizeof *order);
+		if(!order)
+			return bm_record_failed(b);
+		l->order = order;
+		l->a = a;
+	}
+	if(root && !bm_srcs_add(l, root))
+		return bm_record_failed(b);
+	
+	c = &l->cmds[l->n++];
+	c->op = op;
+	c->box[0] = x0;
+	c->box[1] = y0;
+	c->box[2] = x1;
+	c->box[3] = y1;
+	c->color = b->color;
+	c->font = b->font;
+	c->font_spacing = b->font_spacing;
+	c->clip[0] = b->clip.x0;
+	c->clip[1] = b->clip.y0;
+	c->clip[2] = b->clip.x1;
+	c->clip[3] = b->clip.y1;
+	c->src = src;
+	/* The mask colour and flags of the source can change before the replay */
+	c->key = src && op != BM_CMD_RLE_BLIT ? ((const struct bitmap *)src)->color : 0;
+	c->src_flags = src && op != BM_CMD_RLE_BLIT ? ((const struct bitmap *)src)->flags : 0;
+	va_start(args, n);
+	for(i = 0; i < n; i++)
+		c->a[i] = va_arg(args, int);
+	va_end(args);
+	return c;
+}
+
+/* Copies size bytes at p to the list, as argument i of c, which must
+ * be the last command. If it runs out of memory c is dropped and it
+ * returns 0 */
+static int bm_record_data(struct bitmap *b, struct bm_cmd *c, int i, const void *p, size_t size) {
+	struct bm_cmdlist *l = b->cmds;
+	size_t at = (l->ndata + 7) & ~(size_t)7;
+	if(at + size > l->adata) {
+		size_t a = l->adata ? l->adata : 1024;
+		unsigned char *data;
+		while(a < at + size)
+			a *= 2;
+		data = realloc(l->data, a);
+		if(!data) {
+			l->n--;
+			bm_record_failed(b);
+			return 0;
+		}
+		l->data = data;
+		l->adata = a;
+	}
+	memcpy(l->data + at, p, size);
+	l->ndata = at + size;
+	c->data[i] = at;
+	return 1;
+}
+
+/* Flushes the deferred lists that have recorded blits from src */
+static void bm_sync(const void *src) {
+	struct bm_cmdlist *l;
+	for(l = bm_cmdlists; l; l = l->next) {
+		if(l->n && !l->busy && bm_srcs_has(l, src))
+			bm_flush(l->owner);
+	}
+}
+
+/* Replays the planned commands on the rows y0 to y1-1 of the target */
+static void bm_replay_band(void *arg, int y0, int y1) {
+	struct bm_cmdlist *l = arg;
+	struct bitmap t = *l->target, s, *sp;
+	struct bm_dirty d;
+	int k, blend;
+	uint32_t p;
+	
+	t.cmds = NULL;
+	/* bm_replay() marks what a view draws on its parent, since 
+	 * the bands can't share the parent's dirty rectangles */
+	t.parent = NULL;
+	d.n = 0;
+	if(t.dirty)
+		t.dirty = l->bands ? &d : NULL;
+	
+	for(k = 0; k < l->norder; k++) {
+		const struct bm_cmd *c = &l->cmds[l->order[k]];
+		const int *a = c->a;
+		if(c->area[3] < y0 || c->area[1] >= y1)
+			continue;
+	
+		t.color = c->color;
+		if(c->op == BM_CMD_PIXEL) {
+			/* bm_set_pixel() doesn't clip */
+			bm_set_pixel(&t, a[0], a[1], c->color);
+			continue;
+		} else if(c->op == BM_CMD_CLEAR) {
+			/* Neither does bm_clear() */
+			if(BM_CONTIGUOUS(&t))
+				bm_fill32(BM_ROW32(&t, y0), (size_t)t.w * (y1 - y0), c->color);
+			else {
+				int y;
+				for(y = y0; y < y1; y++)
+					bm_fill32(BM_ROW32(&t, y), t.w, c->color);
+			}
+			bm_dirty_add(&t, 0, y0, t.w, y1);
+			continue;
+		}
+	
+		t.font = c->font;
+		t.font_spacing = c->font_spacing;
+		t.clip.x0 = MAX(c->clip[0], 0);
+		t.clip.y0 = MAX(c->clip[1], y0);
+		t.clip.x1 = MIN(c->clip[2], t.w);
+		t.clip.y1 = MIN(c->clip[3], y1);
+		sp = &s;
+		if(c->src == l->target) {
+			/* Blits within the target have to see the pixels drawn so far */
+			t.color = c->key;
+			sp = &t;
+		} else if(c->src && c->op != BM_CMD_RLE_BLIT) {
+			s = *(const struct bitmap *)c->src;
+			s.color = c->key;
+			s.flags = c->src_flags;
+		}
+	
+		switch(c->op) {
+			case BM_CMD_PUTPIXEL: bm_putpixel(&t, a[0], a[1]); break;
+			case BM_CMD_LINE: bm_line(&t, a[0], a[1], a[2], a[3]); break;
+			case BM_CMD_RECT: bm_rect(&t, a[0], a[1], a[2], a[3]); break;
+			case BM_CMD_FILLRECT: bm_fillrect(&t, a[0], a[1], a[2], a[3]); break;
+			case BM_CMD_CIRCLE: bm_circle(&t, a[0], a[1], a[2]); break;
+			case BM_CMD_FILLCIRCLE:
+				bm_fillcircle_rows(&t, a[0], a[1], a[2], (const int *)(l->data + c->data[0]));
+				break;
+			case BM_CMD_ELLIPSE: bm_ellipse(&t, a[0], a[1], a[2], a[3]); break;
+			case BM_CMD_FILLELLIPSE: bm_fillellipse(&t, a[0], a[1], a[2], a[3]); break;
+			case BM_CMD_ROUNDRECT: bm_roundrect(&t, a[0], a[1], a[2], a[3], a[4]); break;
+			case BM_CMD_FILLROUNDRECT:
+				bm_fillroundrect_rows(&t, a[0], a[1], a[2], a[3], a[4], (const int *)(l->data + c->data[0]));
+				break;
+			case BM_CMD_TEXT: {
+				const char *text = (const char *)l->data + c->data[0];
+				p = bm_text_pen(&t, &blend);
+				bm_text_dirty(&t, a[0], a[1], a[2], text);
+				bm_draw_text(&t, a[0], a[1], a[2], text, (const uint64_t *)(l->data + c->data[1]), p, blend);
+			} break;
+			case BM_CMD_BLIT: bm_blit(&t, a[0], a[1], sp, a[2], a[3], a[4], a[5]); break;
+			case BM_CMD_MASKEDBLIT: bm_maskedblit(&t, a[0], a[1], sp, a[2], a[3], a[4], a[5]); break;
+			case BM_CMD_BLIT_ALPHA: bm_blit_alpha(&t, a[0], a[1], sp, a[2], a[3], a[4], a[5], a[6]); break;
+			case BM_CMD_BLIT_EX:
+				bm_blit_ex(&t, a[0], a[1], a[2], a[3], sp, a[4], a[5], a[6], a[7], a[8]);
+				break;
+			case BM_CMD_RLE_BLIT:
+				bm_rle_blit(&t, a[0], a[1], (struct bm_rle *)c->src, a[2], a[3], a[4], a[5]);
+				break;
+			case BM_CMD_ROTOZOOM:
+				bm_rotozoom(&t, a[0], a[1], sp, a[2], a[3], a[4], a[5], a[6], a[7], a[8]);
+				break;
+		}
+	}
+	
+	/* Every band starts at a different multiple of BM_MIN_BAND_ROWS */
+	if(t.dirty)
+		l->bands[y0 / BM_MIN_BAND_ROWS] = d;
+}
+
+/* How many opaque commands hide the ones before them, and how far back
+ * bm_plan() looks for a blit from the same source */
+#define BM_MAX_OCCLUDERS	16
+#define BM_SORT_WINDOW		32
+
+#define BM_BOX_EMPTY(E)		((E)[0] > (E)[2] || (E)[1] > (E)[3])
+#define BM_BOX_INSIDE(E, O)	((E)[0] >= (O)[0] && (E)[1] >= (O)[1] && (E)[2] <= (O)[2] && (E)[3] <= (O)[3])
+#define BM_BOX_OVERLAP(E, O)	((E)[0] <= (O)[2] && (E)[2] >= (O)[0] && (E)[1] <= (O)[3] && (E)[3] >= (O)[1])
+
+/* Sets o to the area c overwrites completely in the target, whatever
+ * was there before. Returns 0 if c doesn't */
+static int bm_cmd_covers(const struct bm_cmd *c, int o[4]) {
+	const int *e = c->area, *a = c->a;
+	int dx = a[0], dy = a[1], sx, sy, w, h;
+	const struct bitmap *src = c->src;
+	switch(c->op) {
+		case BM_CMD_CLEAR: break;
+		case BM_CMD_FILLRECT:
+			if(BM_COMP(c->color, 3) < 255)
+				return 0;
+			break;
+		case BM_CMD_BLIT:
+			/* The area is only an upper bound for blits */
+			sx = a[2];
+			sy = a[3];
+			w = a[4];
+			h = a[5];
+			if(!bm_clip_area(e[0], e[1], e[2] + 1, e[3] + 1, &dx, &dy, src->w, src->h, &sx, &sy, &w, &h))
+				return 0;
+			o[0] = dx;
+			o[1] = dy;
+			o[2] = dx + w - 1;
+			o[3] = dy + h - 1;
+			return 1;
+		default:
+			return 0;
+	}
+	memcpy(o, e, 4 * sizeof *o);
+	return 1;
+}
+
+/* Works out which commands of l to draw on l->target, and in which
+ * order: Commands hidden by later opaque commands are culled, and blits
+ * are moved up behind earlier blits from the same source if nothing
+ * in between overlaps them, so that the source stays in the cache */
+static void bm_plan(struct bm_cmdlist *l) {
+	struct bitmap *t = l->target;
+	int occ[BM_MAX_OCCLUDERS][4], nocc = 0, i, j, k, n = 0;
+	
+	l->culled = 0;
+	l->moved = 0;
+	l->serial = 0;
+	for(i = 0; i < l->n; i++) {
+		struct bm_cmd *c = &l->cmds[i];
+		int *e = c->area;
+		if(c->op == BM_CMD_CLEAR) {
+			e[0] = 0;
+			e[1] = 0;
+			e[2] = t->w - 1;
+			e[3] = t->h - 1;
+		} else {
+			e[0] = MAX(c->box[0], 0);
+			e[1] = MAX(c->box[1], 0);
+			e[2] = MIN(c->box[2], t->w - 1);
+			e[3] = MIN(c->box[3], t->h - 1);
+			if(c->op != BM_CMD_PIXEL) {
+				e[0] = MAX(e[0], c->clip[0]);
+				e[1] = MAX(e[1], c->clip[1]);
+				e[2] = MIN(e[2], c->clip[2] - 1);
+				e[3] = MIN(e[3], c->clip[3] - 1);
+			}
+		}
+		if(c->src && c->op != BM_CMD_RLE_BLIT && BM_ALIASED((const struct bitmap *)c->src, t))
+			l->serial = 1;
+	}
+	
+	/* Walk backwards, so that the occluders are the commands that
+	 * come after the one being looked at. Blits that read the target
+	 * depend on everything before them, so then nothing is hidden */
+	for(i = l->n - 1; i >= 0; i--) {
+		const struct bm_cmd *c = &l->cmds[i];
+		if(BM_BOX_EMPTY(c->area)) {
+			l->culled++;
+			continue;
+		}
+		if(!l->serial) {
+			for(j = 0; j < nocc && !BM_BOX_INSIDE(c->area, occ[j]); j++);
+			if(j < nocc) {
+				l->culled++;
+				continue;
+			}
+			if(nocc < BM_MAX_OCCLUDERS && bm_cmd_covers(c, occ[nocc]))
+				nocc++;
+		}
+		l->order[n++] = i;
+	}
+	for(i = 0; i < n / 2; i++) {
+		k = l->order[i];
+		l->order[i] = l->order[n - 1 - i];
+		l->order[n - 1 - i] = k;
+	}
+	l->norder = n;
+	if(l->serial)
+		return;
+	
+	for(k = 1; k < n; k++) {
+		const struct bm_cmd *c = &l->cmds[l->order[k]];
+		if(c->op < BM_CMD_BLIT)
+			continue;
+		for(j = k - 1; j >= 0 && j >= k - BM_SORT_WINDOW; j--) {
+			const struct bm_cmd *o = &l->cmds[l->order[j]];
+			if(o->src == c->src || BM_BOX_OVERLAP(c->area, o->area))
+				break;
+		}
+		if(j >= 0 && j < k - 1 && l->cmds[l->order[j]].src == c->src) {
+			i = l->order[k];
+			memmove(l->order + j + 2, l->order + j + 1, (k - j - 1) * sizeof *l->order);
+			l->order[j + 1] = i;
+			l->moved++;
+		}
+	}
+}
+
+/* Draws the commands of l on dst. Lists whose blits read dst are drawn
+ * on a single thread, in the order they were recorded */
+static void bm_replay(struct bm_cmdlist *l, struct bitmap *dst) {
+	int deferring, i, j, n = dst->h / BM_MIN_BAND_ROWS + 1;
+	
+	l->busy = 1;
+	l->target = dst;
+	bm_plan(l);
+	
+	if(dst->dirty && n > l->nbands) {
+		free(l->bands);
+		l->bands = malloc(n * sizeof *l->bands);
+		l->nbands = l->bands ? n : 0;
+	}
+	for(i = 0; i < l->nbands; i++)
+		l->bands[i].n = 0;
+	
+	deferring = bm_deferring;
+	bm_deferring = 0;
+	if(l->serial)
+		bm_replay_band(l, 0, dst->h);
+	else
+		bm_run_bands(bm_replay_band, l, dst->h);
+	bm_deferring = deferring;
+	
+	if(dst->dirty) {
+		if(!l->bands)
+			bm_dirty_all(dst);
+		for(i = 0; i < l->nbands; i++) {
+			for(j = 0; j < l->bands[i].n; j++)
+				bm_dirty_add(dst, l->bands[i].r[j].x0, l->bands[i].r[j].y0, l->bands[i].r[j].x1, l->bands[i].r[j].y1);
+		}
+	} else if(dst->parent) {
+		for(i = 0; i < l->norder; i++) {
+			const int *e = l->cmds[l->order[i]].area;
+			bm_dirty_add(dst, e[0], e[1], e[2] + 1, e[3] + 1);
+		}
+	}
+	l->target = NULL;
+	l->busy = 0;
+}
+
+void bm_cmdlist_clear(struct bm_cmdlist *l) {
+	l->n = 0;
+	l->norder = 0;
+	l->ndata = 0;
+	l->font = NULL;
+	if(l->nsrcs) {
+		memset(l->srcs, 0, l->asrcs * sizeof *l->srcs);
+		l->nsrcs = 0;
+	}
+}
+
+void bm_flush(struct bitmap *b) {
+	struct bm_cmdlist *l = bm_deferred_list(b);
+	if(!l || !l->n || l->busy)
+		return;
+	
+	/* This changes b, so lists that read it are drawn first */
+	l->busy = 1;
+	bm_sync(b);
+	
+	bm_replay(l, b);
+	bm_cmdlist_clear(l);
+}
+
+struct bm_cmdlist *bm_cmdlist_create(void) {
+	return calloc(1, sizeof(struct bm_cmdlist));
+}
+
+void bm_cmdlist_free(struct bm_cmdlist *l) {
+	if(!l)
+		return;
+	bm_cmdlist_end(l);
+	bm_cmdlist_release(l);
+}
+
+void bm_cmdlist_begin(struct bm_cmdlist *l, struct bitmap *b) {
+	bm_cmdlist_end(l);
+	l->owner = b;
+	l->saved = b->cmds;
+	b->cmds = l;
+}
+
+void bm_cmdlist_end(struct bm_cmdlist *l) {
+	struct bm_cmdlist **p;
+	if(!l->owner)
+		return;
+	for(p = &l->owner->cmds; *p != l; p = &(*p)->saved);
+	*p = l->saved;
+	l->owner = NULL;
+	l->saved = NULL;
+}
+
+void bm_cmdlist_replay(struct bm_cmdlist *l, struct bitmap *dst) {
+	int i;
+	if(!l->n || l->busy)
+		return;
+	if(bm_deferring) {
+		/* Draw the deferred commands of the bitmaps involved first */
+		for(i = 0; i < l->n; i++) {
+			if(l->cmds[i].src && l->cmds[i].op != BM_CMD_RLE_BLIT)
+				BM_READ((struct bitmap *)l->cmds[i].src);
+		}
+		BM_WRITE(dst);
+	}
+	bm_replay(l, dst);
+}
+
+int bm_cmdlist_count(struct bm_cmdlist *l) {
+	return l->n;
+}
+
+void bm_cmdlist_dump(struct bm_cmdlist *l, FILE *f) {
+	static const char *names[] = {
+		"pixel", "putpixel", "clear", "line", "rect", "fillrect",
+		"circle", "fillcircle", "ellipse", "fillellipse", "roundrect",
+		"fillroundrect", "text", "blit", "maskedblit", "blit_alpha",
+		"blit_ex", "rle_blit", "rotozoom"
+	};
+	int i;
+	fprintf(f, "%d commands; %d drawn, %d culled and %d moved in the last replay%s\n",
+			l->n, l->norder, l->culled, l->moved, l->serial ? " (serial)" : "");
+	for(i = 0; i < l->n; i++) {
+		const struct bm_cmd *c = &l->cmds[i];
+		fprintf(f, "%4d %-13s %d,%d-%d,%d", i, names[c->op], c->box[0], c->box[1], c->box[2], c->box[3]);
+		if(c->src)
+			fprintf(f, " src %p", c->src);
+		fputc('\n', f);
+	}
+}
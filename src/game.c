@@ -22,6 +22,7 @@
 #include "log.h"
 #include "gamedb.h"
 #include "sound.h"
+#include "tileset.h"
 
 /* Some Defaults *************************************************/
 
@@ -62,6 +63,9 @@ filter = GL_NEAREST;
 
 static struct bitmap *bmp = NULL;
 
+/* Record the drawing during update and draw it in parallel bands in render() */
+static int parallel = 0;
+
 struct ini_file *game_ini = NULL;
 
 static Uint32 frameStart;
@@ -111,6 +115,14 @@ int init(const char *appTitle, int virt_width, int virt_height) {
 	
 	bmp = bm_create(virt_width, virt_height);
 	
+	/* Only the parts of the screen that changed are copied to 
+	 * the texture in render() */
+	bm_dirty_track(bmp, 1);
+	bm_dirty_add(bmp, 0, 0, bmp->w, bmp->h);
+	
+	if(parallel)
+		bm_defer(bmp, 1);
+	
 	tex = SDL_CreateTexture(ren, SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_STREAMING, bmp->w, bmp->h);
 	if(!tex) {
 		rerror("SDL_CreateTexture: %s", SDL_GetError());
@@ -160,8 +172,21 @@ int screen_to_virt_y(int in) {
 }
 
 void render() {
-	/* FIXME: Docs says SDL_UpdateTexture() be slow */
-	SDL_UpdateTexture(tex, NULL, bmp->data, bmp->w*4);
+	bm_flush(bmp);
+	/* FIXME: Docs says SDL_UpdateTexture() be slow, 
+	 * but at least it only gets the dirty rectangles now */
+	int i, n = bm_dirty_count(bmp);
+	for(i = 0; i < n; i++) {
+		int x0, y0, x1, y1;
+		SDL_Rect r;
+		bm_dirty_get(bmp, i, &x0, &y0, &x1, &y1);
+		r.x = x0;
+		r.y = y0;
+		r.w = x1 - x0;
+		r.h = y1 - y0;
+		SDL_UpdateTexture(tex, &r, bmp->data + y0 * bmp->stride + x0 * 4, bmp->stride);
+	}
+	bm_dirty_reset(bmp);
 	SDL_RenderClear(ren);
 	SDL_RenderCopy(ren, tex, NULL, NULL);
 	SDL_RenderPresent(ren);
@@ -222,6 +247,9 @@ void advanceFrame() {
 				break;
 			default: break;
 			}
+		} else if(event.type == SDL_RENDER_TARGETS_RESET || event.type == SDL_RENDER_DEVICE_RESET) {
+			/* The texture's contents may be lost: Upload all of it again */
+			bm_dirty_add(bmp, 0, 0, bmp->w, bmp->h);
 		}
 	}
 }
@@ -359,6 +387,17 @@ int main(int argc, char *argv[]) {
 				
 			virt_width = atoi(ini_get(game_ini, "virtual", "width", PARAM(VIRT_WIDTH)));
 			virt_height = atoi(ini_get(game_ini, "virtual", "height", PARAM(VIRT_HEIGHT)));
+			parallel = atoi(ini_get(game_ini, "virtual", "parallel", "0"));
+			
+			/* Pack the Lua scripts' small bitmaps into atlas pages */
+			re_atlas_setup(atoi(ini_get(game_ini, "resources", "atlas", "0")), 
+				atoi(ini_get(game_ini, "resources", "atlasPage", "512")));
+			
+			/* Bake the mask colours of tilesets and sprites into alpha */
+			re_mask_setup(atoi(ini_get(game_ini, "resources", "maskAlpha", "0")));
+			
+			/* Keep tilesets of up to 256 colours indexed, for palette effects */
+			ts_index_setup(atoi(ini_get(game_ini, "resources", "indexedTiles", "0")));
 			
 			startstate = ini_get(game_ini, "init", "startstate", NULL);
 			if(startstate) {
@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -74,6 +75,11 @@ struct lustate_data {
 	struct callback_function *update_fcn, *last_fcn;	
 	struct callback_function *atexit_fcn;
 	
+	/* The CmdListObj that G.record() is recording into, and the
+	 * registry reference that keeps it from being collected */
+	struct bm_cmdlist *recording;
+	int recording_ref;
+	
 	int change_state;
 	char *next_state;
 };
@@ -319,6 +325,18 @@ static const luaL_Reg game_funcs[] = {
  *# Instances of BmpObj are drawn to the screen with the [[G.blit()|Lua-state#gblitbmp-dx-dy-sx-sy-w-h]] function
  */
 
+/* The userdata behind a BmpObj */
+struct bmp_obj {
+	/* Small bitmaps share an atlas page with other sprites,
+	 * so the mask colour is kept in the sprite */
+	struct bm_sprite *spr;
+	
+	/* Compiled version of the sprite for G.blit(), created when it
+	 * is first needed. mask is the colour it was compiled with. */
+	struct bm_rle *rle;
+	unsigned int mask;
+};
+
 /*@ Bmp(filename)
  *# Loads the bitmap file specified by {{filename}} from the
  *# [[Resources|Resource Management]] and returns it
@@ -327,11 +345,13 @@ static const luaL_Reg game_funcs[] = {
 static int new_bmp_obj(lua_State *L) {
 	const char *filename = luaL_checkstring(L,1);
 	
-	struct bitmap **bp = lua_newuserdata(L, sizeof *bp);	
+	struct bmp_obj *bo = lua_newuserdata(L, sizeof *bo);	
 	luaL_setmetatable(L, "BmpObj");
 	
-	*bp = re_get_bmp(filename);
-	if(!*bp) {
+	bo->rle = NULL;
+	bo->mask = 0;
+	bo->spr = re_get_sprite(filename);
+	if(!bo->spr) {
 		luaL_error(L, "Unable to load bitmap '%s'", filename);
 	}
 	return 1;
@@ -341,9 +361,8 @@ static int new_bmp_obj(lua_State *L) {
  *# Returns a string representation of the `BmpObj` instance.
  */
 static int bmp_tostring(lua_State *L) {	
-	struct bitmap **bp = luaL_checkudata(L,1, "BmpObj");
-	struct bitmap *b = *bp;
-	lua_pushfstring(L, "BmpObj[%dx%d]", b->w, b->h);
+	struct bmp_obj *bo = luaL_checkudata(L,1, "BmpObj");
+	lua_pushfstring(L, "BmpObj[%dx%d]", bo->spr->w, bo->spr->h);
 	return 1;
 }
 
@@ -351,17 +370,31 @@ static int bmp_tostring(lua_State *L) {
  *# Garbage collects the `BmpObj` instance.
  */
 static int gc_bmp_obj(lua_State *L) {
-	/* No need to free the bitmap: It's in the resource cache. */
+	/* No need to free the bitmap: It's in the resource cache. 
+		The compiled version belongs to the BmpObj though. */
+	struct bmp_obj *bo = luaL_checkudata(L,1, "BmpObj");
+	bm_rle_free(bo->rle);
+	bo->rle = NULL;
 	return 0;
 }
 
 /*@ BmpObj:setMask(color)
  *# Sets the color used as a mask when the bitmap is drawn to the screen.
+ *# Pixels of that color are then also skipped by {{G.blit()}}'s {{"alpha"}} mode.\n
+ *# If {{maskAlpha}} is set in the {{[resources]}} section of the game's
+ *# ini file, the mask is baked into the bitmap's alpha channel instead, 
+ *# so the pixels of that color become transparent for good.
  */
 static int bmp_set_mask(lua_State *L) {	
-	struct bitmap **bp = luaL_checkudata(L,1, "BmpObj");
+	struct bmp_obj *bo = luaL_checkudata(L,1, "BmpObj");
+	struct bm_sprite *s = bo->spr;
 	const char *mask = luaL_checkstring(L, 2);
-	bm_set_color_s(*bp, mask);
+	bm_set_color_s(s->bmp, mask);
+	/* A sprite on a shared atlas page keeps its mask colour */
+	if(!s->x && !s->y && s->w == s->bmp->w && s->h == s->bmp->h)
+		re_mask_alpha(s->bmp);
+	s->color = s->bmp->color;
+	s->flags |= BM_BLEND_KEY;
 	return 0;
 }
 
@@ -369,8 +402,8 @@ static int bmp_set_mask(lua_State *L) {
  *# Returns the width of the bitmap
  */
 static int bmp_width(lua_State *L) {	
-	struct bitmap **bp = luaL_checkudata(L,1, "BmpObj");
-	lua_pushinteger(L, (*bp)->w);
+	struct bmp_obj *bo = luaL_checkudata(L,1, "BmpObj");
+	lua_pushinteger(L, bo->spr->w);
 	return 1;
 }
 
@@ -378,11 +411,32 @@ static int bmp_width(lua_State *L) {
  *# Returns the height of the bitmap
  */
 static int bmp_height(lua_State *L) {	
-	struct bitmap **bp = luaL_checkudata(L,1, "BmpObj");
-	lua_pushinteger(L, (*bp)->h);
+	struct bmp_obj *bo = luaL_checkudata(L,1, "BmpObj");
+	lua_pushinteger(L, bo->spr->h);
 	return 1;
 }
 
+/* Returns the bitmap the BmpObj's sprite is on, with the 
+ * sprite's mask colour and flags, for the blit functions */
+static struct bitmap *bmp_obj_bitmap(struct bmp_obj *bo) {
+	struct bitmap *b = bo->spr->bmp;
+	b->color = bo->spr->color;
+	b->flags = (b->flags & ~BM_BLEND_KEY) | (bo->spr->flags & BM_BLEND_KEY);
+	return b;
+}
+
+/* Returns the compiled version of the BmpObj's sprite, 
+ * (re)compiling it if the mask colour changed. */
+static struct bm_rle *bmp_obj_rle(struct bmp_obj *bo) {
+	struct bm_sprite *s = bo->spr;
+	if(bo->rle && bo->mask == s->color)
+		return bo->rle;
+	bm_rle_free(bo->rle);
+	bo->rle = bm_rle_create(bmp_obj_bitmap(bo), s->x, s->y, s->w, s->h);
+	bo->mask = s->color;
+	return bo->rle;
+}
+
 static void bmp_obj_meta(lua_State *L) {
 	/* Create the metatable for MyObj */
 	luaL_newmetatable(L, "BmpObj");
@@ -407,6 +461,123 @@ static void bmp_obj_meta(lua_State *L) {
 	lua_setglobal(L, "Bmp");
 }
 
+/*1 CmdListObj
+ *# A list of drawing commands, recorded with [[G.record()|Lua-state#grecordlist]]
+ *# and drawn to the screen as often as needed with {{CmdListObj:replay()}}.
+ *# It is useful for parts of the screen that rarely change, like a HUD.\n
+ *# Before a list is drawn, commands that later commands hide completely
+ *# are skipped, and blits from the same {{BmpObj}} are drawn together.
+ */
+
+/*@ CmdList()
+ *# Creates a new, empty `CmdListObj` instance.
+ */
+static int new_cmdlist_obj(lua_State *L) {
+	struct bm_cmdlist **lo = lua_newuserdata(L, sizeof *lo);
+	luaL_setmetatable(L, "CmdListObj");
+	*lo = bm_cmdlist_create();
+	if(!*lo) {
+		luaL_error(L, "Unable to create command list");
+	}
+	return 1;
+}
+
+/*@ CmdListObj:__tostring()
+ *# Returns a string representation of the `CmdListObj` instance.
+ */
+static int cmdlist_tostring(lua_State *L) {
+	struct bm_cmdlist **lo = luaL_checkudata(L,1, "CmdListObj");
+	lua_pushfstring(L, "CmdListObj[%d]", bm_cmdlist_count(*lo));
+	return 1;
+}
+
+/*@ CmdListObj:__gc()
+ *# Garbage collects the `CmdListObj` instance.
+ */
+static int gc_cmdlist_obj(lua_State *L) {
+	/* G.record() holds a reference, so it can't be recording */
+	struct bm_cmdlist **lo = luaL_checkudata(L,1, "CmdListObj");
+	bm_cmdlist_free(*lo);
+	*lo = NULL;
+	return 0;
+}
+
+/*@ CmdListObj:replay()
+ *# Draws the commands in the list on the screen. The list is kept,
+ *# so it can be drawn again in the next frame.
+ */
+static int cmdlist_replay(lua_State *L) {
+	struct lustate_data *sd = get_state_data(L);
+	struct bm_cmdlist **lo = luaL_checkudata(L,1, "CmdListObj");
+	if(!sd->bmp)
+		luaL_error(L, "Call to graphics function outside of a screen update");
+	bm_cmdlist_replay(*lo, sd->bmp);
+	return 0;
+}
+
+/*@ CmdListObj:clear()
+ *# Removes all the commands from the list.
+ */
+static int cmdlist_clear(lua_State *L) {
+	struct bm_cmdlist **lo = luaL_checkudata(L,1, "CmdListObj");
+	bm_cmdlist_clear(*lo);
+	return 0;
+}
+
+/*@ CmdListObj:count()
+ *# Returns the number of commands in the list.
+ */
+static int cmdlist_count(lua_State *L) {
+	struct bm_cmdlist **lo = luaL_checkudata(L,1, "CmdListObj");
+	lua_pushinteger(L, bm_cmdlist_count(*lo));
+	return 1;
+}
+
+/*@ CmdListObj:dump()
+ *# Writes the commands in the list to the log, with how many of them
+ *# the last {{CmdListObj:replay()}} drew and skipped.
+ */
+static int cmdlist_dump(lua_State *L) {
+	struct bm_cmdlist **lo = luaL_checkudata(L,1, "CmdListObj");
+	bm_cmdlist_dump(*lo, log_file);
+	fflush(log_file);
+	return 0;
+}
+
+static void cmdlist_obj_meta(lua_State *L) {
+	luaL_newmetatable(L, "CmdListObj");
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index"); /* CmdListObj.__index = CmdListObj */
+	
+	/* Add methods */
+	lua_pushcfunction(L, cmdlist_replay);
+	lua_setfield(L, -2, "replay");
+	lua_pushcfunction(L, cmdlist_clear);
+	lua_setfield(L, -2, "clear");
+	lua_pushcfunction(L, cmdlist_count);
+	lua_setfield(L, -2, "count");
+	lua_pushcfunction(L, cmdlist_dump);
+	lua_setfield(L, -2, "dump");
+	
+	lua_pushcfunction(L, cmdlist_tostring);
+	lua_setfield(L, -2, "__tostring");	
+	lua_pushcfunction(L, gc_cmdlist_obj);
+	lua_setfield(L, -2, "__gc");	
+	
+	/* The global method CmdList() */
+	lua_pushcfunction(L, new_cmdlist_obj);
+	lua_setglobal(L, "CmdList");
+}
+
+/* Stops G.record() */
+static void stop_recording(lua_State *L, struct lustate_data *sd) {
+	if(!sd->recording)
+		return;
+	bm_cmdlist_end(sd->recording);
+	luaL_unref(L, LUA_REGISTRYINDEX, sd->recording_ref);
+	sd->recording = NULL;
+}
+
 /*1 Map
  *# The Map object provides access to the Map through
  *# a variety of functions.
@@ -485,9 +656,76 @@ static int get_cell_obj(lua_State *L) {
 	return 1;
 }
 
+/*@ Map.cycle(first, last, [steps, tileset])
+ *# Rotates entries {{first}} to {{last}} of the palettes of the
+ *# indexed tilesets by {{steps}} places (default 1), for colour
+ *# cycling effects like running water.\n
+ *# Tilesets are only indexed when {{indexedTiles=1}} is set in the
+ *# {{[resources]}} section of {{game.ini}} and they have at most 256
+ *# colours. Palette entries are numbered from 0 in the order the
+ *# colours first appear in the tileset, row by row, so a strip of
+ *# the cycled colours at the top of the tileset gives them
+ *# consecutive entries.\n
+ *# If {{tileset}} is given, only that tileset is cycled.
+ */
+static int cycle_map(lua_State *L) {
+	int first = luaL_checkint(L,1);
+	int last = luaL_checkint(L,2);
+	int steps = luaL_optint(L,3,1);
+	const char *name = luaL_optstring(L,4,NULL);
+	struct lustate_data *sd = get_state_data(L);
+	int i;
+
+	if(!sd->map) {
+		luaL_error(L, "Attempt to cycle non-existent Map");
+	}
+	if(first < 0 || first > 255 || last < 0 || last > 255) {
+		luaL_error(L, "Invalid palette range %d-%d in Map.cycle()", first, last);
+	}
+
+	for(i = 0; i < ts_get_num(&sd->map->tiles); i++) {
+		struct tileset *t = ts_get(&sd->map->tiles, i);
+		if(!t->ibm || (name && strcmp(t->name, name)))
+			continue;
+		bm_indexed_cycle(t->ibm, first, last, steps);
+	}
+	return 0;
+}
+
+/*@ Map.fade(color, amount, [tileset])
+ *# Fades the palettes of the indexed tilesets towards {{color}}.
+ *# {{amount}} goes from 0 for the tileset's own colours to 255
+ *# for {{color}} everywhere.\n
+ *# The fade starts from the palette as it was loaded, so it
+ *# undoes any {{Map.cycle()}}.
+ *# See {{Map.cycle()}} for which tilesets are indexed.\n
+ *# If {{tileset}} is given, only that tileset is faded.
+ */
+static int fade_map(lua_State *L) {
+	const char *color = luaL_checkstring(L,1);
+	int amount = luaL_checkint(L,2);
+	const char *name = luaL_optstring(L,3,NULL);
+	struct lustate_data *sd = get_state_data(L);
+	int c = bm_color_atoi(color), i;
+
+	if(!sd->map) {
+		luaL_error(L, "Attempt to fade non-existent Map");
+	}
+
+	for(i = 0; i < ts_get_num(&sd->map->tiles); i++) {
+		struct tileset *t = ts_get(&sd->map->tiles, i);
+		if(!t->ibm || (name && strcmp(t->name, name)))
+			continue;
+		bm_indexed_fade(t->ibm, t->palette, (c >> 16) & 0xFF, (c >> 8) & 0xFF, c & 0xFF, amount);
+	}
+	return 0;
+}
+
 static const luaL_Reg map_funcs[] = {
   {"render",      	render_map},
   {"cell",      	get_cell_obj},
+  {"cycle",      	cycle_map},
+  {"fade",      	fade_map},
   {0, 0}
 };
 
@@ -666,6 +904,27 @@ static int gr_setcolor(lua_State *L) {
 	return 0;
 }
 
+/*@ G.setAlpha(alpha)
+ *# Sets the alpha (opacity) used to draw the graphics primitives,
+ *# from 0 (transparent) to 255 (opaque).\n
+ *# {{G.fillRect()}} and {{G.print()}} blend with the screen if 
+ *# {{alpha}} is less than 255. It is also the opacity of
+ *# {{G.blit()}} in {{"alpha"}} mode.\n
+ *# If {{alpha}} is omitted, it is reset to 255.
+ *# It is also reset to 255 at the start of every frame.
+ */
+static int gr_setalpha(lua_State *L) {
+	struct lustate_data *sd = get_state_data(L);
+	if(!sd->bmp)
+		luaL_error(L, "Call to graphics function outside of a screen update");	
+	if(lua_gettop(L) > 0) {
+		bm_set_alpha(sd->bmp, luaL_checkinteger(L,1));
+	} else {
+		bm_set_alpha(sd->bmp, 255);
+	}
+	return 0;
+}
+
 /*@ G.clip(x0,y0, x1,y1)
  *# Sets the clipping rectangle when drawing primitives.
  */
@@ -793,6 +1052,21 @@ static int gr_ellipse(lua_State *L) {
 	return 0;
 }
 
+/*@ G.fillEllipse(x0, y0, x1, y1)
+ *# Draws a filled ellipse from {{x0,y0}} to {{x1,y1}}
+ */
+static int gr_fillellipse(lua_State *L) {
+	struct lustate_data *sd = get_state_data(L);
+	if(!sd->bmp)
+		luaL_error(L, "Call to graphics function outside of a screen update");
+	int x0 = luaL_checkint(L,1);
+	int y0 = luaL_checkint(L,2);
+	int x1 = luaL_checkint(L,3);
+	int y1 = luaL_checkint(L,4);
+	bm_fillellipse(sd->bmp, x0, y0, x1, y1);
+	return 0;
+}
+
 /*@ G.roundRect(x0, y0, x1, y1, r)
  *# Draws a rectangle from {{x0,y0}} to {{x1,y1}}
  *# with rounded corners of radius {{r}}
@@ -917,40 +1191,272 @@ static int gr_textdims(lua_State *L) {
 	return 2;
 }
 
-/*@ G.blit(bmp, dx, dy, [sx], [sy], [w], [h])
+/* Reads the field {{name}} of the options table at index t into *v.
+ * Returns 0 if the field is not set */
+static int opt_number(lua_State *L, int t, const char *name, lua_Number *v) {
+	int found;
+	lua_getfield(L, t, name);
+	found = !lua_isnil(L, -1);
+	if(found) {
+		if(!lua_isnumber(L, -1))
+			return luaL_error(L, "Option '%s' should be a number", name);
+		*v = lua_tonumber(L, -1);
+	}
+	lua_pop(L, 1);
+	return found;
+}
+
+static const char *opt_string(lua_State *L, int t, const char *name, const char *def) {
+	const char *v = def;
+	lua_getfield(L, t, name);
+	if(!lua_isnil(L, -1)) {
+		if(!lua_isstring(L, -1))
+			luaL_error(L, "Option '%s' should be a string", name);
+		/* The string stays in the options table */
+		v = lua_tostring(L, -1);
+	}
+	lua_pop(L, 1);
+	return v;
+}
+
+/* Returns flag if the field {{name}} of the options table at index t is true */
+static int opt_flag(lua_State *L, int t, const char *name, int flag) {
+	int set;
+	lua_getfield(L, t, name);
+	set = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	return set ? flag : 0;
+}
+
+/* The bm_blit_ex() flags for the modes of G.blitScaled() */
+static int blit_flags(lua_State *L, const char *mode) {
+	if(!strcmp(mode, "mask"))
+		return BM_BLIT_MASK;
+	else if(!strcmp(mode, "copy"))
+		return 0;
+	else if(!strcmp(mode, "smooth"))
+		return BM_BLIT_MASK | BM_BLIT_BILINEAR;
+	return luaL_error(L, "Invalid blit mode '%s'", mode);
+}
+
+/*@ G.blit(bmp, dx, dy, [sx], [sy], [w], [h], [mode])
  *# Draws an instance {{bmp}} of {{BmpObj}} to the screen at {{dx, dy}}.
  *# {{sx,sy}} specify the source x,y position and {{w,h}} specifies the
  *# width and height of the source to draw.
  *# {{sx,sy}} defaults to {{0,0}} and {{w,h}} defaults to the entire 
- *# source bitmap.
+ *# source bitmap. Any of them can be {{nil}} to use the default.\n
+ *# {{mode}} is the blend mode:
+ *{
+ ** {{"mask"}} - (default) Pixels matching the bitmap's mask colour are not drawn.
+ ** {{"alpha"}} - The bitmap is blended with the screen using its alpha channel and the opacity set with {{G.setAlpha()}}. Pixels of the mask colour are only skipped if it was set with {{BmpObj:setMask()}}.
+ *}
+ *# Instead of {{sx}}, the fourth parameter can be a table of options with
+ *# the fields {{sx}}, {{sy}}, {{w}}, {{h}} and {{mode}}, and:
+ *{
+ ** {{angle}} - Rotates the bitmap clockwise by this many degrees.
+ ** {{scale}} - Scales the bitmap by this factor.
+ ** {{flipH}} - If {{true}}, mirrors the bitmap horizontally, so a sprite faces the other way.
+ ** {{flipV}} - If {{true}}, mirrors the bitmap vertically.
+ *}
+ *# A rotated or scaled bitmap turns around its centre, which stays where
+ *# it would be otherwise. A flipped bitmap is mirrored in place.
+ *# The {{mode}} can then be any of those of {{G.blitScaled()}}, but 
+ *# not {{"alpha"}}.
+ *X G.setAlpha(128); G.blit(shadow, x, y, nil, nil, nil, nil, "alpha");
+ *X G.blit(coin, x, y, {angle = t * 90, scale = 1.5, mode = "smooth"})
+ *X G.blit(hero, x, y, {flipH = facing == "left"})
  */
 static int gr_blit(lua_State *L) {
 	struct lustate_data *sd = get_state_data(L);
 	if(!sd->bmp)
 		luaL_error(L, "Call to graphics function outside of a screen update");
-	struct bitmap **bp = luaL_checkudata(L, 1, "BmpObj");
+	struct bmp_obj *bo = luaL_checkudata(L, 1, "BmpObj");
+	struct bm_rle *rle;
 	
 	int dx = luaL_checkinteger(L, 2);
 	int dy = luaL_checkinteger(L, 3);
 	
-	int sx = 0, sy = 0, w = (*bp)->w, h = (*bp)->h;
+	int sx = 0, sy = 0, w = bo->spr->w, h = bo->spr->h;
+	
+	const char *mode = "mask";
+	lua_Number v, angle = 0, scale = 1;
+	int rotozoom = 0, flip = 0;
+	
+	if(lua_istable(L, 4)) {
+		if(opt_number(L, 4, "sx", &v))
+			sx = (int)v;
+		if(opt_number(L, 4, "sy", &v))
+			sy = (int)v;
+		if(opt_number(L, 4, "w", &v))
+			w = (int)v;
+		if(opt_number(L, 4, "h", &v))
+			h = (int)v;
+		mode = opt_string(L, 4, "mode", mode);
+		rotozoom = opt_number(L, 4, "angle", &angle);
+		rotozoom |= opt_number(L, 4, "scale", &scale);
+		flip = opt_flag(L, 4, "flipH", BM_BLIT_FLIP_H) | opt_flag(L, 4, "flipV", BM_BLIT_FLIP_V);
+	} else {
+		if(lua_gettop(L) >= 4 && !lua_isnil(L, 4))
+			sx = luaL_checkinteger(L, 4);
+		if(lua_gettop(L) >= 5 && !lua_isnil(L, 5))
+			sy = luaL_checkinteger(L, 5);
+		if(lua_gettop(L) >= 6 && !lua_isnil(L, 6))
+			w = luaL_checkinteger(L, 6);
+		if(lua_gettop(L) >= 7 && !lua_isnil(L, 7))
+			h = luaL_checkinteger(L, 7);
+		if(lua_gettop(L) >= 8)
+			mode = luaL_checkstring(L, 8);
+	}
 	
-	if(lua_gettop(L) >= 4)
-		sx = luaL_checkinteger(L, 4);
-	if(lua_gettop(L) >= 5)
-		sy = luaL_checkinteger(L, 5);
-	if(lua_gettop(L) >= 6)
-		w = luaL_checkinteger(L, 6);
-	if(lua_gettop(L) >= 7)
-		h = luaL_checkinteger(L, 7);
+	if(rotozoom) {
+		/* Clip to the sprite, so that its neighbours aren't sampled, then move
+		 * the centre of the area that is left to where the rotation and scaling
+		 * around the centre of the area that was asked for puts it. Unrotated
+		 * and unscaled areas are blitted like bm_blit(), which centres odd
+		 * sizes half a pixel differently */
+		double r = fmod(angle, 360.0) * 3.14159265358979323846 / 180.0, fx, fy;
+		double k = r == 0 && scale == 1 ? 0.5 : 0;
+		int ox = dx + (w + 1) / 2, oy = dy + (h + 1) / 2, ow = w, oh = h;
+		int cx = sx * 2 + w, cy = sy * 2 + h;
+		int flags = blit_flags(L, mode) | flip;
+		/* Nothing is drawn otherwise */
+		if(isnan(r) || !(scale >= 1.0 / 256))
+			return 0;
+		if(bm_sprite_clip(bo->spr, &dx, &dy, &sx, &sy, &w, &h)) {
+			fx = ((sx - bo->spr->x) * 2 + w - cx) / 2.0;
+			fy = ((sy - bo->spr->y) * 2 + h - cy) / 2.0;
+			if(flip & BM_BLIT_FLIP_H)
+				fx = -fx;
+			if(flip & BM_BLIT_FLIP_V)
+				fy = -fy;
+			cx = (int)floor(ox + (fx * cos(r) - fy * sin(r)) * scale + k * ((w & 1) - (ow & 1)) + 0.5);
+			cy = (int)floor(oy + (fx * sin(r) + fy * cos(r)) * scale + k * ((h & 1) - (oh & 1)) + 0.5);
+			bm_blit_rotozoom(sd->bmp, cx, cy, bmp_obj_bitmap(bo), sx, sy, w, h, angle, scale, flags);
+		}
+		return 0;
+	} else if(flip) {
+		/* Clip to the sprite, then mirror the area that is left 
+		 * within the area that was asked for */
+		int x = dx, y = dy, r = dx + w, b = dy + h;
+		int flags = blit_flags(L, mode) | flip;
+		if(bm_sprite_clip(bo->spr, &dx, &dy, &sx, &sy, &w, &h)) {
+			if(flip & BM_BLIT_FLIP_H)
+				dx = x + r - dx - w;
+			if(flip & BM_BLIT_FLIP_V)
+				dy = y + b - dy - h;
+			bm_blit_ex(sd->bmp, dx, dy, w, h, bmp_obj_bitmap(bo), sx, sy, w, h, flags);
+		}
+		return 0;
+	}
 	
-	bm_maskedblit(sd->bmp, dx, dy, *bp, sx, sy, w, h);
+	if(!strcmp(mode, "alpha")) {
+		if(bm_sprite_clip(bo->spr, &dx, &dy, &sx, &sy, &w, &h))
+			bm_blit_alpha(sd->bmp, dx, dy, bmp_obj_bitmap(bo), sx, sy, w, h, bm_get_alpha(sd->bmp));
+		return 0;
+	} else if(strcmp(mode, "mask")) {
+		luaL_error(L, "Invalid blend mode '%s'", mode);
+	}
+	
+	/* A CmdListObj can outlive the compiled version, not the bitmap */
+	rle = sd->recording ? NULL : bmp_obj_rle(bo);
+	if(rle)
+		bm_rle_blit(sd->bmp, dx, dy, rle, sx, sy, w, h);
+	else if(bm_sprite_clip(bo->spr, &dx, &dy, &sx, &sy, &w, &h))
+		bm_maskedblit(sd->bmp, dx, dy, bmp_obj_bitmap(bo), sx, sy, w, h);
 	
 	return 0;
 }
 
+/* Clips the source span of sl pixels at s to the sprite's size n, and
+ * scales the destination span of dl pixels at d along with it */
+static int clip_scaled(int *d, int *dl, int *s, int *sl, int n) {
+	int a = *s < 0 ? 0 : *s, b = *s + *sl > n ? n : *s + *sl, e;
+	if(*sl <= 0 || b <= a)
+		return 0;
+	e = *d + (int)((long long)(b - *s) * *dl / *sl);
+	*d += (int)((long long)(a - *s) * *dl / *sl);
+	*dl = e - *d;
+	*s = a;
+	*sl = b - a;
+	return *dl > 0;
+}
+
+/*@ G.blitScaled(bmp, dx, dy, dw, dh, [sx], [sy], [sw], [sh], [mode])
+ *# Draws an instance {{bmp}} of {{BmpObj}} to the screen at {{dx, dy}},
+ *# scaled to {{dw}} by {{dh}} pixels, for zooming sprites.\n
+ *# {{sx,sy}} specify the source x,y position and {{sw,sh}} specifies the
+ *# width and height of the source to draw.
+ *# {{sx,sy}} defaults to {{0,0}} and {{sw,sh}} defaults to the entire 
+ *# source bitmap. Any of them can be {{nil}} to use the default.\n
+ *# {{mode}} is one of:
+ *{
+ ** {{"mask"}} - (default) Pixels matching the bitmap's mask colour are not drawn.
+ ** {{"copy"}} - All pixels are drawn.
+ ** {{"smooth"}} - Like {{"mask"}}, but the image is smoothed with a bilinear filter.
+ *}
+ */
+static int gr_blit_scaled(lua_State *L) {
+	struct lustate_data *sd = get_state_data(L);
+	if(!sd->bmp)
+		luaL_error(L, "Call to graphics function outside of a screen update");
+	struct bmp_obj *bo = luaL_checkudata(L, 1, "BmpObj");
+	
+	int dx = luaL_checkinteger(L, 2);
+	int dy = luaL_checkinteger(L, 3);
+	int dw = luaL_checkinteger(L, 4);
+	int dh = luaL_checkinteger(L, 5);
+	
+	int sx = 0, sy = 0, sw = bo->spr->w, sh = bo->spr->h;
+	const char *mode = "mask";
+	
+	if(lua_gettop(L) >= 6 && !lua_isnil(L, 6))
+		sx = luaL_checkinteger(L, 6);
+	if(lua_gettop(L) >= 7 && !lua_isnil(L, 7))
+		sy = luaL_checkinteger(L, 7);
+	if(lua_gettop(L) >= 8 && !lua_isnil(L, 8))
+		sw = luaL_checkinteger(L, 8);
+	if(lua_gettop(L) >= 9 && !lua_isnil(L, 9))
+		sh = luaL_checkinteger(L, 9);
+	if(lua_gettop(L) >= 10)
+		mode = luaL_checkstring(L, 10);
+	
+	/* The sprite's border keeps the filter from reading its neighbours,
+	 * as long as the area is clipped to the sprite */
+	if(clip_scaled(&dx, &dw, &sx, &sw, bo->spr->w) && clip_scaled(&dy, &dh, &sy, &sh, bo->spr->h))
+		bm_blit_ex(sd->bmp, dx, dy, dw, dh, bmp_obj_bitmap(bo), bo->spr->x + sx, bo->spr->y + sy, sw, sh, blit_flags(L, mode));
+	
+	return 0;
+}
+
+/*@ G.record([list])
+ *# Records the graphics functions called after it into the 
+ *# {{CmdListObj}} {{list}}, instead of drawing them on the screen,
+ *# until {{G.record()}} is called without a {{list}} or the
+ *# screen update ends. The commands are added to those already in 
+ *# the list; Call {{list:clear()}} first to start afresh.
+ *X hud = CmdList()
+ *X G.record(hud); G.print(0, 0, "Score"); G.record()
+ *X hud:replay()
+ */
+static int gr_record(lua_State *L) {
+	struct lustate_data *sd = get_state_data(L);
+	struct bm_cmdlist **lo;
+	if(!sd->bmp)
+		luaL_error(L, "Call to graphics function outside of a screen update");
+	stop_recording(L, sd);
+	if(lua_gettop(L) > 0 && !lua_isnil(L, 1)) {
+		lo = luaL_checkudata(L, 1, "CmdListObj");
+		bm_cmdlist_begin(*lo, sd->bmp);
+		lua_pushvalue(L, 1);
+		sd->recording_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		sd->recording = *lo;
+	}
+	return 0;
+}
+
 static const luaL_Reg graphics_funcs[] = {
   {"setColor",      gr_setcolor},
+  {"setAlpha",      gr_setalpha},
   {"clip", 			gr_clip},
   {"unclip", 		gr_unclip},
   {"pixel",         gr_putpixel},
@@ -960,6 +1466,7 @@ static const luaL_Reg graphics_funcs[] = {
   {"circle",        gr_circle},
   {"fillCircle",    gr_fillcircle},
   {"ellipse",    	gr_ellipse},
+  {"fillEllipse",	gr_fillellipse},
   {"roundRect",    	gr_roundrect},
   {"fillRoundRect", gr_fillroundrect},
   {"curve",         gr_bezier3},
@@ -968,6 +1475,8 @@ static const luaL_Reg graphics_funcs[] = {
   {"setFont",       gr_setfont},
   {"textDims",      gr_textdims},
   {"blit",          gr_blit},
+  {"blitScaled",    gr_blit_scaled},
+  {"record",        gr_record},
   {0, 0}
 };
 
@@ -1546,6 +2055,7 @@ static int lus_init(struct game_state *s) {
 	sd->n_timeout = 0;
 	sd->map = NULL;
 	sd->bmp = NULL;
+	sd->recording = NULL;
 		
 	sd->change_state = 0;
 	sd->next_state = NULL;
@@ -1624,6 +2134,9 @@ static int lus_init(struct game_state *s) {
 		a bitmap through the resources module that can be drawn with G.blit() */
 	bmp_obj_meta(L);
 	
+	/* CmdList() creates lists of drawing commands for G.record() */
+	cmdlist_obj_meta(L);
+	
 	wav_obj_meta(L);
 	
 	mus_obj_meta(L);
@@ -1684,6 +2197,9 @@ static int lus_update(struct game_state *s, struct bitmap *bmp) {
 	SET_TABLE_INT_VAL("SCREEN_WIDTH", bmp->w);
 	SET_TABLE_INT_VAL("SCREEN_HEIGHT", bmp->h);
 	
+	/* G.setAlpha() only lasts until the end of the frame */
+	bm_set_alpha(bmp, 255);
+	
 	/* TODO: Maybe background colour metadata in the map file? */
 	bm_set_color_s(bmp, "black");
 	bm_clear(bmp);
@@ -1705,7 +2221,13 @@ static int lus_update(struct game_state *s, struct bitmap *bmp) {
 		fn = fn->next;
 	}
 	
+	/* The next update starts by clearing the screen, which isn't 
+	 * meant to be recorded */
+	stop_recording(L, sd);
+	
 	if(sd->change_state) {
+		/* Don't leak the pen alpha into the next state */
+		bm_set_alpha(bmp, 255);
 		if(!sd->next_state) {
 			rwarn("Lua script didn't specify a next state; terminating...");
 			change_state(NULL);
@@ -109,7 +109,12 @@ void map_render(struct map *m, struct bitmap *bmp, int layer, int scroll_x, int
 				r = tile->ti / nht;
 				c = tile->ti % nht;
 				
-				bm_maskedblit(bmp, x, y, ts->bm, c * (m->tiles.tw + ts->border), r * (m->tiles.th + ts->border), m->tiles.tw, m->tiles.th);
+				if(ts->ibm)
+					bm_indexed_draw(bmp, x, y, ts->ibm, c * (m->tiles.tw + ts->border), r * (m->tiles.th + ts->border), m->tiles.tw, m->tiles.th);
+				else if(tile->ti < ts->ntiles)
+					bm_rle_blit(bmp, x, y, ts->tiles[tile->ti], 0, 0, m->tiles.tw, m->tiles.th);
+				else
+					bm_maskedblit(bmp, x, y, ts->bm, c * (m->tiles.tw + ts->border), r * (m->tiles.th + ts->border), m->tiles.tw, m->tiles.th);
 			}
 			x += m->tiles.tw;
 		}
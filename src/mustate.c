@@ -401,6 +401,7 @@ static struct mu_par mus_setmask(struct musl *m, int argc, struct mu_par argv[])
 		mu_throw(m, "Unable to load bitmap '%s'", filename);
 	}
 	bm_set_color_s(bmp, mask);
+	re_mask_alpha(bmp);
 		
 	return rv;
 }
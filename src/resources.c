@@ -16,6 +16,15 @@ static struct pak_file *game_pak = NULL;
 
 static const char *pak_file_name = "";
 
+/* Bitmaps loaded through re_get_sprite() that are at most atlas_max
+ * pixels wide and high are packed into atlas pages of atlas_page 
+ * pixels square. See re_atlas_setup() */
+static int atlas_max = 0, atlas_page = 512;
+
+/* Whether re_mask_alpha() bakes the mask colours into the 
+ * alpha channel. See re_mask_setup() */
+static int mask_alpha = 0;
+
 /* The cache forms a stack, so that it can be pushed 
 	and popped as the game states are pushed and popped. */
 struct resource_cache {
@@ -24,6 +33,11 @@ struct resource_cache {
 	struct hash_tbl *wav_cache;
 	struct hash_tbl *mus_cache;
 	
+	/* The sprites from re_get_sprite(), and the atlas with
+	the ones that were small enough to be packed */
+	struct hash_tbl *spr_cache;
+	struct bm_atlas *atlas;
+	
 	/* I expect as development continues, other 
 	things will be cached as well */
 	
@@ -35,6 +49,8 @@ static struct resource_cache *re_cache_create() {
 	rc->bmp_cache = ht_create(128);
 	rc->wav_cache = ht_create(128);
 	rc->mus_cache = ht_create(128);
+	rc->spr_cache = ht_create(128);
+	rc->atlas = NULL;
 	rc->parent = NULL;
 	return rc;
 }
@@ -57,7 +73,13 @@ static void mus_cache_cleanup(const char *key, void *vb) {
 	Mix_FreeMusic(music);
 }
 
+static void spr_cache_cleanup(const char *key, void *vs) {
+	free(vs);
+}
+
 static void re_cache_destroy(struct resource_cache *rc) {
+	ht_free(rc->spr_cache, spr_cache_cleanup);
+	bm_atlas_free(rc->atlas);
 	ht_free(rc->bmp_cache, bmp_cache_cleanup);
 	ht_free(rc->wav_cache, wav_cache_cleanup);
 	ht_free(rc->mus_cache, mus_cache_cleanup);
@@ -149,7 +171,7 @@ static SDL_RWops *re_get_RWops(const char *filename) {
  * defined in rengine/editor/resources.c which doesn't
  * use the resource cache.
  */
-struct bitmap *re_get_bmp(const char *filename) {
+static struct bitmap *re_find_bmp(const char *filename) {
 	struct bitmap *bmp;
 	
 	/* Search through the current resource cache and
@@ -162,8 +184,11 @@ struct bitmap *re_get_bmp(const char *filename) {
 		}
 		rc = rc->parent;
 	}
-	
-	/* Not cached. Load it. */
+	return NULL;
+}
+
+static struct bitmap *re_load_bmp(const char *filename) {
+	struct bitmap *bmp;
 	if(game_pak) {
 		FILE *f = pak_get_file(game_pak, filename);
 		if(!f) {
@@ -180,6 +205,18 @@ struct bitmap *re_get_bmp(const char *filename) {
 			rerror("Unable to load bitmap '%s'", filename);
 		}
 	}
+	return bmp;
+}
+
+struct bitmap *re_get_bmp(const char *filename) {
+	struct bitmap *bmp = re_find_bmp(filename);
+	if(bmp)
+		return bmp;
+	
+	/* Not cached. Load it. */
+	bmp = re_load_bmp(filename);
+	if(!bmp)
+		return NULL;
 	
 	/* Insert it to the cache on the top of the stack. */
 	ht_insert(re_cache->bmp_cache, filename, bmp);
@@ -188,6 +225,84 @@ struct bitmap *re_get_bmp(const char *filename) {
 	return bmp;
 }
 
+void re_atlas_setup(int max_size, int page_size) {
+	atlas_max = max_size;
+	if(page_size > 2)
+		atlas_page = page_size;
+}
+
+struct bm_sprite *re_get_sprite(const char *filename) {
+	struct bm_sprite *spr;
+	struct bitmap *bmp;
+	
+	struct resource_cache *rc = re_cache;	
+	while(rc) {
+		spr = ht_find(rc->spr_cache, filename);
+		if(spr) {
+			return spr;
+		}
+		rc = rc->parent;
+	}
+	
+	spr = malloc(sizeof *spr);
+	if(!spr)
+		return NULL;
+	
+	/* A bitmap that is already cached is shared with re_get_bmp() 
+		callers, so it isn't packed. */
+	bmp = re_find_bmp(filename);
+	if(!bmp) {
+		bmp = re_load_bmp(filename);
+		if(!bmp) {
+			free(spr);
+			return NULL;
+		}
+		if(bmp->w <= atlas_max && bmp->h <= atlas_max) {
+			if(!re_cache->atlas)
+				re_cache->atlas = bm_atlas_create(atlas_page, atlas_page);
+			if(re_cache->atlas && bm_atlas_add(re_cache->atlas, bmp, spr)) {
+				bm_free(bmp);
+				ht_insert(re_cache->spr_cache, filename, spr);
+				rlog("Packed bitmap '%s' in atlas page %p", filename, spr->bmp);
+				return spr;
+			}
+		}
+		ht_insert(re_cache->bmp_cache, filename, bmp);
+		rlog("Cached bitmap '%s'", filename);
+	}
+	
+	spr->bmp = bmp;
+	spr->x = 0;
+	spr->y = 0;
+	spr->w = bmp->w;
+	spr->h = bmp->h;
+	spr->color = bmp->color;
+	spr->flags = bmp->flags & BM_BLEND_KEY;
+	ht_insert(re_cache->spr_cache, filename, spr);
+	return spr;
+}
+
+void re_mask_setup(int alpha) {
+	mask_alpha = alpha;
+}
+
+void re_mask_alpha(struct bitmap *bmp) {
+	if(!mask_alpha)
+		return;
+	bm_mask_alpha(bmp);
+}
+
+void re_atlas_reset() {
+	struct resource_cache *rc = re_cache;
+	if(!rc || !rc->atlas)
+		return;
+	rlog("Freeing %d atlas pages", bm_atlas_pages(rc->atlas));
+	ht_free(rc->spr_cache, spr_cache_cleanup);
+	rc->spr_cache = ht_create(128);
+	bm_atlas_free(rc->atlas);
+	rc->atlas = NULL;
+}
+
 Mix_Chunk *re_get_wav(const char *filename) {
 	Mix_Chunk *chunk = NULL;
 	
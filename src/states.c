@@ -457,6 +457,9 @@ int change_state(struct game_state *next) {
 		}
 		
 		free(game_states[state_top]);
+		
+		/* Nothing refers to the old state's sprites anymore */
+		re_atlas_reset();
 	}	
 	game_states[state_top] = next;	
 	if(game_states[state_top]){		
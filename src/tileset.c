@@ -18,6 +18,9 @@ static struct tileset *ts_make(const char *filename);
 
 static void ts_free(struct tileset *t);
 
+/* See ts_index_setup() */
+static int ts_indexed = 0;
+
 void ts_init(struct tile_collection *tc, int tw, int th) {
 	tc->tilesets = NULL;
 	tc->ntilesets = 0;
@@ -105,6 +108,11 @@ static struct tileset *ts_make(const char *filename) {
 		t->nmeta = 0;
 		t->meta = NULL;
 		
+		t->ntiles = 0;
+		t->tiles = NULL;
+		
+		t->ibm = NULL;
+		
 		return t;
 	} else {
 		rerror("Unable to load tileset bitmap %s", filename);
@@ -112,9 +120,22 @@ static struct tileset *ts_make(const char *filename) {
 	return NULL;
 }
 
+static void ts_free_tiles(struct tileset *t) {
+	int i;
+	for(i = 0; i < t->ntiles; i++) {
+		bm_rle_free(t->tiles[i]);
+	}
+	free(t->tiles);
+	t->tiles = NULL;
+	t->ntiles = 0;
+}
+
 static void ts_free(struct tileset *t) {
 	if(!t) return;
 	free(t->name);
+	ts_free_tiles(t);
+	if(t->ibm)
+		bm_indexed_free(t->ibm);
 #ifdef EDITOR
 	/* In the game engine itself, the bitmap is freed
 	through the resource cache */
@@ -183,6 +204,55 @@ struct tile_meta *ts_get_meta(struct tile_collection *tc, struct tileset *t, int
 	}
 }
 
+void ts_index_setup(int indexed) {
+	ts_indexed = indexed;
+}
+
+int ts_index(struct tileset *t) {
+	struct bm_indexed *ibm = bm_indexed_from_bitmap(t->bm);
+	if(!ibm)
+		return 0;
+	if(t->ibm)
+		bm_indexed_free(t->ibm);
+	t->ibm = ibm;
+	memcpy(t->palette, ibm->palette, sizeof t->palette);
+	/* map_render() draws the indexed tiles instead */
+	ts_free_tiles(t);
+	return 1;
+}
+
+int ts_compile(struct tile_collection *tc, struct tileset *t) {
+	int r, c, nr, nc;
+	
+	ts_free_tiles(t);
+	
+	nc = t->bm->w / tc->tw;
+	nr = t->bm->h / tc->th;
+	if(nc <= 0 || nr <= 0)
+		return 0;
+	
+	t->tiles = calloc(nr * nc, sizeof *t->tiles);
+	if(!t->tiles) {
+		rerror("malloc failed while compiling tileset %s", t->name);
+		return 0;
+	}
+	t->ntiles = nr * nc;
+	
+	for(r = 0; r < nr; r++) {
+		for(c = 0; c < nc; c++) {
+			struct bm_rle *tile = bm_rle_create(t->bm, c * (tc->tw + t->border), 
+					r * (tc->th + t->border), tc->tw, tc->th);
+			if(!tile) {
+				rerror("malloc failed while compiling tileset %s", t->name);
+				ts_free_tiles(t);
+				return 0;
+			}
+			t->tiles[r * nc + c] = tile;
+		}
+	}
+	return 1;
+}
+
 int ts_valid_class(const char *clas) {
 	if(strlen(clas) > TS_CLASS_MAXLEN) 
 		return 0;
@@ -349,6 +419,19 @@ int ts_read_all(struct tile_collection *tc, struct json *j) {
 			}
 		}
 		
+#ifndef EDITOR
+		/* The editor can change the mask colour, but the
+			engine can index the tileset, or bake the mask into 
+			the alpha channel and compile the tiles, once they're 
+			loaded. */
+		if(ts_indexed && !ts_index(t))
+			rwarn("Tileset %s has more than 256 colours; It is not indexed", t->name);
+		if(!t->ibm) {
+			re_mask_alpha(t->bm);
+			ts_compile(tc, t);
+		}
+#endif
+		
 		e = e->next;
 	}
 	